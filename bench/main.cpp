@@ -0,0 +1,273 @@
+// sp - string formatting micro-library
+//
+// Written in 2017 by Johan Sköld
+//
+// To the extent possible under law, the author(s) have dedicated all
+// copyright and related and neighboring rights to this software to the public
+// domain worldwide. This software is distributed without any warranty.
+//
+// You should have received a copy of the CC0 Public Domain Dedication along
+// with this software. If not, see <http://creativecommons.org/publicdomain/zero/1.0/>.
+
+#include <chrono> // std::chrono::steady_clock, std::chrono::system_clock
+#include <cstdio> // std::printf, std::snprintf
+#include <cstring> // std::strstr
+#include <ctime> // std::time_t, std::tm, gmtime_r
+#include <ostream> // std::ostream
+#include <thread> // std::thread
+#include <tuple> // std::tuple
+#include <vector> // std::vector
+
+#include "../include/sp.hpp"
+
+enum class State {
+    Idle,
+    Connecting,
+    Open,
+    Draining,
+    Closed,
+};
+
+enum Signal {
+    SIGNAL_NONE = 0,
+    SIGNAL_READ = 1,
+    SIGNAL_WRITE = 2,
+    SIGNAL_HANGUP = 16,
+    SIGNAL_ERROR = 64,
+    SIGNAL_TIMEOUT = 1024,
+};
+
+SP_ENUM(State, Idle, Connecting, Open, Draining, Closed)
+SP_ENUM(Signal, SIGNAL_NONE, SIGNAL_READ, SIGNAL_WRITE, SIGNAL_HANGUP, SIGNAL_ERROR, SIGNAL_TIMEOUT)
+
+/// Stream buffer discarding its output, to measure only the cost of getting
+/// output to it.
+class NullStreambuf : public std::streambuf {
+protected:
+    int_type overflow(int_type ch) override
+    {
+        return traits_type::not_eof(ch);
+    }
+
+    std::streamsize xsputn(const char*, std::streamsize length) override
+    {
+        return length;
+    }
+};
+
+static const char* signal_name(Signal signal)
+{
+    switch (signal) {
+    case SIGNAL_NONE: return "SIGNAL_NONE";
+    case SIGNAL_READ: return "SIGNAL_READ";
+    case SIGNAL_WRITE: return "SIGNAL_WRITE";
+    case SIGNAL_HANGUP: return "SIGNAL_HANGUP";
+    case SIGNAL_ERROR: return "SIGNAL_ERROR";
+    case SIGNAL_TIMEOUT: return "SIGNAL_TIMEOUT";
+    }
+    return "?";
+}
+
+static const char* s_filter = nullptr;
+static volatile int32_t s_sink = 0;
+
+#define BENCH(name, iterations, expr)                                               \
+    for (; !s_filter || std::strstr((name), s_filter);) {                           \
+        const auto start = std::chrono::steady_clock::now();                        \
+        for (int32_t i = 0; i < (iterations); ++i) {                                \
+            s_sink = s_sink + (expr);                                                \
+        }                                                                           \
+        const auto elapsed = std::chrono::steady_clock::now() - start;              \
+        const auto ns = std::chrono::duration<double, std::nano>(elapsed).count();  \
+        std::printf("%-32s %10.1f ns/op\n", (name), ns / (iterations));             \
+        break;                                                                      \
+    }
+
+#if defined(SP_ENABLE_THREADS)
+/// Run `body(i)` `iterations` times in total, split across `threads` threads.
+template <class Body>
+void bench_threads(const char* name, int32_t threads, int32_t iterations, const Body& body)
+{
+    char label[64];
+    std::snprintf(label, sizeof(label), "%s x%d", name, threads);
+
+    if (s_filter && !std::strstr(label, s_filter)) {
+        return;
+    }
+
+    std::vector<std::thread> workers;
+    const auto start = std::chrono::steady_clock::now();
+
+    for (int32_t t = 0; t < threads; ++t) {
+        workers.emplace_back([&, t] {
+            for (int32_t i = t; i < iterations; i += threads) {
+                body(i);
+            }
+        });
+    }
+
+    for (auto& worker : workers) {
+        worker.join();
+    }
+
+    const auto elapsed = std::chrono::steady_clock::now() - start;
+    const auto ns = std::chrono::duration<double, std::nano>(elapsed).count();
+    std::printf("%-32s %10.1f ns/op\n", label, ns / iterations);
+}
+#endif
+
+int main(int argc, char* argv[])
+{
+    static const int32_t N = 1000000;
+    char buffer[256];
+
+    if (argc > 1) {
+        s_filter = argv[1];
+    }
+
+    BENCH("int {}", N, sp::format(buffer, "{}", i));
+    BENCH("int {:d}", N, sp::format(buffer, "{:d}", i));
+    BENCH("int snprintf", N, std::snprintf(buffer, sizeof(buffer), "%d", i));
+    BENCH("int64 {}", N, sp::format(buffer, "{}", int64_t(i) * 1000000007));
+#if defined(SP_HAS_INT128)
+    // below 2^64 * 10^19, so splitting by hand only takes two halves
+    const auto key = (sp::uint128_t(0x7e3779b97f4a7c15ull) << 64) | 0xf39cc0605cedc834ull;
+    BENCH("int128 {}", N, sp::format(buffer, "{}", key + uint64_t(i)));
+    BENCH("int128 manual split", N, ([&] {
+        const auto value = key + uint64_t(i);
+        const auto chunk = 10000000000000000000ull;
+        return sp::format(buffer, "{}{:019}", uint64_t(value / chunk), uint64_t(value % chunk));
+    })());
+    BENCH("int128 {:x}", N, sp::format(buffer, "{:x}", key + uint64_t(i)));
+#endif
+    BENCH("double {}", N, sp::format(buffer, "{}", i * 0.25));
+    BENCH("double snprintf", N, std::snprintf(buffer, sizeof(buffer), "%.15g", i * 0.25));
+    BENCH("price double {:.2f}", N, sp::format(buffer, "{:.2f}", (1000000 + i) * 0.0001));
+    BENCH("price decimal {:.2f}", N, sp::format(buffer, "{:.2f}", sp::decimal(1000000 + i, 4)));
+    BENCH("price decimal {}", N, sp::format(buffer, "{}", sp::decimal(1000000 + i, 4)));
+    BENCH("string {}", N, sp::format(buffer, "{}", "hello"));
+    static const char* const message = "request from \"client\" completed without any errors, see the log for details";
+    BENCH("string {:j} long", N, sp::format(buffer, "{:j}", message));
+    BENCH("string {:csv} long", N, sp::format(buffer, "{:csv}", message));
+    BENCH("bool {}", N, sp::format(buffer, "{}", (i & 1) != 0));
+    BENCH("char {}", N, sp::format(buffer, "{}", char('a' + (i & 15))));
+    BENCH("pointer {}", N, sp::format(buffer, "{}", (void*)buffer));
+    static const Signal signals[] = { SIGNAL_NONE, SIGNAL_READ, SIGNAL_WRITE, SIGNAL_HANGUP, SIGNAL_ERROR, SIGNAL_TIMEOUT };
+    BENCH("enum {} dense", N, sp::format(buffer, "{}", State(i % 5)));
+    BENCH("enum {} sparse", N, sp::format(buffer, "{}", signals[i % 6]));
+    BENCH("enum switch", N, sp::format(buffer, "{}", signal_name(signals[i % 6])));
+    BENCH("enum {:d}", N, sp::format(buffer, "{:d}", State(i % 5)));
+    BENCH("padded int {:>8}", N, sp::format(buffer, "{:>8}", i));
+    BENCH("mixed line", N, sp::format(buffer, "[{}] {} took {} ms ({})", i, "request", i * 0.5, true));
+
+    const auto now = std::chrono::system_clock::now();
+    BENCH("timestamp fields", N, ([&] {
+        const auto t = std::time_t(1488603967 + (i >> 10));
+        std::tm tm;
+        gmtime_r(&t, &tm);
+        return sp::format(buffer, "{:04}-{:02}-{:02} {:02}:{:02}:{:02}.{:03}", tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec, i % 1000);
+    })());
+    BENCH("timestamp chrono", N, sp::format(buffer, "{:%F %T.%L}", now + std::chrono::microseconds(i)));
+
+    const sp::CompiledFormat<int, const char*, double, bool> compiled("[{}] {} took {} ms ({})");
+    BENCH("mixed line compiled", N, ([&] {
+        sp::StringWriter writer(buffer, sizeof(buffer));
+        sp::format(writer, compiled, i, "request", i * 0.5, true);
+        return writer.result();
+    })());
+
+    // a status line where one of five fields changes per redraw
+    static const char* const statusLine = "rx {:>10} tx {:>10} err {:>4} up {:>8.1f}s [{:<8}]";
+    sp::Template<int, int, int, double, const char*> status(statusLine);
+    BENCH("status line format", N, sp::format(buffer, statusLine, i, 123456, 0, 3600.5, "online"));
+    BENCH("status line template", N, int32_t(status.update(i, 123456, 0, 3600.5, "online")));
+
+    static const char* const translated = "{3:>5} | {1} von {0} Dateien in {2:q} kopiert";
+    const sp::StringView catalogKeys[] = { "copied" };
+    const sp::StringView catalogFormats[] = { translated };
+    sp::BufferWriter catalogFile;
+    sp::write_catalog(catalogFile, catalogKeys, catalogFormats, 1);
+    sp::Catalog catalog;
+    sp::CatalogFormat copied;
+    catalog.load(catalogFile.data(), catalogFile.size());
+    catalog.find("copied", &copied);
+    NullStreambuf nullBuffer;
+    std::ostream nullStream(&nullBuffer);
+    sp::OStreamWriter nullWriter(&nullBuffer);
+    BENCH("int line ostream <<", N, ([&] {
+        nullStream << '[' << i << "] " << "request" << " took " << (i >> 3) << " ms (" << (i & 7) << ')';
+        return 0;
+    })());
+    BENCH("int line OStreamWriter", N, ([&] {
+        sp::format(nullWriter, "[{}] {} took {} ms ({})", i, "request", i >> 3, i & 7);
+        return 0;
+    })());
+
+    BENCH("translation reparsed", N, sp::format(buffer, translated, 120, i, "/srv/data", true));
+    BENCH("translation catalog", N, ([&] {
+        sp::StringWriter writer(buffer, sizeof(buffer));
+        sp::format(writer, copied, 120, i, "/srv/data", true);
+        return writer.result();
+    })());
+    BENCH("catalog lookup", N, catalog.find("copied", &copied));
+
+    sp::BufferWriter mirrorA;
+    sp::BufferWriter mirrorB;
+    auto tee = sp::make_tee(mirrorA, mirrorB);
+    auto crc = sp::make_hash_writer<sp::Crc32>(tee);
+    BENCH("mixed line tee+crc32", N, ([&] {
+        mirrorA.clear();
+        mirrorB.clear();
+        sp::format(crc, "[{}] {} took {} ms ({})", i, "request", i * 0.5, true);
+        return int32_t(crc.hash());
+    })());
+
+#if defined(SP_ENABLE_THREADS)
+    // batch formatting scaling, per record; capped at the amount of cores
+    std::vector<std::tuple<int32_t, const char*, double>> records;
+    for (int32_t i = 0; i < N; ++i) {
+        records.emplace_back(i, "request", i * 0.5);
+    }
+
+    for (int32_t threads = 1; threads <= 64; threads *= 2) {
+        char label[64];
+        std::snprintf(label, sizeof(label), "format_parallel x%d", threads);
+
+        if (s_filter && !std::strstr(label, s_filter)) {
+            continue;
+        }
+
+        sp::NullWriter sink;
+        const auto start = std::chrono::steady_clock::now();
+        sp::format_parallel(sink, "[{}] {} took {} ms\n", records, threads);
+        const auto elapsed = std::chrono::steady_clock::now() - start;
+        const auto ns = std::chrono::duration<double, std::nano>(elapsed).count();
+        std::printf("%-32s %10.1f ns/op\n", label, ns / N);
+    }
+
+    std::FILE* null = std::fopen("/dev/null", "wb");
+
+    if (null) {
+        {
+            sp::SharedBuffer shared(null);
+
+            for (int32_t threads = 1; threads <= 8; threads *= 2) {
+                bench_threads("print fragments", threads, N, [&](int32_t i) {
+                    sp::StreamWriter writer(null);
+                    sp::format(writer, "[{}] {} took {} ms\n", i, "request", i * 0.5);
+                });
+                bench_threads("print staged", threads, N, [&](int32_t i) {
+                    sp::format(null, "[{}] {} took {} ms\n", i, "request", i * 0.5);
+                });
+                bench_threads("print shared", threads, N, [&](int32_t i) {
+                    sp::format(shared, "[{}] {} took {} ms\n", i, "request", i * 0.5);
+                });
+            }
+        }
+
+        std::fclose(null);
+    }
+#endif
+
+    return 0;
+}
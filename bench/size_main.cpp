@@ -0,0 +1,36 @@
+// sp - string formatting micro-library
+//
+// Written in 2017 by Johan Sköld
+//
+// To the extent possible under law, the author(s) have dedicated all
+// copyright and related and neighboring rights to this software to the public
+// domain worldwide. This software is distributed without any warranty.
+//
+// You should have received a copy of the CC0 Public Domain Dedication along
+// with this software. If not, see <http://creativecommons.org/publicdomain/zero/1.0/>.
+
+
+// Entry point for the `make size-report` binaries. With
+// `SP_SEPARATE_COMPILATION`, this is also the translation unit compiling the
+// formatting engine.
+
+#define SP_IMPLEMENTATION
+
+#include <cstdint> // int32_t
+
+#include "../include/sp.hpp"
+
+#define SIZE_UNITS(X) X(0) X(1) X(2) X(3) X(4) X(5) X(6) X(7)
+
+#define SIZE_DECLARE(unit) void size_unit_##unit(sp::IWriter& writer, int32_t count, double ratio, const char* name);
+SIZE_UNITS(SIZE_DECLARE)
+
+int main(int argc, char* argv[])
+{
+    sp::BufferWriter writer;
+
+#define SIZE_CALL(unit) size_unit_##unit(writer, argc, 0.5, argv[0]);
+    SIZE_UNITS(SIZE_CALL)
+
+    return writer.size() ? 0 : 1;
+}
@@ -0,0 +1,37 @@
+// sp - string formatting micro-library
+//
+// Written in 2017 by Johan Sköld
+//
+// To the extent possible under law, the author(s) have dedicated all
+// copyright and related and neighboring rights to this software to the public
+// domain worldwide. This software is distributed without any warranty.
+//
+// You should have received a copy of the CC0 Public Domain Dedication along
+// with this software. If not, see <http://creativecommons.org/publicdomain/zero/1.0/>.
+
+
+// One of several translation units formatting a typical mix of arguments, used
+// by `make size-report` to compare inline and separate compilation.
+
+#include <cstdint> // int32_t, uint64_t
+
+#include "../include/sp.hpp"
+
+#define SIZE_CONCAT_(a, b) a##b
+#define SIZE_CONCAT(a, b) SIZE_CONCAT_(a, b)
+
+void SIZE_CONCAT(size_unit_, SIZE_UNIT)(sp::IWriter& writer, int32_t count, double ratio, const char* name)
+{
+    const uint64_t bytes = uint64_t(count) * 4096u;
+
+    sp::format(writer, "unit {} started\n", SIZE_UNIT);
+    sp::format(writer, "{}: {} items ({:.2f}%)\n", name, count, ratio * 100.0);
+    sp::format(writer, "{:>16} {:<8x} {:+d}\n", name, bytes, count - 100);
+    sp::format(writer, "{0} {1} {0}\n", ratio, name);
+    sp::format(writer, "{:{}.{}f}\n", ratio, 12, 3);
+    sp::format(writer, "user={user} id={id}\n", sp::arg("user", name), sp::arg("id", count));
+    sp::format(writer, "{:j} {:q}\n", name, name);
+    sp::format(writer, "{} {} {} {} {}\n", count, bytes, ratio, name, count > 0);
+    sp::format(writer, "{:#b} {:#o} {:#X}\n", count, count, bytes);
+    sp::format(writer, "{:*^20}\n", name);
+}
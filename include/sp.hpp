@@ -14,10 +14,142 @@
 #include <cstdint> // int32_t, uint64_t
 #include <cstdio> // std::snprintf, std::FILE, std::fwrite
 #include <cstring> // std::memcpy
+#include <cstdlib> // std::realloc, std::free, posix_memalign
 #include <cctype> // std::isupper
+#include <chrono> // std::chrono::time_point, std::chrono::duration
 #include <algorithm> // std::min, std::max
 #include <limits> // std::numeric_limits
+#include <memory> // std::unique_ptr
+#include <tuple> // std::tuple, std::get
+#include <type_traits> // std::decay, std::integral_constant
 #include <utility> // std::forward
+#include <vector> // std::vector
+
+#if !defined(_WIN32)
+#include <cerrno> // errno, EINTR
+#include <fcntl.h> // ::open
+#include <sys/mman.h> // ::mmap, ::munmap
+#include <sys/stat.h> // ::fstat
+#include <sys/uio.h> // ::writev, struct iovec
+#include <unistd.h> // ::write, ::close
+#endif
+
+#if defined(__linux__)
+#include <sys/syscall.h> // __NR_io_uring_*
+
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>) && defined(__NR_io_uring_setup)
+#include <linux/io_uring.h> // struct io_uring_params, struct io_uring_sqe, struct io_uring_cqe
+#define SP_HAS_URING 1
+#endif
+#endif
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h> // _mm_loadu_si128, _mm_cmpeq_epi8, _mm_movemask_epi8
+#define SP_HAS_SSE2 1
+
+#if defined(_MSC_VER)
+#include <intrin.h> // _BitScanForward
+#endif
+#endif
+
+#if defined(SP_ENABLE_ZLIB)
+#include <zlib.h> // z_stream, deflateInit2, deflate, deflateEnd
+#endif
+
+#if defined(SP_ENABLE_ZSTD)
+#include <zstd.h> // ZSTD_CCtx, ZSTD_compressStream2
+#endif
+
+#if defined(SP_ENABLE_IOSTREAMS)
+#include <streambuf> // std::streambuf
+#endif
+
+#if defined(SP_ENABLE_THREADS)
+#include <atomic> // std::atomic
+#include <condition_variable> // std::condition_variable
+#include <mutex> // std::mutex, std::unique_lock
+#include <thread> // std::thread
+#endif
+
+// With `SP_SEPARATE_COMPILATION`, the non-template formatting engine is only
+// compiled in the one translation unit that also defines `SP_IMPLEMENTATION`,
+// rather than inline in every translation unit including this header.
+#if defined(SP_SEPARATE_COMPILATION)
+#define SP_ENGINE
+#if defined(SP_IMPLEMENTATION)
+#define SP_DEFINE_ENGINE 1
+#else
+#define SP_DEFINE_ENGINE 0
+#endif
+#else
+#define SP_ENGINE inline
+#define SP_DEFINE_ENGINE 1
+#endif
+
+// The formatting engine is written against any writer type, so that it can
+// also produce `sp::FixedString`s in constant expressions. Those are only
+// `constexpr` from C++17, which allows the loops and lambdas it uses.
+#if __cplusplus >= 201703L || (defined(_MSVC_LANG) && _MSVC_LANG >= 201703L)
+#define SP_HAS_CONSTEXPR 1
+#define SP_CONSTEXPR constexpr
+#else
+#define SP_CONSTEXPR inline
+#endif
+
+// 128-bit integers are formatted natively wherever the compiler provides them.
+#if defined(__SIZEOF_INT128__)
+#define SP_HAS_INT128 1
+#endif
+
+// Per-thread storage. MSVC only supports `thread_local` from 2015, and its
+// `__declspec(thread)` is limited to types without constructors or
+// destructors.
+#if defined(_MSC_VER) && _MSC_VER < 1900
+#define SP_THREAD_LOCAL __declspec(thread)
+#else
+#define SP_THREAD_LOCAL thread_local
+#endif
+
+// Whether a class is `final`. `std::is_final` is C++14, but GCC, Clang and
+// MSVC all provide the intrinsic behind it in C++11 too.
+#if __cplusplus >= 201402L || (defined(_MSVC_LANG) && _MSVC_LANG >= 201402L)
+#define SP_IS_FINAL(T) std::is_final<T>::value
+#else
+#define SP_IS_FINAL(T) __is_final(T)
+#endif
+
+// Scratch space reserved on the stack while formatting. `SP_LOW_STACK`
+// shrinks it for small stacks, such as those of coroutines, at the cost of a
+// heap allocation for float output that doesn't fit (such as `{:.100f}`).
+#if defined(SP_LOW_STACK)
+#define SP_FLOAT_BUFFER_SIZE 64
+#define SP_SCRATCH_BUFFER_SIZE 64
+#else
+#define SP_FLOAT_BUFFER_SIZE 512
+#define SP_SCRATCH_BUFFER_SIZE 256
+#endif
+
+// Limits on what a replacement field can request, so that formatting an
+// untrusted format string takes time and memory proportional to its length
+// and output. Fields exceeding them are invalid, and written as-is. Each can
+// be overridden by defining it before including `sp.hpp`.
+#if !defined(SP_MAX_WIDTH)
+#define SP_MAX_WIDTH 65535
+#endif
+#if !defined(SP_MAX_PRECISION)
+#define SP_MAX_PRECISION 65535
+#endif
+#if !defined(SP_MAX_NESTING)
+#define SP_MAX_NESTING 8
+#endif
+
+#if defined(_MSC_VER)
+#define SP_NOINLINE __declspec(noinline)
+#else
+#define SP_NOINLINE __attribute__((noinline))
+#endif
 
 ///
 // API
@@ -29,6 +161,23 @@ namespace sp {
     struct IWriter {
         /// Write the provided data to the output.
         virtual size_t write(size_t length, const void* data) = 0;
+
+        /// Write the provided data to the output. The data is guaranteed to
+        /// stay alive until the writer is flushed (it is either part of the
+        /// format string, or a string literal), so it may be referenced
+        /// rather than copied. String arguments are always written with
+        /// `write`, as they may be temporaries.
+        virtual size_t write_ref(size_t length, const void* data)
+        {
+            return write(length, data);
+        }
+
+        /// Return whether the writer can no longer accept any output, in
+        /// which case formatting stops early.
+        virtual bool stopped() const
+        {
+            return false;
+        }
     };
 
     /// View into a string.
@@ -37,19 +186,20 @@ namespace sp {
         int32_t length = 0; //< Length of the string.
 
         /// Construct an empty StringView.
-        StringView();
+        constexpr StringView();
 
         /// Construct a StringView from the provided null-terminated string.
         StringView(const char str[]);
 
         /// Construct a StringView from the provided string, with the provided
         /// length (in `char`).
-        StringView(const char str[], int32_t length);
+        constexpr StringView(const char str[], int32_t length);
     };
 
     /// Print to standard out using the provided format with the provided
     /// format arguments. Return the amount of `char`s written, or `-1` in case
-    /// of an error.
+    /// of an error. The message is written with a single `fwrite`, so
+    /// messages printed from different threads never interleave.
     template <class... Args>
     int32_t print(const StringView& fmt, Args&&... args);
 
@@ -60,7 +210,8 @@ namespace sp {
 
     /// Print to the provided FILE stream using the provided format with the
     /// provided format arguments. Return the amount of `char`s written, or
-    /// `-1` in case of an error.
+    /// `-1` in case of an error. Like `print`, the message is written with a
+    /// single `fwrite`.
     template <class... Args>
     int32_t format(std::FILE* file, const StringView& fmt, Args&&... args);
 
@@ -80,6 +231,187 @@ namespace sp {
     template <size_t N, class... Args>
     int32_t format(char (&buffer)[N], const StringView& fmt, Args&&... args);
 
+#if defined(SP_ENABLE_THREADS)
+    class SharedBuffer;
+
+    /// Append the result of formatting the provided arguments with the
+    /// provided format string to the provided shared buffer, as a single
+    /// message. Return the amount of `char`s appended, or `-1` in case of an
+    /// error.
+    template <class... Args>
+    int32_t format(SharedBuffer& buffer, const StringView& fmt, Args&&... args);
+#endif
+
+    /// Result of a formatting call that stops once its output is full.
+    struct TruncatedResult {
+        int32_t length = 0; //< Amount of `char`s written.
+        int32_t position = 0; //< Offset into the format string where formatting stopped.
+        bool truncated = false; //< Whether the output did not fit.
+    };
+
+    /// Print to the provided buffer of the provided size, using the provided
+    /// format string with the provided format arguments. Unlike `format`,
+    /// formatting stops as soon as the buffer is full, rather than counting
+    /// the length of the entire result. If truncated, the result's `position`
+    /// is the offset of the literal text or replacement field in the format
+    /// string that did not fit.
+    template <class... Args>
+    TruncatedResult format_truncated(char buffer[], size_t size, const StringView& fmt, Args&&... args);
+
+    template <class... Args>
+    class FormatCursor;
+
+    /// Create a cursor that produces the result of formatting the provided
+    /// arguments with the provided format string in chunks, through its
+    /// `next` function. The arguments are copied into the cursor, but any
+    /// strings they point to must stay alive while it is in use.
+    ///
+    /// Memory use is constant: literal text is resumed in place, and a field
+    /// that doesn't fit the chunk is kept in a small spill buffer. Fields
+    /// longer than that are formatted again for each further chunk, skipping
+    /// what was already produced, which costs time quadratic in their length
+    /// divided by the chunk size, and requires them to format the same each
+    /// time.
+    template <class... Args>
+    FormatCursor<typename std::decay<Args>::type...> make_cursor(const StringView& fmt, Args&&... args);
+
+    template <class... Args>
+    class CompiledFormat;
+
+    /// Print to the provided writer using the provided compiled format with
+    /// the provided format arguments, which must be convertible to the
+    /// argument types the format was compiled for.
+    template <class... Args, class... Values>
+    void format(IWriter& writer, const CompiledFormat<Args...>& fmt, Values&&... values);
+
+    template <class... Args>
+    class Template;
+
+    class Catalog;
+    struct CatalogFormat;
+
+    /// Write a catalog of the provided formats, keyed by the provided keys,
+    /// to the provided writer. Formats are stored pre-tokenized, with their
+    /// argument indices resolved and their format specs decoded, in a flat
+    /// file that `Catalog` uses without any parsing. Return `false` if a key
+    /// is repeated or the catalog would exceed 4 GiB.
+    bool write_catalog(IWriter& writer, const StringView keys[], const StringView formats[], size_t count);
+
+    /// Print to the provided writer using the provided format from a
+    /// `Catalog`, with the provided format arguments.
+    template <class... Args>
+    void format(IWriter& writer, const CatalogFormat& fmt, Args&&... args);
+
+    /// Print each of the provided records to the provided writer, using the
+    /// provided format string. Records that are `std::tuple`s are expanded
+    /// into separate format arguments. The records are split into chunks
+    /// that are formatted on up to `threads` threads (with
+    /// `SP_ENABLE_THREADS`), but no more than there are cores, and the
+    /// results are written in their original order.
+    template <class T>
+    void format_parallel(IWriter& writer, const StringView& fmt, const T records[], size_t count, int32_t threads);
+
+    /// Print each record of the provided container, which must provide
+    /// `data()` and `size()`. See above.
+    template <class Records>
+    void format_parallel(IWriter& writer, const StringView& fmt, const Records& records, int32_t threads);
+
+    template <class T>
+    struct NamedArg;
+
+    /// Name the provided format argument, so that it may be referred to as
+    /// `{name}` in format strings. The value is referenced rather than
+    /// copied, so it must outlive the formatting call.
+    template <class T>
+    NamedArg<T> arg(const StringView& name, const T& value);
+
+    template <class F>
+    struct Lazy;
+
+    /// Wrap the provided callable, so that it is only called once its
+    /// replacement field is formatted, with its result being formatted in
+    /// its place. It is called every time its field is formatted, and not
+    /// at all if the format string doesn't refer to it.
+    template <class F>
+    Lazy<typename std::decay<F>::type> lazy(F&& func);
+
+    /// Severity of log messages.
+    enum LogLevel {
+        LOGLEVEL_TRACE,
+        LOGLEVEL_DEBUG,
+        LOGLEVEL_INFO,
+        LOGLEVEL_WARNING,
+        LOGLEVEL_ERROR,
+        LOGLEVEL_OFF, //< Only valid as the level of a `Logger`.
+    };
+
+    class Logger;
+
+    /// Formats for records written by `format_structured`.
+    enum RecordFormat {
+        RECORD_JSON, //< `{"key":value,...}`
+        RECORD_LOGFMT, //< `key=value ...`
+    };
+
+    /// Print to `text` using the provided format with the provided format
+    /// arguments, while also writing every replacement field to `record` as
+    /// a key/value pair. Named arguments are keyed by their name, others by
+    /// their index. Each value is only formatted once, for both outputs.
+    template <class... Args>
+    void format_structured(IWriter& text, IWriter& record, RecordFormat recordFormat, const StringView& fmt, Args&&... args);
+
+    struct Decimal;
+
+    /// Make a fixed-point decimal of `mantissa * 10^-scale`, which is
+    /// formatted exactly using integer arithmetic rather than by converting
+    /// it to a float. It supports the `f` and `%` presentations, rounding
+    /// half away from zero, and grouping thousands with `,` or `_`.
+    constexpr Decimal decimal(int64_t mantissa, int32_t scale);
+
+#if defined(SP_HAS_INT128)
+    /// 128-bit integers, formatted like any other integer in every base.
+    /// Only available if the compiler provides `__int128`.
+    __extension__ typedef __int128 int128_t;
+    __extension__ typedef unsigned __int128 uint128_t;
+#endif
+
+    /// Value and name of an enumerator registered with `SP_ENUM`.
+    struct EnumName {
+        long long value; //< Value of the enumerator.
+        StringView name; //< Name of the enumerator.
+    };
+
+    /// Lookup from values to the names of an enum's enumerators, built once
+    /// from its `SP_ENUM` registration.
+    class EnumNames;
+
+    template <size_t N>
+    struct FixedString;
+
+    /// Format the provided arguments with the provided format string into a
+    /// string of up to `N` `char`s, truncating anything beyond that. Only
+    /// built-in types are supported, and named or nested replacement fields
+    /// are written as-is. From C++17, this is `constexpr`, so constant
+    /// arguments other than floats produce the string at compile time.
+    template <size_t N, size_t M, class... Args>
+    SP_CONSTEXPR FixedString<N> format_to_fixed(const char (&fmt)[M], const Args&... args);
+
+#if defined(SP_HAS_CONSTEXPR)
+    /// Return the maximum length of the output of formatting arguments of
+    /// the provided types with the provided `SP_STRING` format string, or
+    /// `-1` if it is unbounded. Strings are only bounded by a precision, as
+    /// in `{:.16}`.
+    template <class... Args, class Fmt>
+    constexpr int32_t max_length(const Fmt& fmt);
+
+    /// Format the provided arguments with the provided `SP_STRING` format
+    /// string into a `FixedString` whose capacity is the `max_length` of the
+    /// format, so that it never truncates. Fails to compile if the length is
+    /// unbounded.
+    template <class Fmt, class... Args>
+    constexpr auto format_fixed(const Fmt& fmt, const Args&... args);
+#endif
+
     /// Provided format functions.
     bool format_value(IWriter& writer, const StringView& fmt, std::nullptr_t);
     bool format_value(IWriter& writer, const StringView& fmt, bool value);
@@ -106,8 +438,137 @@ namespace sp {
     template <class T>
     bool format_value(IWriter& output, const StringView& fmt, T* value);
 
+    /// Two-phase formatter for values of type `T`. `parse` is called once per
+    /// replacement field with its format spec, after which `format` may be
+    /// called any number of times with the parsed state. Specialize it to
+    /// format your own types without re-parsing the format spec on every
+    /// call. By default it falls back to `format_value`.
+    template <class T>
+    struct Formatter;
+
 } // namespace sp
 
+/// Log a message with the provided `sp::Logger` at the provided level,
+/// without evaluating any of the format arguments if the level is disabled.
+/// The logger and level are evaluated once.
+#define SP_LOG(logger, level, ...)                          \
+    do {                                                    \
+        auto& sp_log_logger_ = (logger);                    \
+        const auto sp_log_level_ = (level);                 \
+        if (sp_log_logger_.enabled(sp_log_level_)) {        \
+            sp_log_logger_.log(sp_log_level_, __VA_ARGS__); \
+        }                                                   \
+    } while (0)
+
+#if defined(SP_HAS_CONSTEXPR)
+/// Make a format string whose contents are part of its type, for use with
+/// `sp::max_length` and `sp::format_fixed`.
+#define SP_STRING(str)                                                  \
+    [] {                                                                \
+        struct FormatString {                                           \
+            static constexpr ::sp::StringView view()                    \
+            {                                                           \
+                return ::sp::StringView(str, int32_t(sizeof(str) - 1)); \
+            }                                                           \
+        };                                                              \
+        return FormatString();                                          \
+    }()
+#endif
+
+/// Register the enumerators of the enum `Type`, so that `{}` formats its
+/// values by name, and the integer presentations such as `{:d}` or `{:x}` by
+/// value. Values without a registered name are formatted as integers. Use it
+/// in the global namespace with a qualified `Type`, for up to 64
+/// enumerators: `SP_ENUM(net::State, Idle, Connecting, Open)`.
+#define SP_ENUM(Type, ...)                                                               \
+    namespace sp {                                                                       \
+    template <>                                                                          \
+    struct Formatter<Type> : EnumFormatter<Type> {                                       \
+        static const EnumNames& names()                                                  \
+        {                                                                                \
+            static EnumName entries[] = {                                                \
+                SP_ENUM_ENTRIES(Type, __VA_ARGS__)                                       \
+            };                                                                           \
+            static const EnumNames table(entries, sizeof(entries) / sizeof(entries[0])); \
+            return table;                                                                \
+        }                                                                                \
+    };                                                                                   \
+    }
+
+// `SP_ENUM` helpers, applying `SP_ENUM_ENTRY` to each enumerator. The extra
+// expansions are needed by MSVC's traditional preprocessor.
+#define SP_ENUM_EXPAND(x) x
+#define SP_ENUM_CONCAT(a, b) a##b
+#define SP_ENUM_JOIN(a, b) SP_ENUM_CONCAT(a, b)
+#define SP_ENUM_ENTRY(Type, name) { static_cast<long long>(Type::name), ::sp::StringView(#name, int32_t(sizeof(#name) - 1)) }
+#define SP_ENUM_COUNT_N(_1, _2, _3, _4, _5, _6, _7, _8, _9, _10, _11, _12, _13, _14, _15, _16, _17, _18, _19, _20, _21, _22, _23, _24, _25, _26, _27, _28, _29, _30, _31, _32, _33, _34, _35, _36, _37, _38, _39, _40, _41, _42, _43, _44, _45, _46, _47, _48, _49, _50, _51, _52, _53, _54, _55, _56, _57, _58, _59, _60, _61, _62, _63, _64, n, ...) n
+#define SP_ENUM_COUNT(...) SP_ENUM_EXPAND(SP_ENUM_COUNT_N(__VA_ARGS__, 64, 63, 62, 61, 60, 59, 58, 57, 56, 55, 54, 53, 52, 51, 50, 49, 48, 47, 46, 45, 44, 43, 42, 41, 40, 39, 38, 37, 36, 35, 34, 33, 32, 31, 30, 29, 28, 27, 26, 25, 24, 23, 22, 21, 20, 19, 18, 17, 16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1))
+#define SP_ENUM_ENTRIES(Type, ...) SP_ENUM_EXPAND(SP_ENUM_JOIN(SP_ENUM_ENTRIES_, SP_ENUM_COUNT(__VA_ARGS__))(Type, __VA_ARGS__))
+#define SP_ENUM_ENTRIES_1(Type, name) SP_ENUM_ENTRY(Type, name)
+#define SP_ENUM_ENTRIES_2(Type, name, ...) SP_ENUM_ENTRY(Type, name), SP_ENUM_EXPAND(SP_ENUM_ENTRIES_1(Type, __VA_ARGS__))
+#define SP_ENUM_ENTRIES_3(Type, name, ...) SP_ENUM_ENTRY(Type, name), SP_ENUM_EXPAND(SP_ENUM_ENTRIES_2(Type, __VA_ARGS__))
+#define SP_ENUM_ENTRIES_4(Type, name, ...) SP_ENUM_ENTRY(Type, name), SP_ENUM_EXPAND(SP_ENUM_ENTRIES_3(Type, __VA_ARGS__))
+#define SP_ENUM_ENTRIES_5(Type, name, ...) SP_ENUM_ENTRY(Type, name), SP_ENUM_EXPAND(SP_ENUM_ENTRIES_4(Type, __VA_ARGS__))
+#define SP_ENUM_ENTRIES_6(Type, name, ...) SP_ENUM_ENTRY(Type, name), SP_ENUM_EXPAND(SP_ENUM_ENTRIES_5(Type, __VA_ARGS__))
+#define SP_ENUM_ENTRIES_7(Type, name, ...) SP_ENUM_ENTRY(Type, name), SP_ENUM_EXPAND(SP_ENUM_ENTRIES_6(Type, __VA_ARGS__))
+#define SP_ENUM_ENTRIES_8(Type, name, ...) SP_ENUM_ENTRY(Type, name), SP_ENUM_EXPAND(SP_ENUM_ENTRIES_7(Type, __VA_ARGS__))
+#define SP_ENUM_ENTRIES_9(Type, name, ...) SP_ENUM_ENTRY(Type, name), SP_ENUM_EXPAND(SP_ENUM_ENTRIES_8(Type, __VA_ARGS__))
+#define SP_ENUM_ENTRIES_10(Type, name, ...) SP_ENUM_ENTRY(Type, name), SP_ENUM_EXPAND(SP_ENUM_ENTRIES_9(Type, __VA_ARGS__))
+#define SP_ENUM_ENTRIES_11(Type, name, ...) SP_ENUM_ENTRY(Type, name), SP_ENUM_EXPAND(SP_ENUM_ENTRIES_10(Type, __VA_ARGS__))
+#define SP_ENUM_ENTRIES_12(Type, name, ...) SP_ENUM_ENTRY(Type, name), SP_ENUM_EXPAND(SP_ENUM_ENTRIES_11(Type, __VA_ARGS__))
+#define SP_ENUM_ENTRIES_13(Type, name, ...) SP_ENUM_ENTRY(Type, name), SP_ENUM_EXPAND(SP_ENUM_ENTRIES_12(Type, __VA_ARGS__))
+#define SP_ENUM_ENTRIES_14(Type, name, ...) SP_ENUM_ENTRY(Type, name), SP_ENUM_EXPAND(SP_ENUM_ENTRIES_13(Type, __VA_ARGS__))
+#define SP_ENUM_ENTRIES_15(Type, name, ...) SP_ENUM_ENTRY(Type, name), SP_ENUM_EXPAND(SP_ENUM_ENTRIES_14(Type, __VA_ARGS__))
+#define SP_ENUM_ENTRIES_16(Type, name, ...) SP_ENUM_ENTRY(Type, name), SP_ENUM_EXPAND(SP_ENUM_ENTRIES_15(Type, __VA_ARGS__))
+#define SP_ENUM_ENTRIES_17(Type, name, ...) SP_ENUM_ENTRY(Type, name), SP_ENUM_EXPAND(SP_ENUM_ENTRIES_16(Type, __VA_ARGS__))
+#define SP_ENUM_ENTRIES_18(Type, name, ...) SP_ENUM_ENTRY(Type, name), SP_ENUM_EXPAND(SP_ENUM_ENTRIES_17(Type, __VA_ARGS__))
+#define SP_ENUM_ENTRIES_19(Type, name, ...) SP_ENUM_ENTRY(Type, name), SP_ENUM_EXPAND(SP_ENUM_ENTRIES_18(Type, __VA_ARGS__))
+#define SP_ENUM_ENTRIES_20(Type, name, ...) SP_ENUM_ENTRY(Type, name), SP_ENUM_EXPAND(SP_ENUM_ENTRIES_19(Type, __VA_ARGS__))
+#define SP_ENUM_ENTRIES_21(Type, name, ...) SP_ENUM_ENTRY(Type, name), SP_ENUM_EXPAND(SP_ENUM_ENTRIES_20(Type, __VA_ARGS__))
+#define SP_ENUM_ENTRIES_22(Type, name, ...) SP_ENUM_ENTRY(Type, name), SP_ENUM_EXPAND(SP_ENUM_ENTRIES_21(Type, __VA_ARGS__))
+#define SP_ENUM_ENTRIES_23(Type, name, ...) SP_ENUM_ENTRY(Type, name), SP_ENUM_EXPAND(SP_ENUM_ENTRIES_22(Type, __VA_ARGS__))
+#define SP_ENUM_ENTRIES_24(Type, name, ...) SP_ENUM_ENTRY(Type, name), SP_ENUM_EXPAND(SP_ENUM_ENTRIES_23(Type, __VA_ARGS__))
+#define SP_ENUM_ENTRIES_25(Type, name, ...) SP_ENUM_ENTRY(Type, name), SP_ENUM_EXPAND(SP_ENUM_ENTRIES_24(Type, __VA_ARGS__))
+#define SP_ENUM_ENTRIES_26(Type, name, ...) SP_ENUM_ENTRY(Type, name), SP_ENUM_EXPAND(SP_ENUM_ENTRIES_25(Type, __VA_ARGS__))
+#define SP_ENUM_ENTRIES_27(Type, name, ...) SP_ENUM_ENTRY(Type, name), SP_ENUM_EXPAND(SP_ENUM_ENTRIES_26(Type, __VA_ARGS__))
+#define SP_ENUM_ENTRIES_28(Type, name, ...) SP_ENUM_ENTRY(Type, name), SP_ENUM_EXPAND(SP_ENUM_ENTRIES_27(Type, __VA_ARGS__))
+#define SP_ENUM_ENTRIES_29(Type, name, ...) SP_ENUM_ENTRY(Type, name), SP_ENUM_EXPAND(SP_ENUM_ENTRIES_28(Type, __VA_ARGS__))
+#define SP_ENUM_ENTRIES_30(Type, name, ...) SP_ENUM_ENTRY(Type, name), SP_ENUM_EXPAND(SP_ENUM_ENTRIES_29(Type, __VA_ARGS__))
+#define SP_ENUM_ENTRIES_31(Type, name, ...) SP_ENUM_ENTRY(Type, name), SP_ENUM_EXPAND(SP_ENUM_ENTRIES_30(Type, __VA_ARGS__))
+#define SP_ENUM_ENTRIES_32(Type, name, ...) SP_ENUM_ENTRY(Type, name), SP_ENUM_EXPAND(SP_ENUM_ENTRIES_31(Type, __VA_ARGS__))
+#define SP_ENUM_ENTRIES_33(Type, name, ...) SP_ENUM_ENTRY(Type, name), SP_ENUM_EXPAND(SP_ENUM_ENTRIES_32(Type, __VA_ARGS__))
+#define SP_ENUM_ENTRIES_34(Type, name, ...) SP_ENUM_ENTRY(Type, name), SP_ENUM_EXPAND(SP_ENUM_ENTRIES_33(Type, __VA_ARGS__))
+#define SP_ENUM_ENTRIES_35(Type, name, ...) SP_ENUM_ENTRY(Type, name), SP_ENUM_EXPAND(SP_ENUM_ENTRIES_34(Type, __VA_ARGS__))
+#define SP_ENUM_ENTRIES_36(Type, name, ...) SP_ENUM_ENTRY(Type, name), SP_ENUM_EXPAND(SP_ENUM_ENTRIES_35(Type, __VA_ARGS__))
+#define SP_ENUM_ENTRIES_37(Type, name, ...) SP_ENUM_ENTRY(Type, name), SP_ENUM_EXPAND(SP_ENUM_ENTRIES_36(Type, __VA_ARGS__))
+#define SP_ENUM_ENTRIES_38(Type, name, ...) SP_ENUM_ENTRY(Type, name), SP_ENUM_EXPAND(SP_ENUM_ENTRIES_37(Type, __VA_ARGS__))
+#define SP_ENUM_ENTRIES_39(Type, name, ...) SP_ENUM_ENTRY(Type, name), SP_ENUM_EXPAND(SP_ENUM_ENTRIES_38(Type, __VA_ARGS__))
+#define SP_ENUM_ENTRIES_40(Type, name, ...) SP_ENUM_ENTRY(Type, name), SP_ENUM_EXPAND(SP_ENUM_ENTRIES_39(Type, __VA_ARGS__))
+#define SP_ENUM_ENTRIES_41(Type, name, ...) SP_ENUM_ENTRY(Type, name), SP_ENUM_EXPAND(SP_ENUM_ENTRIES_40(Type, __VA_ARGS__))
+#define SP_ENUM_ENTRIES_42(Type, name, ...) SP_ENUM_ENTRY(Type, name), SP_ENUM_EXPAND(SP_ENUM_ENTRIES_41(Type, __VA_ARGS__))
+#define SP_ENUM_ENTRIES_43(Type, name, ...) SP_ENUM_ENTRY(Type, name), SP_ENUM_EXPAND(SP_ENUM_ENTRIES_42(Type, __VA_ARGS__))
+#define SP_ENUM_ENTRIES_44(Type, name, ...) SP_ENUM_ENTRY(Type, name), SP_ENUM_EXPAND(SP_ENUM_ENTRIES_43(Type, __VA_ARGS__))
+#define SP_ENUM_ENTRIES_45(Type, name, ...) SP_ENUM_ENTRY(Type, name), SP_ENUM_EXPAND(SP_ENUM_ENTRIES_44(Type, __VA_ARGS__))
+#define SP_ENUM_ENTRIES_46(Type, name, ...) SP_ENUM_ENTRY(Type, name), SP_ENUM_EXPAND(SP_ENUM_ENTRIES_45(Type, __VA_ARGS__))
+#define SP_ENUM_ENTRIES_47(Type, name, ...) SP_ENUM_ENTRY(Type, name), SP_ENUM_EXPAND(SP_ENUM_ENTRIES_46(Type, __VA_ARGS__))
+#define SP_ENUM_ENTRIES_48(Type, name, ...) SP_ENUM_ENTRY(Type, name), SP_ENUM_EXPAND(SP_ENUM_ENTRIES_47(Type, __VA_ARGS__))
+#define SP_ENUM_ENTRIES_49(Type, name, ...) SP_ENUM_ENTRY(Type, name), SP_ENUM_EXPAND(SP_ENUM_ENTRIES_48(Type, __VA_ARGS__))
+#define SP_ENUM_ENTRIES_50(Type, name, ...) SP_ENUM_ENTRY(Type, name), SP_ENUM_EXPAND(SP_ENUM_ENTRIES_49(Type, __VA_ARGS__))
+#define SP_ENUM_ENTRIES_51(Type, name, ...) SP_ENUM_ENTRY(Type, name), SP_ENUM_EXPAND(SP_ENUM_ENTRIES_50(Type, __VA_ARGS__))
+#define SP_ENUM_ENTRIES_52(Type, name, ...) SP_ENUM_ENTRY(Type, name), SP_ENUM_EXPAND(SP_ENUM_ENTRIES_51(Type, __VA_ARGS__))
+#define SP_ENUM_ENTRIES_53(Type, name, ...) SP_ENUM_ENTRY(Type, name), SP_ENUM_EXPAND(SP_ENUM_ENTRIES_52(Type, __VA_ARGS__))
+#define SP_ENUM_ENTRIES_54(Type, name, ...) SP_ENUM_ENTRY(Type, name), SP_ENUM_EXPAND(SP_ENUM_ENTRIES_53(Type, __VA_ARGS__))
+#define SP_ENUM_ENTRIES_55(Type, name, ...) SP_ENUM_ENTRY(Type, name), SP_ENUM_EXPAND(SP_ENUM_ENTRIES_54(Type, __VA_ARGS__))
+#define SP_ENUM_ENTRIES_56(Type, name, ...) SP_ENUM_ENTRY(Type, name), SP_ENUM_EXPAND(SP_ENUM_ENTRIES_55(Type, __VA_ARGS__))
+#define SP_ENUM_ENTRIES_57(Type, name, ...) SP_ENUM_ENTRY(Type, name), SP_ENUM_EXPAND(SP_ENUM_ENTRIES_56(Type, __VA_ARGS__))
+#define SP_ENUM_ENTRIES_58(Type, name, ...) SP_ENUM_ENTRY(Type, name), SP_ENUM_EXPAND(SP_ENUM_ENTRIES_57(Type, __VA_ARGS__))
+#define SP_ENUM_ENTRIES_59(Type, name, ...) SP_ENUM_ENTRY(Type, name), SP_ENUM_EXPAND(SP_ENUM_ENTRIES_58(Type, __VA_ARGS__))
+#define SP_ENUM_ENTRIES_60(Type, name, ...) SP_ENUM_ENTRY(Type, name), SP_ENUM_EXPAND(SP_ENUM_ENTRIES_59(Type, __VA_ARGS__))
+#define SP_ENUM_ENTRIES_61(Type, name, ...) SP_ENUM_ENTRY(Type, name), SP_ENUM_EXPAND(SP_ENUM_ENTRIES_60(Type, __VA_ARGS__))
+#define SP_ENUM_ENTRIES_62(Type, name, ...) SP_ENUM_ENTRY(Type, name), SP_ENUM_EXPAND(SP_ENUM_ENTRIES_61(Type, __VA_ARGS__))
+#define SP_ENUM_ENTRIES_63(Type, name, ...) SP_ENUM_ENTRY(Type, name), SP_ENUM_EXPAND(SP_ENUM_ENTRIES_62(Type, __VA_ARGS__))
+#define SP_ENUM_ENTRIES_64(Type, name, ...) SP_ENUM_ENTRY(Type, name), SP_ENUM_EXPAND(SP_ENUM_ENTRIES_63(Type, __VA_ARGS__))
+
 ///
 // Implementation
 ///
@@ -116,10 +577,16 @@ namespace sp {
 
     class StringWriter : public IWriter {
     public:
-        StringWriter(char buffer[], size_t size)
+        /// By default the writer keeps counting once the buffer is full, so
+        /// that `result` is the length of the entire formatted string. If
+        /// `stopWhenFull` is set it instead stops as soon as some output did
+        /// not fit, and `result` is the amount of `char`s actually written.
+        StringWriter(char buffer[], size_t size, bool stopWhenFull = false)
             : m_buffer(buffer)
             , m_size(int32_t(size))
             , m_length(0)
+            , m_stopWhenFull(stopWhenFull)
+            , m_truncated(false)
         {
         }
 
@@ -128,27 +595,44 @@ namespace sp {
             return m_length;
         }
 
+        /// Return whether any output did not fit in the buffer.
+        bool truncated() const
+        {
+            return m_truncated;
+        }
+
         size_t write(size_t length, const void* data) override
         {
-            if (m_length >= 0) {
-                m_length += int32_t(length);
+            if (m_length >= 0 && !stopped()) {
+                const auto toCopy = std::min(size_t(m_size), length);
 
-                if (m_size) {
-                    const auto toCopy = std::min(size_t(m_size), length);
+                if (toCopy) {
                     std::memcpy(m_buffer, data, toCopy);
                     m_buffer += toCopy;
                     m_size -= int32_t(toCopy);
-                    return toCopy;
                 }
+
+                // a length too large for the result is an error
+                const auto counted = m_stopWhenFull ? toCopy : length;
+                m_length = (counted <= size_t(INT32_MAX - m_length)) ? m_length + int32_t(counted) : -1;
+                m_truncated |= toCopy < length;
+                return toCopy;
             }
 
             return 0;
         }
 
+        bool stopped() const override
+        {
+            return m_stopWhenFull && m_truncated;
+        }
+
     private:
         char* m_buffer;
         int32_t m_size;
         int32_t m_length;
+        bool m_stopWhenFull;
+        bool m_truncated;
     };
 
     class StreamWriter : public IWriter {
@@ -181,708 +665,5840 @@ namespace sp {
             return 0;
         }
 
+        bool stopped() const override
+        {
+            return m_length < 0;
+        }
+
     private:
         FILE* m_stream;
         int32_t m_length;
     };
 
-    inline void write_char(IWriter& writer, char ch)
-    {
-        writer.write(1, &ch);
-    }
+#if defined(SP_ENABLE_IOSTREAMS)
+    /// Writer that appends to a `std::streambuf` with `sputn`, skipping the
+    /// sentry and formatting state of `std::ostream`. Use `stream.rdbuf()` to
+    /// write to an existing stream.
+    class OStreamWriter : public IWriter {
+    public:
+        OStreamWriter(std::streambuf* buffer)
+            : m_buffer(buffer)
+            , m_length(0)
+        {
+        }
 
-    inline StringView::StringView() {}
+        int32_t result() const
+        {
+            return m_length;
+        }
 
-    inline StringView::StringView(const char str[])
-        : ptr(str)
-        , length(str ? int32_t(std::strlen(str)) : 0)
-    {
-    }
+        size_t write(size_t length, const void* data) override
+        {
+            if (m_length >= 0) {
+                const auto written = m_buffer->sputn(static_cast<const char*>(data), std::streamsize(length));
 
-    inline StringView::StringView(const char str[], int32_t length)
-        : ptr(str)
-        , length(length)
-    {
-    }
+                if (written == std::streamsize(length)) {
+                    m_length += int32_t(written);
+                } else {
+                    m_length = -1;
+                }
 
-    struct FormatFlags {
-        char fill = 0;
-        char align = 0;
-        char sign = 0;
-        bool alternate = false;
-        int32_t width = -1;
-        int32_t precision = -1;
-        char type = 0;
-    };
+                return size_t(std::max(written, std::streamsize(0)));
+            }
 
-    inline bool parse_format(const StringView& fmt, FormatFlags* flags)
-    {
-        enum State {
-            STATE_ALIGN,
-            STATE_SIGN,
-            STATE_ALTERNATE,
-            STATE_WIDTH,
-            STATE_PRECISION,
-            STATE_TYPE,
-            STATE_DONE,
-        };
+            return 0;
+        }
 
-        auto state = STATE_ALIGN;
-        auto next = fmt.ptr;
-        auto term = fmt.ptr + fmt.length;
-        *flags = FormatFlags{};
+        bool stopped() const override
+        {
+            return m_length < 0;
+        }
 
-        while (next < term) {
-            const auto ptr = next++;
-            const auto ch = *ptr;
+    private:
+        std::streambuf* m_buffer;
+        int32_t m_length;
+    };
 
-            switch (state) {
-            case STATE_ALIGN: {
-                const auto isAlign = [](char ch) {
-                    return (ch >= '<' && ch <= '>') || ch == '^';
-                };
+    /// Stream buffer that passes the output of a `std::ostream` on to a
+    /// writer, as in `std::ostream out(&buffer)`, for code still written
+    /// against iostreams. Small writes are collected until the buffer fills
+    /// up, the stream is flushed, or the stream buffer is destroyed.
+    class WriterStreambuf : public std::streambuf {
+    public:
+        WriterStreambuf(IWriter& writer)
+            : m_writer(writer)
+        {
+            setp(m_buffer, m_buffer + BUFFER_SIZE);
+        }
 
-                if (next < term && isAlign(*next)) {
-                    flags->fill = ch;
-                    flags->align = *next++;
-                } else if (isAlign(ch)) {
-                    flags->align = ch;
-                } else {
-                    --next;
-                }
+        WriterStreambuf(const WriterStreambuf&) = delete;
+        WriterStreambuf& operator=(const WriterStreambuf&) = delete;
 
-                state = STATE_SIGN;
-                break;
+        ~WriterStreambuf()
+        {
+            flush_buffer();
+        }
+
+    protected:
+        int_type overflow(int_type ch) override
+        {
+            if (!flush_buffer()) {
+                return traits_type::eof();
             }
 
-            case STATE_SIGN:
-                switch (ch) {
-                case '+':
-                case '-':
-                case ' ':
-                    flags->sign = ch;
-                    break;
-                default:
-                    --next;
-                    break;
-                }
-                state = STATE_ALTERNATE;
-                break;
+            if (!traits_type::eq_int_type(ch, traits_type::eof())) {
+                *pptr() = traits_type::to_char_type(ch);
+                pbump(1);
+            }
 
-            case STATE_ALTERNATE:
-                if (ch == '#') {
-                    flags->alternate = true;
-                } else {
-                    --next;
-                }
-                state = STATE_WIDTH;
-                break;
+            return traits_type::not_eof(ch);
+        }
 
-            case STATE_WIDTH:
-                if (ch >= '0' && ch <= '9') {
-                    if (flags->width < 0) {
-                        if (ch == '0') {
-                            flags->fill = flags->fill ? flags->fill : '0';
-                            flags->align = flags->align ? flags->align : '=';
-                        }
-                        flags->width = 0;
-                    }
-                    flags->width = (flags->width * 10) + (ch - '0');
-                } else {
-                    state = STATE_PRECISION;
-                    --next;
-                }
-                break;
+        std::streamsize xsputn(const char* data, std::streamsize length) override
+        {
+            // writes that don't fit are passed on directly, rather than
+            // being split over several buffer flushes
+            if (length <= epptr() - pptr()) {
+                traits_type::copy(pptr(), data, size_t(length));
+                pbump(int(length));
+                return length;
+            }
 
-            case STATE_PRECISION: {
-                const auto isDigit = [](char ch) {
-                    return ch >= '0' && ch <= '9';
-                };
+            if (!flush_buffer() || m_writer.stopped()) {
+                return 0;
+            }
 
-                if (ch == '.') {
-                    const char nextCh = (next < term) ? *next : 0;
+            return std::streamsize(m_writer.write(size_t(length), data));
+        }
 
-                    if (flags->precision < 0 && isDigit(nextCh)) {
-                        flags->precision = 0;
-                        continue;
-                    }
-                } else if (isDigit(ch)) {
-                    if (flags->precision >= 0) {
-                        flags->precision = (flags->precision * 10) + (ch - '0');
-                        continue;
-                    }
-                }
+        int sync() override
+        {
+            return flush_buffer() ? 0 : -1;
+        }
 
-                state = STATE_TYPE;
-                --next;
-                break;
-            }
+    private:
+        enum {
+            BUFFER_SIZE = 512,
+        };
 
-            case STATE_TYPE:
-                switch (ch) {
-                case 'b':
-                case 'd':
-                case 'c':
-                case 'e':
-                case 'E':
-                case 'f':
-                case 'F':
-                case 'g':
-                case 'G':
-                case 'o':
-                case 's':
-                case 'x':
-                case 'X':
-                case '%':
-                    flags->type = ch;
-                    break;
-                default:
-                    --next;
-                    break;
-                }
-                state = STATE_DONE;
-                break;
+        bool flush_buffer()
+        {
+            const auto length = size_t(pptr() - pbase());
 
-            case STATE_DONE:
-                // if we get here, it means there's stuff in there after the
-                // flags, in which case we should fail.
-                return false;
+            if (!length) {
+                return !m_writer.stopped();
             }
+
+            setp(m_buffer, m_buffer + BUFFER_SIZE);
+            return m_writer.write(length, m_buffer) == length && !m_writer.stopped();
         }
 
-        return true;
-    }
+        IWriter& m_writer;
+        char m_buffer[BUFFER_SIZE];
+    };
+#endif
 
-    inline bool format_int(IWriter& writer, const FormatFlags& flags, bool isNegative, uint64_t value)
-    {
-        // determine base
-        int32_t base = 10;
+    /// Writer that appends to a heap allocated buffer, growing it as needed.
+    class BufferWriter : public IWriter {
+    public:
+        BufferWriter()
+            : m_data(nullptr)
+            , m_size(0)
+            , m_capacity(0)
+            , m_failed(false)
+        {
+        }
 
-        switch (flags.type) {
-        case 'b':
-            base = 2;
-            break;
-        case 'o':
-            base = 8;
-            break;
-        case 'c':
+        BufferWriter(const BufferWriter&) = delete;
+        BufferWriter& operator=(const BufferWriter&) = delete;
+
+        ~BufferWriter()
+        {
+            std::free(m_data);
+        }
+
+        int32_t result() const
+        {
+            return m_failed ? -1 : int32_t(m_size);
+        }
+
+        const char* data() const
+        {
+            return m_data;
+        }
+
+        size_t size() const
+        {
+            return m_size;
+        }
+
+        /// Discard the contents, keeping the allocated memory for reuse.
+        void clear()
+        {
+            m_size = 0;
+            m_failed = false;
+        }
+
+        size_t write(size_t length, const void* data) override
+        {
+            if (m_failed) {
+                return 0;
+            }
+
+            if (m_size + length > m_capacity) {
+                const auto capacity = std::max(m_size + length, m_capacity * 2);
+                const auto grown = (char*)std::realloc(m_data, capacity);
+
+                if (!grown) {
+                    m_failed = true;
+                    return 0;
+                }
+
+                m_data = grown;
+                m_capacity = capacity;
+            }
+
+            if (length) {
+                std::memcpy(m_data + m_size, data, length);
+                m_size += length;
+            }
+
+            return length;
+        }
+
+        bool stopped() const override
+        {
+            return m_failed;
+        }
+
+    private:
+        char* m_data;
+        size_t m_size;
+        size_t m_capacity;
+        bool m_failed;
+    };
+
+    /// Per-thread buffer in which messages are staged before being written
+    /// in one go.
+    struct StagingBuffer {
+        BufferWriter writer;
+        bool inUse = false;
+    };
+
+    inline StagingBuffer& staging_buffer()
+    {
+        // not `SP_THREAD_LOCAL`, as the buffer owns memory that must be freed
+        // when the thread exits, which `__declspec(thread)` can't do
+        static thread_local StagingBuffer buffer;
+        return buffer;
+    }
+
+#if defined(SP_ENABLE_THREADS)
+    /// Buffer that messages from any amount of threads are appended to
+    /// without taking a lock, and that is written to a FILE stream in
+    /// batches. A message is only ever written as a whole, and is written
+    /// once the buffer is full, `flush` is called, or the buffer is
+    /// destroyed. Messages larger than the buffer are written directly.
+    class SharedBuffer {
+    public:
+        /// Reservations are counted in 32 bits, next to a generation count.
+        /// Every thread appending to or flushing a full buffer overshoots it
+        /// by at most `capacity + 1` until it is drained, so the capacity is
+        /// limited for that to never carry into the generation with up to
+        /// `MAX_THREADS` threads using the buffer at once.
+        static const size_t MAX_THREADS = 1023;
+        static const size_t MAX_CAPACITY = 4 * 1024 * 1024 - 1;
+
+        static_assert((uint64_t(MAX_THREADS) + 1) * (uint64_t(MAX_CAPACITY) + 1) - 1 <= UINT32_MAX,
+            "reservations by all threads must fit in 32 bits");
+
+        SharedBuffer(std::FILE* stream, size_t capacity = 64 * 1024)
+            : m_stream(stream)
+            , m_data((char*)std::malloc(capacity))
+            , m_capacity(m_data ? uint32_t(std::min(capacity, size_t(MAX_CAPACITY))) : 0)
+            , m_state(0)
+            , m_committed(0)
+            , m_failed(false)
+        {
+        }
+
+        SharedBuffer(const SharedBuffer&) = delete;
+        SharedBuffer& operator=(const SharedBuffer&) = delete;
+
+        ~SharedBuffer()
+        {
+            flush();
+            std::free(m_data);
+        }
+
+        /// Return whether any write to the stream failed.
+        bool failed() const
+        {
+            return m_failed.load();
+        }
+
+        /// Append a message, returning whether it was accepted.
+        bool append(size_t length, const void* data)
+        {
+            if (length > m_capacity) {
+                flush();
+                return write_stream(data, length);
+            }
+
+            for (;;) {
+                // the low half of the state is the amount of reserved bytes,
+                // and the high half the generation, bumped by every flush
+                const auto state = m_state.fetch_add(length);
+                const auto offset = uint32_t(state);
+
+                if (offset + length <= m_capacity) {
+                    std::memcpy(m_data + offset, data, length);
+                    m_committed.fetch_add(uint32_t(length));
+                    return true;
+                }
+
+                if (offset <= m_capacity) {
+                    // first to overflow the buffer, so this thread flushes it
+                    drain(state);
+                } else {
+                    wait_for_drain(state);
+                }
+            }
+        }
+
+        /// Write everything appended so far to the stream.
+        void flush()
+        {
+            // reserving more than the capacity forces a flush
+            const auto state = m_state.fetch_add(uint64_t(m_capacity) + 1);
+
+            if (uint32_t(state) <= m_capacity) {
+                drain(state);
+            } else {
+                wait_for_drain(state);
+            }
+
+            std::fflush(m_stream);
+        }
+
+    private:
+        bool write_stream(const void* data, size_t length)
+        {
+            if (std::fwrite(data, 1, length, m_stream) != length) {
+                m_failed.store(true);
+                return false;
+            }
+
+            return true;
+        }
+
+        void drain(uint64_t state)
+        {
+            const auto offset = uint32_t(state);
+
+            // wait for the threads that reserved space before us
+            while (m_committed.load() != offset) {
+                std::this_thread::yield();
+            }
+
+            if (offset) {
+                write_stream(m_data, offset);
+            }
+
+            m_committed.store(0);
+            m_state.store(((state >> 32) + 1) << 32);
+        }
+
+        void wait_for_drain(uint64_t state)
+        {
+            while ((m_state.load() >> 32) == (state >> 32)) {
+                std::this_thread::yield();
+            }
+        }
+
+        std::FILE* m_stream;
+        char* m_data;
+        uint32_t m_capacity;
+        std::atomic<uint64_t> m_state;
+        std::atomic<uint32_t> m_committed;
+        std::atomic<bool> m_failed;
+    };
+#endif
+
+#if !defined(_WIN32)
+    /// Writer for raw file descriptors. Rather than copying everything into a
+    /// buffer, it collects `iovec` segments that reference the format string
+    /// directly, and only copies arguments and generated data (digits,
+    /// padding, etc) into a small arena. Everything is written with a single
+    /// `writev` per flush, so referenced data must stay alive until then.
+    class FdWriter : public IWriter {
+    public:
+        FdWriter(int fd)
+            : m_fd(fd)
+            , m_nsegments(0)
+            , m_arenaUsed(0)
+            , m_length(0)
+        {
+        }
+
+        FdWriter(const FdWriter&) = delete;
+        FdWriter& operator=(const FdWriter&) = delete;
+
+        ~FdWriter()
+        {
+            flush();
+        }
+
+        int32_t result() const
+        {
+            return m_length;
+        }
+
+        size_t write(size_t length, const void* data) override
+        {
+            if (m_length < 0 || !length) {
+                return 0;
+            }
+
+            // make room up front, as flushing resets the arena
+            const bool isFull = length > size_t(ARENA_SIZE - m_arenaUsed)
+                || m_nsegments == MAX_SEGMENTS;
+
+            if (isFull && !flush()) {
+                return 0;
+            }
+
+            // too big for the arena; since the data is only guaranteed to be
+            // valid for this call, write it out immediately
+            if (length > size_t(ARENA_SIZE)) {
+                push_segment(length, data);
+                return flush() ? length : 0;
+            }
+
+            char* dest = m_arena + m_arenaUsed;
+            std::memcpy(dest, data, length);
+            m_arenaUsed += int32_t(length);
+            return push_segment(length, dest) ? length : 0;
+        }
+
+        size_t write_ref(size_t length, const void* data) override
+        {
+            // small slices are cheaper to copy than to spend a segment on
+            if (length < size_t(MIN_REF_SIZE)) {
+                return write(length, data);
+            }
+
+            return (m_length >= 0 && push_segment(length, data)) ? length : 0;
+        }
+
+        /// Write all pending segments to the file descriptor. Return `false`
+        /// in case of an error.
+        bool flush()
+        {
+            struct iovec* iov = m_segments;
+            int count = m_nsegments;
+
+            while (count > 0 && m_length >= 0) {
+                const auto written = ::writev(m_fd, iov, count);
+
+                if (written < 0) {
+                    if (errno != EINTR) {
+                        m_length = -1;
+                    }
+                    continue;
+                }
+
+                // skip past what was written, which may be a partial segment
+                auto remaining = size_t(written);
+
+                while (count && remaining >= iov->iov_len) {
+                    remaining -= iov->iov_len;
+                    ++iov;
+                    --count;
+                }
+
+                if (count) {
+                    iov->iov_base = (char*)iov->iov_base + remaining;
+                    iov->iov_len -= remaining;
+                }
+            }
+
+            m_nsegments = 0;
+            m_arenaUsed = 0;
+            return m_length >= 0;
+        }
+
+        bool stopped() const override
+        {
+            return m_length < 0;
+        }
+
+    private:
+        enum {
+            MAX_SEGMENTS = 64,
+            ARENA_SIZE = 512,
+            MIN_REF_SIZE = 16,
+        };
+
+        bool push_segment(size_t length, const void* data)
+        {
+            // extend the previous segment if this one directly follows it
+            if (m_nsegments) {
+                auto& prev = m_segments[m_nsegments - 1];
+
+                if ((const char*)prev.iov_base + prev.iov_len == data) {
+                    prev.iov_len += length;
+                    m_length += int32_t(length);
+                    return true;
+                }
+            }
+
+            if (m_nsegments == MAX_SEGMENTS && !flush()) {
+                return false;
+            }
+
+            auto& segment = m_segments[m_nsegments++];
+            segment.iov_base = const_cast<void*>(data);
+            segment.iov_len = length;
+            m_length += int32_t(length);
+            return true;
+        }
+
+        struct iovec m_segments[MAX_SEGMENTS];
+        char m_arena[ARENA_SIZE];
+        int m_fd;
+        int32_t m_nsegments;
+        int32_t m_arenaUsed;
+        int32_t m_length;
+    };
+#endif
+
+#if defined(__linux__)
+    /// Writer that asynchronously writes to a file, so formatting does not
+    /// block on storage. Output is gathered into a bounded set of buffers.
+    /// Once a buffer is full it is submitted, and formatting continues into
+    /// the next one while earlier ones are in flight. Submission goes through
+    /// io_uring with registered buffers where available, and otherwise falls
+    /// back to `pwrite` on worker threads (or inline, without
+    /// `SP_ENABLE_THREADS`). Files opened with `O_APPEND` keep one write in
+    /// flight at a time, so that appends land in order.
+    class AsyncFileWriter : public IWriter {
+    public:
+        enum Backend {
+            BACKEND_URING,
+            BACKEND_PWRITE,
+        };
+
+        AsyncFileWriter(int fd, int64_t offset = 0, Backend backend = BACKEND_URING)
+            : m_fd(fd)
+            , m_backend(BACKEND_PWRITE)
+            , m_memory(nullptr)
+            , m_current(0)
+            , m_used(0)
+            , m_offset(offset)
+            , m_length(0)
+            , m_error(false)
+        {
+            // with `O_APPEND` the kernel ignores the offsets and appends in the
+            // order the writes are issued, so only one may be in flight
+            const int flags = ::fcntl(fd, F_GETFL);
+            m_isAppend = flags >= 0 && (flags & O_APPEND);
+
+            for (int i = 0; i < BUFFER_COUNT; ++i) {
+                m_inFlight[i] = false;
+            }
+
+            void* memory = nullptr;
+
+            if (posix_memalign(&memory, 4096, size_t(BUFFER_COUNT) * BUFFER_SIZE)) {
+                m_error = true;
+                return;
+            }
+
+            m_memory = (char*)memory;
+
+#if defined(SP_HAS_URING)
+            if (backend == BACKEND_URING && uring_init()) {
+                m_backend = BACKEND_URING;
+                return;
+            }
+#else
+            (void)backend;
+#endif
+
+#if defined(SP_ENABLE_THREADS)
+            m_queueHead = 0;
+            m_queueSize = 0;
+            m_stopping = false;
+            m_workerError = false;
+            m_workerCount = m_isAppend ? 1 : WORKER_COUNT;
+
+            for (int i = 0; i < m_workerCount; ++i) {
+                m_workers[i] = std::thread([this] { pwrite_worker(); });
+            }
+#endif
+        }
+
+        ~AsyncFileWriter()
+        {
+            flush();
+
+#if defined(SP_HAS_URING)
+            if (m_backend == BACKEND_URING) {
+                uring_destroy();
+            }
+#endif
+
+#if defined(SP_ENABLE_THREADS)
+            if (m_backend == BACKEND_PWRITE && m_memory) {
+                {
+                    std::unique_lock<std::mutex> lock(m_mutex);
+                    m_stopping = true;
+                }
+
+                m_cond.notify_all();
+
+                for (int i = 0; i < m_workerCount; ++i) {
+                    m_workers[i].join();
+                }
+            }
+#endif
+
+            std::free(m_memory);
+        }
+
+        /// Return the amount of `char`s written, or `-1` in case of an error.
+        int64_t result() const
+        {
+            return m_error ? -1 : m_length;
+        }
+
+        /// Return the backend in use, which may differ from the requested one
+        /// if io_uring is unavailable.
+        Backend backend() const
+        {
+            return m_backend;
+        }
+
+        size_t write(size_t length, const void* data) override
+        {
+            auto src = (const char*)data;
+            auto remaining = length;
+
+            while (remaining && !m_error) {
+                const auto toCopy = std::min(remaining, size_t(BUFFER_SIZE - m_used));
+                std::memcpy(buffer(m_current) + m_used, src, toCopy);
+                m_used += int32_t(toCopy);
+                src += toCopy;
+                remaining -= toCopy;
+
+                if (m_used == BUFFER_SIZE) {
+                    submit_current();
+                }
+            }
+
+            m_length += int64_t(length - remaining);
+            return length - remaining;
+        }
+
+        /// Submit any buffered output and wait for all writes to complete.
+        /// Return `false` in case of an error.
+        bool flush()
+        {
+            if (m_used && !m_error) {
+                submit_current();
+            }
+
+            for (int i = 0; i < BUFFER_COUNT; ++i) {
+                wait(i);
+            }
+
+            return !m_error;
+        }
+
+        bool stopped() const override
+        {
+            return m_error;
+        }
+
+    private:
+        enum {
+            BUFFER_COUNT = 4,
+            BUFFER_SIZE = 64 * 1024,
+            WORKER_COUNT = 2,
+        };
+
+        char* buffer(int index)
+        {
+            return m_memory + size_t(index) * BUFFER_SIZE;
+        }
+
+        void submit_current()
+        {
+            const auto index = m_current;
+            m_sizes[index] = m_used;
+            m_offsets[index] = m_offset;
+            m_offset += m_used;
+
+#if defined(SP_HAS_URING)
+            if (m_backend == BACKEND_URING) {
+                if (m_isAppend) {
+                    wait((index + BUFFER_COUNT - 1) % BUFFER_COUNT);
+                }
+
+                m_inFlight[index] = true;
+                m_done[index] = 0;
+                uring_submit(index);
+            } else
+#endif
+            {
+#if defined(SP_ENABLE_THREADS)
+                std::unique_lock<std::mutex> lock(m_mutex);
+                m_inFlight[index] = true;
+                m_queue[(m_queueHead + m_queueSize++) % BUFFER_COUNT] = index;
+                lock.unlock();
+                m_cond.notify_all();
+#else
+                m_error |= !pwrite_all(index);
+#endif
+            }
+
+            // formatting continues in the next buffer, once it's available
+            m_current = (m_current + 1) % BUFFER_COUNT;
+            m_used = 0;
+            wait(m_current);
+        }
+
+        void wait(int index)
+        {
+#if defined(SP_HAS_URING)
+            if (m_backend == BACKEND_URING) {
+                while (m_inFlight[index]) {
+                    uring_reap();
+                }
+                return;
+            }
+#endif
+
+#if defined(SP_ENABLE_THREADS)
+            std::unique_lock<std::mutex> lock(m_mutex);
+
+            while (m_inFlight[index]) {
+                m_cond.wait(lock);
+            }
+
+            m_error |= m_workerError;
+#else
+            (void)index;
+#endif
+        }
+
+        bool pwrite_all(int index)
+        {
+            const char* data = buffer(index);
+            size_t remaining = size_t(m_sizes[index]);
+            auto offset = m_offsets[index];
+
+            while (remaining) {
+                const auto written = ::pwrite(m_fd, data, remaining, off_t(offset));
+
+                if (written < 0) {
+                    if (errno == EINTR) {
+                        continue;
+                    }
+                    return false;
+                }
+
+                data += written;
+                offset += written;
+                remaining -= size_t(written);
+            }
+
+            return true;
+        }
+
+#if defined(SP_ENABLE_THREADS)
+        void pwrite_worker()
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+
+            for (;;) {
+                while (!m_queueSize && !m_stopping) {
+                    m_cond.wait(lock);
+                }
+
+                if (!m_queueSize) {
+                    return;
+                }
+
+                const auto index = m_queue[m_queueHead];
+                m_queueHead = (m_queueHead + 1) % BUFFER_COUNT;
+                --m_queueSize;
+
+                lock.unlock();
+                const bool success = pwrite_all(index);
+                lock.lock();
+
+                m_workerError |= !success;
+                m_inFlight[index] = false;
+                m_cond.notify_all();
+            }
+        }
+#endif
+
+#if defined(SP_HAS_URING)
+        bool uring_init()
+        {
+            io_uring_params params;
+            std::memset(&params, 0, sizeof(params));
+
+            m_ring = int(syscall(__NR_io_uring_setup, BUFFER_COUNT, &params));
+
+            if (m_ring < 0) {
+                return false;
+            }
+
+            m_sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+            m_cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+            m_sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+
+            if (params.features & IORING_FEAT_SINGLE_MMAP) {
+                m_sqRingSize = m_cqRingSize = std::max(m_sqRingSize, m_cqRingSize);
+            }
+
+            m_sqRing = ::mmap(nullptr, m_sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_ring, IORING_OFF_SQ_RING);
+            m_cqRing = (params.features & IORING_FEAT_SINGLE_MMAP)
+                ? m_sqRing
+                : ::mmap(nullptr, m_cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_ring, IORING_OFF_CQ_RING);
+            void* sqes = ::mmap(nullptr, m_sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_ring, IORING_OFF_SQES);
+
+            // registering the buffers saves the kernel from mapping them on
+            // every write
+            iovec iovecs[BUFFER_COUNT];
+
+            for (int i = 0; i < BUFFER_COUNT; ++i) {
+                iovecs[i].iov_base = buffer(i);
+                iovecs[i].iov_len = BUFFER_SIZE;
+            }
+
+            const bool isMapped = m_sqRing != MAP_FAILED && m_cqRing != MAP_FAILED && sqes != MAP_FAILED;
+
+            if (!isMapped || syscall(__NR_io_uring_register, m_ring, IORING_REGISTER_BUFFERS, iovecs, BUFFER_COUNT) < 0) {
+                m_sqes = (sqes != MAP_FAILED) ? (io_uring_sqe*)sqes : nullptr;
+                uring_destroy();
+                return false;
+            }
+
+            auto sq = (char*)m_sqRing;
+            auto cq = (char*)m_cqRing;
+            m_sqes = (io_uring_sqe*)sqes;
+            m_sqTail = (unsigned*)(sq + params.sq_off.tail);
+            m_sqMask = (unsigned*)(sq + params.sq_off.ring_mask);
+            m_sqArray = (unsigned*)(sq + params.sq_off.array);
+            m_cqHead = (unsigned*)(cq + params.cq_off.head);
+            m_cqTail = (unsigned*)(cq + params.cq_off.tail);
+            m_cqMask = (unsigned*)(cq + params.cq_off.ring_mask);
+            m_cqes = (io_uring_cqe*)(cq + params.cq_off.cqes);
+            return true;
+        }
+
+        void uring_destroy()
+        {
+            if (m_sqes) {
+                ::munmap(m_sqes, m_sqesSize);
+            }
+            if (m_cqRing != MAP_FAILED && m_cqRing != m_sqRing) {
+                ::munmap(m_cqRing, m_cqRingSize);
+            }
+            if (m_sqRing != MAP_FAILED) {
+                ::munmap(m_sqRing, m_sqRingSize);
+            }
+
+            ::close(m_ring);
+        }
+
+        void uring_submit(int index)
+        {
+            // there are as many entries as buffers, so there is always room
+            const auto tail = *m_sqTail;
+            const auto slot = tail & *m_sqMask;
+            const auto done = size_t(m_done[index]);
+
+            auto& sqe = m_sqes[slot];
+            std::memset(&sqe, 0, sizeof(sqe));
+            sqe.opcode = IORING_OP_WRITE_FIXED;
+            sqe.fd = m_fd;
+            sqe.addr = uint64_t(buffer(index) + done);
+            sqe.len = unsigned(m_sizes[index] - done);
+            sqe.off = uint64_t(m_offsets[index] + done);
+            sqe.buf_index = uint16_t(index);
+            sqe.user_data = uint64_t(index);
+
+            m_sqArray[slot] = slot;
+            __atomic_store_n(m_sqTail, tail + 1, __ATOMIC_RELEASE);
+
+            while (syscall(__NR_io_uring_enter, m_ring, 1, 0, 0, nullptr, 0) < 0) {
+                if (errno != EINTR && errno != EAGAIN) {
+                    m_error = true;
+                    m_inFlight[index] = false;
+                    return;
+                }
+            }
+        }
+
+        void uring_reap()
+        {
+            auto head = *m_cqHead;
+
+            if (head == __atomic_load_n(m_cqTail, __ATOMIC_ACQUIRE)) {
+                if (syscall(__NR_io_uring_enter, m_ring, 0, 1, IORING_ENTER_GETEVENTS, nullptr, 0) < 0 && errno != EINTR) {
+                    m_error = true;
+                    std::fill(m_inFlight, m_inFlight + BUFFER_COUNT, false);
+                }
+                return;
+            }
+
+            do {
+                const auto& cqe = m_cqes[head & *m_cqMask];
+                const auto index = int(cqe.user_data);
+                const auto res = cqe.res;
+                __atomic_store_n(m_cqHead, ++head, __ATOMIC_RELEASE);
+
+                if (res == -EINTR || res == -EAGAIN) {
+                    uring_submit(index);
+                } else if (res <= 0) {
+                    m_error = true;
+                    m_inFlight[index] = false;
+                } else if ((m_done[index] += res) < m_sizes[index]) {
+                    // short write, submit the remainder
+                    uring_submit(index);
+                } else {
+                    m_inFlight[index] = false;
+                }
+            } while (head != __atomic_load_n(m_cqTail, __ATOMIC_ACQUIRE));
+        }
+
+        int m_ring;
+        void* m_sqRing;
+        void* m_cqRing;
+        io_uring_sqe* m_sqes;
+        size_t m_sqRingSize;
+        size_t m_cqRingSize;
+        size_t m_sqesSize;
+        unsigned* m_sqTail;
+        unsigned* m_sqMask;
+        unsigned* m_sqArray;
+        unsigned* m_cqHead;
+        unsigned* m_cqTail;
+        unsigned* m_cqMask;
+        io_uring_cqe* m_cqes;
+        int32_t m_done[BUFFER_COUNT];
+#endif
+
+#if defined(SP_ENABLE_THREADS)
+        std::mutex m_mutex;
+        std::condition_variable m_cond;
+        std::thread m_workers[WORKER_COUNT];
+        int m_queue[BUFFER_COUNT];
+        int m_queueHead;
+        int m_queueSize;
+        int m_workerCount;
+        bool m_stopping;
+        bool m_workerError;
+#endif
+
+        int m_fd;
+        Backend m_backend;
+        char* m_memory;
+        int m_current;
+        int32_t m_used;
+        int32_t m_sizes[BUFFER_COUNT];
+        int64_t m_offsets[BUFFER_COUNT];
+        bool m_inFlight[BUFFER_COUNT];
+        int64_t m_offset;
+        int64_t m_length;
+        bool m_error;
+        bool m_isAppend;
+    };
+#endif
+
+    // Writer adapters call `final` writers they wrap directly, so that the
+    // calls may be inlined. Any other writer may be a base class of the
+    // actual writer, possibly an abstract one, so it is called virtually.
+
+    template <class Writer>
+    size_t forward_write(Writer& writer, size_t length, const void* data, bool isRef, std::true_type)
+    {
+        return isRef
+            ? writer.Writer::write_ref(length, data)
+            : writer.Writer::write(length, data);
+    }
+
+    template <class Writer>
+    size_t forward_write(Writer& writer, size_t length, const void* data, bool isRef, std::false_type)
+    {
+        return isRef
+            ? writer.write_ref(length, data)
+            : writer.write(length, data);
+    }
+
+    template <class Writer>
+    size_t forward_write(Writer& writer, size_t length, const void* data, bool isRef)
+    {
+        return forward_write(writer, length, data, isRef, std::integral_constant<bool, SP_IS_FINAL(Writer)>());
+    }
+
+    /// Writer that discards its output.
+    class NullWriter : public IWriter {
+    public:
+        size_t write(size_t length, const void*) override
+        {
+            return length;
+        }
+    };
+
+    /// Writer that writes its output to each of the provided writers. It
+    /// only stops once all of them have.
+    template <class... Writers>
+    class TeeWriter : public IWriter {
+    public:
+        TeeWriter(Writers&... writers)
+            : m_writers(writers...)
+        {
+        }
+
+        size_t write(size_t length, const void* data) override
+        {
+            write_all(length, data, false, SizeConstant<0>());
+            return length;
+        }
+
+        size_t write_ref(size_t length, const void* data) override
+        {
+            write_all(length, data, true, SizeConstant<0>());
+            return length;
+        }
+
+        bool stopped() const override
+        {
+            return all_stopped(SizeConstant<0>());
+        }
+
+    private:
+        template <size_t I>
+        using SizeConstant = std::integral_constant<size_t, I>;
+
+        using Count = SizeConstant<sizeof...(Writers)>;
+
+        void write_all(size_t, const void*, bool, Count)
+        {
+        }
+
+        template <size_t I>
+        void write_all(size_t length, const void* data, bool isRef, SizeConstant<I>)
+        {
+            auto& writer = std::get<I>(m_writers);
+
+            if (!writer.stopped()) {
+                forward_write(writer, length, data, isRef);
+            }
+
+            write_all(length, data, isRef, SizeConstant<I + 1>());
+        }
+
+        bool all_stopped(Count) const
+        {
+            return true;
+        }
+
+        template <size_t I>
+        bool all_stopped(SizeConstant<I>) const
+        {
+            return std::get<I>(m_writers).stopped()
+                && all_stopped(SizeConstant<I + 1>());
+        }
+
+        std::tuple<Writers&...> m_writers;
+    };
+
+    template <class... Writers>
+    TeeWriter<Writers...> make_tee(Writers&... writers)
+    {
+        return TeeWriter<Writers...>(writers...);
+    }
+
+    /// CRC-32 (as used by zlib, gzip and PNG), for use with `HashWriter`.
+    class Crc32 {
+    public:
+        Crc32()
+            : m_crc(0xffffffffu)
+        {
+        }
+
+        void update(const void* data, size_t length)
+        {
+            static const auto table = make_table();
+            auto bytes = static_cast<const uint8_t*>(data);
+            auto crc = m_crc;
+
+            // four bytes per iteration, one table lookup per byte
+            for (; length >= 4; length -= 4, bytes += 4) {
+                crc ^= uint32_t(bytes[0]) | (uint32_t(bytes[1]) << 8) | (uint32_t(bytes[2]) << 16) | (uint32_t(bytes[3]) << 24);
+                crc = table.entries[3][crc & 0xff]
+                    ^ table.entries[2][(crc >> 8) & 0xff]
+                    ^ table.entries[1][(crc >> 16) & 0xff]
+                    ^ table.entries[0][crc >> 24];
+            }
+
+            for (; length; --length, ++bytes) {
+                crc = table.entries[0][(crc ^ *bytes) & 0xff] ^ (crc >> 8);
+            }
+
+            m_crc = crc;
+        }
+
+        uint32_t value() const
+        {
+            return m_crc ^ 0xffffffffu;
+        }
+
+    private:
+        struct Table {
+            uint32_t entries[4][256];
+        };
+
+        static Table make_table()
+        {
+            Table table;
+
+            for (uint32_t i = 0; i < 256; ++i) {
+                auto crc = i;
+
+                for (auto bit = 0; bit < 8; ++bit) {
+                    crc = (crc >> 1) ^ ((crc & 1) ? 0xedb88320u : 0);
+                }
+
+                table.entries[0][i] = crc;
+            }
+
+            for (uint32_t i = 0; i < 256; ++i) {
+                for (auto n = 1; n < 4; ++n) {
+                    const auto prev = table.entries[n - 1][i];
+                    table.entries[n][i] = table.entries[0][prev & 0xff] ^ (prev >> 8);
+                }
+            }
+
+            return table;
+        }
+
+        uint32_t m_crc;
+    };
+
+    /// 64-bit FNV-1a, for use with `HashWriter`.
+    class Fnv1a64 {
+    public:
+        Fnv1a64()
+            : m_hash(0xcbf29ce484222325ull)
+        {
+        }
+
+        void update(const void* data, size_t length)
+        {
+            auto bytes = static_cast<const uint8_t*>(data);
+            auto hash = m_hash;
+
+            for (size_t i = 0; i < length; ++i) {
+                hash = (hash ^ bytes[i]) * 0x100000001b3ull;
+            }
+
+            m_hash = hash;
+        }
+
+        uint64_t value() const
+        {
+            return m_hash;
+        }
+
+    private:
+        uint64_t m_hash;
+    };
+
+    /// Writer that updates a running hash with its output before passing it
+    /// on to the provided writer. `Hasher` must provide `update(data, length)`
+    /// and `value()`, like `Crc32` does.
+    template <class Hasher, class Writer>
+    class HashWriter : public IWriter {
+    public:
+        HashWriter(Writer& writer, const Hasher& hasher = Hasher())
+            : m_writer(writer)
+            , m_hasher(hasher)
+        {
+        }
+
+        auto hash() const -> decltype(std::declval<const Hasher&>().value())
+        {
+            return m_hasher.value();
+        }
+
+        size_t write(size_t length, const void* data) override
+        {
+            m_hasher.update(data, length);
+            return forward_write(m_writer, length, data, false);
+        }
+
+        size_t write_ref(size_t length, const void* data) override
+        {
+            m_hasher.update(data, length);
+            return forward_write(m_writer, length, data, true);
+        }
+
+        bool stopped() const override
+        {
+            return m_writer.stopped();
+        }
+
+    private:
+        Writer& m_writer;
+        Hasher m_hasher;
+    };
+
+    template <class Hasher, class Writer>
+    HashWriter<Hasher, Writer> make_hash_writer(Writer& writer, const Hasher& hasher = Hasher())
+    {
+        return HashWriter<Hasher, Writer>(writer, hasher);
+    }
+
+    /// Writer that counts its output, and passes at most `limit` `char`s of
+    /// it on to the provided writer. It stops once the limit is exceeded.
+    template <class Writer>
+    class LimitWriter : public IWriter {
+    public:
+        LimitWriter(Writer& writer, size_t limit = size_t(-1))
+            : m_writer(writer)
+            , m_limit(limit)
+            , m_count(0)
+        {
+        }
+
+        /// Return the amount of `char`s written to this writer, including
+        /// any beyond the limit.
+        size_t count() const
+        {
+            return m_count;
+        }
+
+        /// Return whether any output was cut off by the limit.
+        bool truncated() const
+        {
+            return m_count > m_limit;
+        }
+
+        size_t write(size_t length, const void* data) override
+        {
+            return write(length, data, false);
+        }
+
+        size_t write_ref(size_t length, const void* data) override
+        {
+            return write(length, data, true);
+        }
+
+        bool stopped() const override
+        {
+            return truncated() || m_writer.stopped();
+        }
+
+    private:
+        size_t write(size_t length, const void* data, bool isRef)
+        {
+            const auto remaining = (m_count < m_limit) ? m_limit - m_count : 0;
+            const auto toWrite = std::min(length, remaining);
+
+            m_count += length;
+
+            return toWrite
+                ? forward_write(m_writer, toWrite, data, isRef)
+                : 0;
+        }
+
+        Writer& m_writer;
+        size_t m_limit;
+        size_t m_count;
+    };
+
+    template <class Writer>
+    LimitWriter<Writer> make_limit_writer(Writer& writer, size_t limit = size_t(-1))
+    {
+        return LimitWriter<Writer>(writer, limit);
+    }
+
+#if defined(SP_ENABLE_ZLIB) || defined(SP_ENABLE_ZSTD)
+    /// Result of a single compression step.
+    enum CompressStep {
+        COMPRESSSTEP_ERROR, //< The codec failed.
+        COMPRESSSTEP_MORE, //< The output is full, call again with more space.
+        COMPRESSSTEP_DONE, //< All input was consumed (and flushed, when finishing).
+    };
+
+    /// Writer that compresses its output with a streaming `Codec`, and
+    /// writes the compressed data to the provided writer. Output is staged
+    /// until `STAGE_SIZE` `char`s have been collected, so that the codec
+    /// isn't invoked for every small fragment. `finish` must be called to
+    /// complete the stream; the destructor does so if it hasn't been.
+    template <class Codec>
+    class CompressWriter : public IWriter {
+    public:
+        static const size_t STAGE_SIZE = 16 * 1024;
+        static const size_t CHUNK_SIZE = 16 * 1024;
+
+        CompressWriter(IWriter& output, int level = Codec::DEFAULT_LEVEL)
+            : m_output(output)
+            , m_staged(0)
+            , m_inputSize(0)
+            , m_outputSize(0)
+            , m_finished(false)
+            , m_failed(!m_codec.init(level))
+        {
+        }
+
+        CompressWriter(const CompressWriter&) = delete;
+        CompressWriter& operator=(const CompressWriter&) = delete;
+
+        ~CompressWriter()
+        {
+            finish();
+        }
+
+        /// Return the amount of uncompressed `char`s written.
+        uint64_t input_size() const
+        {
+            return m_inputSize;
+        }
+
+        /// Return the amount of compressed `char`s produced so far.
+        uint64_t output_size() const
+        {
+            return m_outputSize;
+        }
+
+        /// Compress any staged output, and complete the stream. Return
+        /// whether the whole stream was produced successfully.
+        bool finish()
+        {
+            if (!m_finished) {
+                m_finished = true;
+                pump(m_stage, m_staged, true);
+                m_staged = 0;
+            }
+
+            return !m_failed;
+        }
+
+        size_t write(size_t length, const void* data) override
+        {
+            if (stopped()) {
+                return 0;
+            }
+
+            m_inputSize += length;
+
+            if (m_staged + length <= STAGE_SIZE) {
+                std::memcpy(m_stage + m_staged, data, length);
+                m_staged += length;
+                return length;
+            }
+
+            // compress what is staged, and large writes directly
+            pump(m_stage, m_staged, false);
+            m_staged = 0;
+
+            if (length >= STAGE_SIZE) {
+                pump(static_cast<const char*>(data), length, false);
+            } else {
+                std::memcpy(m_stage, data, length);
+                m_staged = length;
+            }
+
+            return length;
+        }
+
+        bool stopped() const override
+        {
+            return m_failed || m_finished || m_output.stopped();
+        }
+
+    private:
+        void pump(const char* data, size_t length, bool finish)
+        {
+            while (!m_failed) {
+                size_t consumed = 0;
+                size_t produced = 0;
+                const auto step = m_codec.step(data, length, &consumed, m_chunk, CHUNK_SIZE, &produced, finish);
+
+                data += consumed;
+                length -= consumed;
+
+                if (produced) {
+                    m_outputSize += produced;
+                    m_output.write(produced, m_chunk);
+                }
+
+                if (step == COMPRESSSTEP_ERROR || m_output.stopped()) {
+                    m_failed = true;
+                } else if (step == COMPRESSSTEP_DONE) {
+                    break;
+                }
+            }
+        }
+
+        IWriter& m_output;
+        Codec m_codec;
+        char m_stage[STAGE_SIZE];
+        char m_chunk[CHUNK_SIZE];
+        size_t m_staged;
+        uint64_t m_inputSize;
+        uint64_t m_outputSize;
+        bool m_finished;
+        bool m_failed;
+    };
+#endif
+
+#if defined(SP_ENABLE_ZLIB)
+    /// Codec producing gzip streams with zlib.
+    class DeflateCodec {
+    public:
+        static const int DEFAULT_LEVEL = Z_DEFAULT_COMPRESSION;
+
+        DeflateCodec()
+            : m_initialized(false)
+        {
+        }
+
+        DeflateCodec(const DeflateCodec&) = delete;
+        DeflateCodec& operator=(const DeflateCodec&) = delete;
+
+        ~DeflateCodec()
+        {
+            if (m_initialized) {
+                deflateEnd(&m_stream);
+            }
+        }
+
+        bool init(int level)
+        {
+            std::memset(&m_stream, 0, sizeof(m_stream));
+
+            // 16 added to the window bits selects the gzip wrapper
+            m_initialized = deflateInit2(&m_stream, level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) == Z_OK;
+            return m_initialized;
+        }
+
+        CompressStep step(const char* in, size_t inLength, size_t* consumed, char* out, size_t outLength, size_t* produced, bool finish)
+        {
+            // zlib counts in `uInt`, so feed it at most that much at a time
+            const auto maxLength = size_t(std::numeric_limits<uInt>::max());
+            const auto inChunk = std::min(inLength, maxLength);
+
+            m_stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(in));
+            m_stream.avail_in = uInt(inChunk);
+            m_stream.next_out = reinterpret_cast<Bytef*>(out);
+            m_stream.avail_out = uInt(std::min(outLength, maxLength));
+
+            const auto isLast = finish && inChunk == inLength;
+            const auto result = deflate(&m_stream, isLast ? Z_FINISH : Z_NO_FLUSH);
+
+            *consumed = inChunk - m_stream.avail_in;
+            *produced = size_t(reinterpret_cast<char*>(m_stream.next_out) - out);
+
+            if (result == Z_STREAM_ERROR) {
+                return COMPRESSSTEP_ERROR;
+            }
+
+            if (isLast) {
+                return (result == Z_STREAM_END) ? COMPRESSSTEP_DONE : COMPRESSSTEP_MORE;
+            }
+
+            return (*consumed == inLength && m_stream.avail_out) ? COMPRESSSTEP_DONE : COMPRESSSTEP_MORE;
+        }
+
+    private:
+        z_stream m_stream;
+        bool m_initialized;
+    };
+
+    /// Writer producing gzip compressed output.
+    typedef CompressWriter<DeflateCodec> DeflateWriter;
+#endif
+
+#if defined(SP_ENABLE_ZSTD)
+    /// Codec producing zstd frames.
+    class ZstdCodec {
+    public:
+        static const int DEFAULT_LEVEL = 3;
+
+        ZstdCodec()
+            : m_context(nullptr)
+        {
+        }
+
+        ZstdCodec(const ZstdCodec&) = delete;
+        ZstdCodec& operator=(const ZstdCodec&) = delete;
+
+        ~ZstdCodec()
+        {
+            ZSTD_freeCCtx(m_context);
+        }
+
+        bool init(int level)
+        {
+            m_context = ZSTD_createCCtx();
+            return m_context
+                && !ZSTD_isError(ZSTD_CCtx_setParameter(m_context, ZSTD_c_compressionLevel, level));
+        }
+
+        CompressStep step(const char* in, size_t inLength, size_t* consumed, char* out, size_t outLength, size_t* produced, bool finish)
+        {
+            ZSTD_inBuffer input = { in, inLength, 0 };
+            ZSTD_outBuffer output = { out, outLength, 0 };
+
+            const auto remaining = ZSTD_compressStream2(m_context, &output, &input, finish ? ZSTD_e_end : ZSTD_e_continue);
+
+            *consumed = input.pos;
+            *produced = output.pos;
+
+            if (ZSTD_isError(remaining)) {
+                return COMPRESSSTEP_ERROR;
+            }
+
+            if (finish) {
+                return remaining ? COMPRESSSTEP_MORE : COMPRESSSTEP_DONE;
+            }
+
+            return (input.pos == input.size && output.pos < output.size) ? COMPRESSSTEP_DONE : COMPRESSSTEP_MORE;
+        }
+
+    private:
+        ZSTD_CCtx* m_context;
+    };
+
+    /// Writer producing zstd compressed output.
+    typedef CompressWriter<ZstdCodec> ZstdWriter;
+#endif
+
+    inline void write_char(IWriter& writer, char ch)
+    {
+        writer.write(1, &ch);
+    }
+
+    inline void write_fill(IWriter& writer, char ch, int32_t count)
+    {
+        char block[64];
+        std::memset(block, ch, size_t(std::min(count, int32_t(sizeof(block)))));
+
+        while (count > 0 && !writer.stopped()) {
+            const auto toWrite = std::min(count, int32_t(sizeof(block)));
+            writer.write(size_t(toWrite), block);
+            count -= toWrite;
+        }
+    }
+
+    template <class Writer>
+    SP_CONSTEXPR void write_fill(Writer& writer, char ch, int32_t count)
+    {
+        for (; count > 0; --count) {
+            writer.write(1, &ch);
+        }
+    }
+
+    constexpr StringView::StringView() {}
+
+    inline StringView::StringView(const char str[])
+        : ptr(str)
+        , length(str ? int32_t(std::strlen(str)) : 0)
+    {
+    }
+
+    constexpr StringView::StringView(const char str[], int32_t length)
+        : ptr(str)
+        , length(length)
+    {
+    }
+
+    struct FormatFlags {
+        char fill = 0;
+        char align = 0;
+        char sign = 0;
+        bool alternate = false;
+        int32_t width = -1;
+        char grouping = 0;
+        int32_t precision = -1;
+        char type = 0;
+    };
+
+    static_assert(SP_MAX_WIDTH < INT32_MAX / 10 && SP_MAX_PRECISION < INT32_MAX / 10, "format spec limits must fit in an int32_t");
+
+    struct Decimal {
+        int64_t mantissa; //< Value, scaled by `10^scale`.
+        int32_t scale; //< Amount of decimal places in `mantissa`.
+    };
+
+    constexpr Decimal decimal(int64_t mantissa, int32_t scale)
+    {
+        return Decimal{ mantissa, scale };
+    }
+
+    // Formatting engine. These are defined below, or only in the translation
+    // unit defining `SP_IMPLEMENTATION` when using `SP_SEPARATE_COMPILATION`.
+    SP_ENGINE bool parse_format(const StringView& fmt, FormatFlags* flags);
+    SP_ENGINE bool format_int(IWriter& writer, const FormatFlags& flags, bool isNegative, uint64_t value);
+#if defined(SP_HAS_INT128)
+    SP_ENGINE bool format_int(IWriter& writer, const FormatFlags& flags, bool isNegative, uint128_t value);
+#endif
+    SP_ENGINE const char* find_escape(const char* ptr, const char* term, char type);
+    SP_ENGINE int32_t escape_char(char type, char ch, char out[6]);
+    SP_ENGINE int32_t escaped_length(const StringView& str, char type, bool* isQuoted);
+    SP_ENGINE bool format_string(IWriter& writer, const FormatFlags& flags, const StringView& str, bool isStable = false);
+    SP_ENGINE bool format_value(IWriter& writer, const FormatFlags& flags, bool value);
+    SP_ENGINE bool format_value(IWriter& writer, const FormatFlags& flags, float value);
+    SP_ENGINE bool format_value(IWriter& writer, const FormatFlags& flags, double value);
+    SP_ENGINE bool format_value(IWriter& writer, const FormatFlags& flags, char32_t value);
+    SP_ENGINE bool format_value(IWriter& writer, const FormatFlags& flags, long long value);
+    SP_ENGINE bool format_value(IWriter& writer, const FormatFlags& flags, unsigned long long value);
+    SP_ENGINE bool format_value(IWriter& writer, const FormatFlags& flags, const StringView& value);
+    SP_ENGINE bool format_value(IWriter& writer, const FormatFlags& flags, const Decimal& value);
+#if defined(SP_HAS_INT128)
+    SP_ENGINE bool format_value(IWriter& writer, const FormatFlags& flags, int128_t value);
+    SP_ENGINE bool format_value(IWriter& writer, const FormatFlags& flags, uint128_t value);
+#endif
+    SP_ENGINE bool format_default(IWriter& writer, bool value);
+    SP_ENGINE bool format_default(IWriter& writer, float value);
+    SP_ENGINE bool format_default(IWriter& writer, double value);
+    SP_ENGINE bool format_default(IWriter& writer, char32_t value);
+    SP_ENGINE bool format_default(IWriter& writer, unsigned long long value);
+    SP_ENGINE bool format_default(IWriter& writer, long long value);
+    SP_ENGINE bool format_default(IWriter& writer, const StringView& value);
+    SP_ENGINE bool format_default(IWriter& writer, const Decimal& value);
+#if defined(SP_HAS_INT128)
+    SP_ENGINE bool format_default(IWriter& writer, int128_t value);
+    SP_ENGINE bool format_default(IWriter& writer, uint128_t value);
+#endif
+
+    // Formatting cores, written against any writer type. Through `IWriter`
+    // they back the engine below, and through `FixedString` they produce
+    // `format_to_fixed`'s output.
+
+    SP_CONSTEXPR bool basic_parse_format(const StringView& fmt, FormatFlags* flags)
+    {
+        enum State {
+            STATE_ALIGN,
+            STATE_SIGN,
+            STATE_ALTERNATE,
+            STATE_WIDTH,
+            STATE_GROUPING,
+            STATE_PRECISION,
+            STATE_TYPE,
+            STATE_DONE,
+        };
+
+        auto state = STATE_ALIGN;
+        auto next = fmt.ptr;
+        auto term = fmt.ptr + fmt.length;
+        *flags = FormatFlags{};
+
+        while (next < term) {
+            const auto ptr = next++;
+            const auto ch = *ptr;
+
+            switch (state) {
+            case STATE_ALIGN: {
+                const auto isAlign = [](char ch) {
+                    return (ch >= '<' && ch <= '>') || ch == '^';
+                };
+
+                if (next < term && isAlign(*next)) {
+                    flags->fill = ch;
+                    flags->align = *next++;
+                } else if (isAlign(ch)) {
+                    flags->align = ch;
+                } else {
+                    --next;
+                }
+
+                state = STATE_SIGN;
+                break;
+            }
+
+            case STATE_SIGN:
+                switch (ch) {
+                case '+':
+                case '-':
+                case ' ':
+                    flags->sign = ch;
+                    break;
+                default:
+                    --next;
+                    break;
+                }
+                state = STATE_ALTERNATE;
+                break;
+
+            case STATE_ALTERNATE:
+                if (ch == '#') {
+                    flags->alternate = true;
+                } else {
+                    --next;
+                }
+                state = STATE_WIDTH;
+                break;
+
+            case STATE_WIDTH:
+                if (ch >= '0' && ch <= '9') {
+                    if (flags->width < 0) {
+                        if (ch == '0') {
+                            flags->fill = flags->fill ? flags->fill : '0';
+                            flags->align = flags->align ? flags->align : '=';
+                        }
+                        flags->width = 0;
+                    }
+                    flags->width = (flags->width * 10) + (ch - '0');
+
+                    if (flags->width > SP_MAX_WIDTH) {
+                        return false;
+                    }
+                } else {
+                    state = STATE_GROUPING;
+                    --next;
+                }
+                break;
+
+            case STATE_GROUPING:
+                if (ch == ',' || ch == '_') {
+                    flags->grouping = ch;
+                } else {
+                    --next;
+                }
+                state = STATE_PRECISION;
+                break;
+
+            case STATE_PRECISION: {
+                const auto isDigit = [](char ch) {
+                    return ch >= '0' && ch <= '9';
+                };
+
+                if (ch == '.') {
+                    const char nextCh = (next < term) ? *next : 0;
+
+                    if (flags->precision < 0 && isDigit(nextCh)) {
+                        flags->precision = 0;
+                        continue;
+                    }
+                } else if (isDigit(ch)) {
+                    if (flags->precision >= 0) {
+                        flags->precision = (flags->precision * 10) + (ch - '0');
+
+                        if (flags->precision > SP_MAX_PRECISION) {
+                            return false;
+                        }
+                        continue;
+                    }
+                }
+
+                state = STATE_TYPE;
+                --next;
+                break;
+            }
+
+            case STATE_TYPE:
+                if (term - ptr == 3 && ptr[0] == 'c' && ptr[1] == 's' && ptr[2] == 'v') {
+                    flags->type = 'v';
+                    next = term;
+                    state = STATE_DONE;
+                    break;
+                }
+
+                switch (ch) {
+                case 'b':
+                case 'd':
+                case 'c':
+                case 'e':
+                case 'E':
+                case 'f':
+                case 'F':
+                case 'g':
+                case 'G':
+                case 'j':
+                case 'o':
+                case 'q':
+                case 's':
+                case 'x':
+                case 'X':
+                case '%':
+                    flags->type = ch;
+                    break;
+                default:
+                    --next;
+                    break;
+                }
+                state = STATE_DONE;
+                break;
+
+            case STATE_DONE:
+                // if we get here, it means there's stuff in there after the
+                // flags, in which case we should fail.
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    template <class T = void>
+    struct DecimalPairs {
+        static constexpr char digits[] = "00010203040506070809"
+                                         "10111213141516171819"
+                                         "20212223242526272829"
+                                         "30313233343536373839"
+                                         "40414243444546474849"
+                                         "50515253545556575859"
+                                         "60616263646566676869"
+                                         "70717273747576777879"
+                                         "80818283848586878889"
+                                         "90919293949596979899";
+    };
+
+#if !defined(SP_HAS_CONSTEXPR)
+    template <class T>
+    constexpr char DecimalPairs<T>::digits[];
+#endif
+
+    /// Write the decimal digits of `value` backwards, ending at `end`, two
+    /// at a time. Returns a pointer to the first digit.
+    SP_CONSTEXPR char* write_decimal(char* end, uint64_t value)
+    {
+        const auto pairs = DecimalPairs<>::digits;
+
+        while (value >= 100) {
+            const auto pair = pairs + (value % 100) * 2;
+            value /= 100;
+            *(--end) = pair[1];
+            *(--end) = pair[0];
+        }
+
+        if (value >= 10) {
+            const auto pair = pairs + value * 2;
+            *(--end) = pair[1];
+            *(--end) = pair[0];
+        } else {
+            *(--end) = char('0' + value);
+        }
+
+        return end;
+    }
+
+#if defined(SP_HAS_INT128)
+    /// Write the decimal digits of the 128-bit `value` backwards, ending at
+    /// `end`. The value is split into chunks of 19 digits, so only one
+    /// 128-bit division is needed per chunk rather than per digit.
+    SP_CONSTEXPR char* write_decimal(char* end, uint128_t value)
+    {
+        const uint64_t chunk = 10000000000000000000ull; // 10^19
+
+        while (value >> 64) {
+            const auto quotient = value / chunk;
+            const auto digits = write_decimal(end, uint64_t(value - quotient * chunk));
+
+            // inner chunks keep their leading zeros
+            for (auto ptr = end - 19; ptr < digits; ++ptr) {
+                *ptr = '0';
+            }
+
+            end -= 19;
+            value = quotient;
+        }
+
+        return write_decimal(end, uint64_t(value));
+    }
+#endif
+
+    /// Padding before and after a formatted value.
+    struct Padding {
+        int32_t lead;
+        int32_t tail;
+    };
+
+    /// Pad `length` chars of output to the width of `flags`, as aligned by
+    /// `flags`, or by `defaultAlign` if it has no alignment that applies.
+    SP_CONSTEXPR Padding align_padding(const FormatFlags& flags, int32_t length, char defaultAlign)
+    {
+        const int32_t width = std::max(flags.width, length);
+        Padding padding = { 0, 0 };
+
+        switch ((flags.align == '^' || flags.align == '<' || flags.align == '>') ? flags.align : defaultAlign) {
+        case '^':
+            padding.lead = (width / 2) - ((length + 1) / 2); // length rounded up
+            padding.tail = ((width + 1) / 2) - (length / 2); // width rounded up
+            padding.lead += (width & 1) & (length & 1); // if both are odd, we need to add one for correction
+            padding.tail -= (width & 1) & (length & 1); // if both are odd, we need to remove one for correction
+            break;
+        case '<':
+            padding.tail = width - length;
+            break;
+        default:
+            padding.lead = width - length;
+            break;
+        }
+
+        return padding;
+    }
+
+    /// Write the sign of a number followed by `ndigits` chars, and the
+    /// leading padding. The sign goes before the padding with `=` alignment,
+    /// and after it otherwise. Return the trailing padding, which is up to
+    /// the caller to write after the digits.
+    inline int32_t write_number_lead(IWriter& writer, const FormatFlags& flags, bool isNegative, int32_t ndigits)
+    {
+        char sign = 0;
+
+        if (isNegative) {
+            sign = '-';
+        } else if (flags.sign == '+' || flags.sign == ' ') {
+            sign = flags.sign;
+        }
+
+        const auto nchars = (sign && ndigits < INT32_MAX) ? ndigits + 1 : ndigits;
+        const auto padding = align_padding(flags, nchars, '>');
+
+        if (sign && flags.align == '=') {
+            write_char(writer, sign);
+        }
+
+        write_fill(writer, flags.fill ? flags.fill : ' ', padding.lead);
+
+        if (sign && flags.align != '=') {
+            write_char(writer, sign);
+        }
+
+        return padding.tail;
+    }
+
+    /// Return whether `type` is one of the escaped string presentations,
+    /// which are only valid for strings.
+    SP_CONSTEXPR bool is_escape_type(char type)
+    {
+        return type == 'j' || type == 'q' || type == 'v';
+    }
+
+    /// Format the magnitude `value` of an integer, where `Value` is either
+    /// `uint64_t` or `uint128_t`.
+    template <class Writer, class Value>
+    SP_CONSTEXPR bool basic_format_int(Writer& writer, const FormatFlags& flags, bool isNegative, Value value)
+    {
+        if (is_escape_type(flags.type) || flags.grouping) {
+            return false;
+        }
+
+        // determine base, all but decimal being powers of two
+        int32_t base = 10;
+        int32_t shift = 0;
+
+        switch (flags.type) {
+        case 'b':
+            base = 2;
+            shift = 1;
+            break;
+        case 'o':
+            base = 8;
+            shift = 3;
+            break;
+        case 'c':
+        case 'x':
+        case 'X':
+            base = 16;
+            shift = 4;
+            break;
+        }
+
+        // count digits, and copy them to a buffer (so we don't have to repeat
+        // this later)
+        char buffer[sizeof(Value) * 8 + 3] = {}; // max needed; binary + sign + alternate prefix
+        char* digits = buffer + sizeof(buffer);
+        char* prefix = buffer + 3;
+        int32_t ndigits = 0;
+        int32_t nprefix = 0;
+        char type = flags.type;
+
+        const bool isChar = type == 'c';
+        const bool charAsHex = (value >= 0x80 || isNegative);
+
+        if (isChar) {
+            if (charAsHex) {
+                *(--digits) = ')';
+            } else {
+                *(--digits) = char(value);
+            }
+            ndigits = 1;
+        }
+
+        if (!isChar || charAsHex) {
+            const auto digitchars = (flags.type == 'X')
+                ? "0123456789ABCDEFX"
+                : "0123456789abcdefx";
+
+            if (base == 10) {
+                const auto end = digits;
+                digits = write_decimal(end, value);
+                ndigits += int32_t(end - digits);
+            } else {
+                auto v = value;
+                do {
+                    *(--digits) = digitchars[int32_t(v & Value(base - 1))];
+                    v >>= shift;
+                    ++ndigits;
+                } while (v);
+            }
+
+            if (flags.alternate) {
+                switch (base) {
+                case 2:
+                    *(--prefix) = 'b';
+                    *(--prefix) = '0';
+                    nprefix += 2;
+                    break;
+                case 8:
+                    *(--prefix) = 'o';
+                    *(--prefix) = '0';
+                    nprefix += 2;
+                    break;
+                case 16:
+                    *(--prefix) = digitchars[16];
+                    *(--prefix) = '0';
+                    nprefix += 2;
+                    break;
+                }
+            }
+        }
+
+        // determine sign
+        if (isNegative) {
+            *(--prefix) = '-';
+            ++nprefix;
+        } else if (flags.sign == '+' || flags.sign == ' ') {
+            *(--prefix) = flags.sign;
+            ++nprefix;
+        }
+
+        // for hex chars, the prefix should be part of the value
+        if (isChar && charAsHex) {
+            if (nprefix) {
+                digits -= nprefix;
+                ndigits += nprefix;
+                for (int32_t i = 0; i < nprefix; ++i) {
+                    digits[i] = prefix[i];
+                }
+                nprefix = 0;
+            }
+            *(--digits) = '(';
+            ++ndigits;
+        }
+
+        // determine spacing
+        const auto padding = align_padding(flags, ndigits + nprefix, '>');
+
+        // print sign and alternate prefix, if they should be before the padding
+        if (nprefix) {
+            switch (flags.align) {
+            case '^':
+            case '>':
+                break;
+            case '<':
+            case '=':
+            default:
+                writer.write(nprefix, prefix);
+                nprefix = 0;
+                break;
+            }
+        }
+
+        // apply the leading padding
+        const char fill = flags.fill ? flags.fill : ' ';
+
+        write_fill(writer, fill, padding.lead);
+
+        // print the prefix, if it should be after the padding
+        if (nprefix) {
+            writer.write(nprefix, prefix);
+        }
+
+        // print digits
+        writer.write(ndigits, digits);
+
+        // print tailing padding
+        write_fill(writer, fill, padding.tail);
+
+        return true;
+    }
+
+    /// Write `str` escaped by the string presentation `type`. Runs without
+    /// any characters to escape are written in one go.
+    template <class Writer>
+    void write_escaped(Writer& writer, const StringView& str, char type, bool isQuoted, bool isStable)
+    {
+        const auto term = str.ptr + str.length;
+        auto run = str.ptr;
+
+        if (isQuoted) {
+            writer.write_ref(1, "\"");
+        }
+
+        while (run < term) {
+            const auto ptr = find_escape(run, term, type);
+
+            if (ptr != run) {
+                if (isStable) {
+                    writer.write_ref(size_t(ptr - run), run);
+                } else {
+                    writer.write(size_t(ptr - run), run);
+                }
+            }
+
+            if (ptr == term) {
+                break;
+            }
+
+            char escaped[6];
+            const auto length = escape_char(type, *ptr, escaped);
+            writer.write(size_t(length), escaped);
+
+            run = ptr + 1;
+        }
+
+        if (isQuoted) {
+            writer.write_ref(1, "\"");
+        }
+    }
+
+    /// Format the provided string. If `isStable` is set, `str` must stay
+    /// alive until the writer is flushed, as it may be referenced rather than
+    /// copied.
+    template <class Writer>
+    SP_CONSTEXPR bool basic_format_string(Writer& writer, const FormatFlags& flags, const StringView& str, bool isStable)
+    {
+        if (flags.grouping) {
+            return false;
+        }
+
+        // determine the amount of characters to write
+        auto nchars = str.length;
+
+        if (flags.precision >= 0) {
+            nchars = std::min(flags.precision, nchars);
+        }
+
+        // escaped presentations only need a counting pass if padded
+        const auto isEscaped = is_escape_type(flags.type);
+        const auto escapeStr = StringView(str.ptr, nchars);
+        auto isQuoted = false;
+        auto length = nchars;
+
+        if (isEscaped && flags.width > 0) {
+            length = escaped_length(escapeStr, flags.type, &isQuoted);
+        } else if (isEscaped) {
+            isQuoted = (flags.type != 'v') || find_escape(str.ptr, str.ptr + nchars, 'v') != str.ptr + nchars;
+        }
+
+        // determine alignment
+        const auto padding = align_padding(flags, length, '<');
+
+        // apply leading padding
+        const char fill = flags.fill ? flags.fill : ' ';
+
+        write_fill(writer, fill, padding.lead);
+
+        // write string
+        if (isEscaped) {
+            write_escaped(writer, escapeStr, flags.type, isQuoted, isStable);
+        } else if (isStable) {
+            writer.write_ref(nchars, str.ptr);
+        } else {
+            writer.write(nchars, str.ptr);
+        }
+
+        // apply tailing padding
+        write_fill(writer, fill, padding.tail);
+
+        return true;
+    }
+
+    template <class Writer>
+    SP_CONSTEXPR bool basic_format_value(Writer& writer, const FormatFlags& flags, bool value)
+    {
+        switch (flags.type) {
+            case 'b':
+            case 'c':
+            case 'd':
+            case 'o':
+            case 'x':
+            case 'X':
+                return basic_format_int(writer, flags, false, (uint64_t)value);
+            case 'j':
+            case 'q':
+            case 'v':
+                return false;
+            default:
+                return basic_format_string(writer, flags, value ? StringView("true", 4) : StringView("false", 5), true);
+        }
+    }
+
+    template <class Writer>
+    SP_CONSTEXPR bool basic_format_value(Writer& writer, const FormatFlags& flags, char32_t value)
+    {
+        auto charFlags = flags;
+
+        if (!charFlags.type) {
+            charFlags.type = 'c';
+        }
+
+        if (!charFlags.align) {
+            charFlags.align = '<';
+        }
+
+        return basic_format_int(writer, charFlags, false, uint64_t(value));
+    }
+
+    template <class Writer>
+    SP_CONSTEXPR bool basic_format_value(Writer& writer, const FormatFlags& flags, long long value)
+    {
+        static_assert(sizeof(value) == sizeof(uint64_t), "invalid cast on negation");
+
+        const auto abs = (value >= 0 || value == std::numeric_limits<long long>::min())
+            ? uint64_t(value)
+            : uint64_t(-value);
+
+        return basic_format_int(writer, flags, value < 0, abs);
+    }
+
+    template <class Writer>
+    SP_CONSTEXPR bool basic_format_value(Writer& writer, const FormatFlags& flags, unsigned long long value)
+    {
+        return basic_format_int(writer, flags, false, uint64_t(value));
+    }
+
+#if defined(SP_HAS_INT128)
+    template <class Writer>
+    SP_CONSTEXPR bool basic_format_value(Writer& writer, const FormatFlags& flags, int128_t value)
+    {
+        // negate in unsigned arithmetic, which also covers the minimum
+        const auto abs = (value < 0) ? uint128_t(0) - uint128_t(value) : uint128_t(value);
+
+        return basic_format_int(writer, flags, value < 0, abs);
+    }
+
+    template <class Writer>
+    SP_CONSTEXPR bool basic_format_value(Writer& writer, const FormatFlags& flags, uint128_t value)
+    {
+        return basic_format_int(writer, flags, false, value);
+    }
+#endif
+
+    template <class Writer>
+    SP_CONSTEXPR bool basic_format_value(Writer& writer, const FormatFlags& flags, const StringView& value)
+    {
+        return basic_format_string(writer, flags, value, false);
+    }
+
+#if SP_DEFINE_ENGINE
+    SP_ENGINE bool parse_format(const StringView& fmt, FormatFlags* flags)
+    {
+        return basic_parse_format(fmt, flags);
+    }
+
+    SP_ENGINE bool format_int(IWriter& writer, const FormatFlags& flags, bool isNegative, uint64_t value)
+    {
+        return basic_format_int(writer, flags, isNegative, value);
+    }
+
+#if defined(SP_HAS_INT128)
+    SP_ENGINE bool format_int(IWriter& writer, const FormatFlags& flags, bool isNegative, uint128_t value)
+    {
+        return basic_format_int(writer, flags, isNegative, value);
+    }
+#endif
+
+    template <class F>
+    bool format_float(IWriter& writer, const FormatFlags& flags, F value)
+    {
+        // I *really* have no interest in serializing floats/doubles... so
+        // let's not. Instead, let's build a format string for snprintf to do
+        // the heavy work, and we'll just do alignment and stuff.
+        if (is_escape_type(flags.type) || flags.grouping) {
+            return false;
+        }
+
+        const char* suffix = "";
+        int32_t precision;
+        char type;
+
+        switch (flags.type) {
+        case 'f':
+        case 'F':
+        case 'e':
+        case 'E':
+            precision = flags.precision >= 0 ? flags.precision : 6;
+            type = flags.type;
+            break;
+        case 'g':
+        case 'G':
+            precision = (flags.precision != 0)
+                ? (flags.precision > 0 ? flags.precision : 6)
+                : 1;
+            type = flags.type;
+            break;
+        case '%':
+            precision = flags.precision >= 0 ? flags.precision : 6;
+            type = 'f';
+            value *= 100;
+            suffix = "%%";
+            break;
+        default:
+            precision = flags.precision >= 0 ? flags.precision : std::numeric_limits<F>::digits10;
+            type = 'g';
+            break;
+        }
+
+        // `g` drops trailing zeros, and no value has more significant digits
+        // than this, so larger precisions only cost time
+        if (type == 'g' || type == 'G') {
+            precision = std::min(precision, int32_t(std::numeric_limits<F>::digits - std::numeric_limits<F>::min_exponent));
+        }
+
+        // produce the formatted value, on the heap if it doesn't fit
+        char stackBuffer[SP_FLOAT_BUFFER_SIZE];
+        std::unique_ptr<char, void (*)(void*)> heapBuffer(nullptr, &std::free);
+        char* buffer = stackBuffer;
+        const char* digits = buffer;
+        int32_t ndigits = 0;
+
+        if (std::isnan(value)) {
+            const char* str = std::isupper(flags.type) ? "NAN" : "nan";
+            std::memcpy(buffer, str, 3);
+            ndigits = 3;
+        } else if (std::isinf(value)) {
+            const char* str = std::isupper(flags.type) ? "INF" : "inf";
+            std::memcpy(buffer, str, 3);
+            ndigits = 3;
+        } else {
+            char numFormat[17];
+            snprintf(numFormat, sizeof(numFormat), "%%+.%d%c%s", precision, type, suffix);
+
+            // produce the formatted value
+    #if defined(__MINGW32__) || (defined(_MSC_VER) && _MSC_VER < 1900)
+            unsigned int prevOutputFormat = _set_output_format(_TWO_DIGIT_EXPONENT);
+    #endif
+
+            const auto length = snprintf(buffer, sizeof(stackBuffer), numFormat, value);
+
+            if (length >= int(sizeof(stackBuffer))) {
+                heapBuffer.reset(static_cast<char*>(std::malloc(size_t(length) + 1)));
+                buffer = heapBuffer.get();
+
+                if (buffer) {
+                    snprintf(buffer, size_t(length) + 1, numFormat, value);
+                }
+            }
+
+            if (length <= 0 || !buffer) {
+                return false;
+            }
+
+            ndigits = length - 1;
+            digits = buffer + 1;
+
+    #if defined(__MINGW32__) || (defined(_MSC_VER) && _MSC_VER < 1900)
+            _set_output_format(prevOutputFormat);
+    #endif
+        }
+
+        // sign and padding
+        const auto tailSpace = write_number_lead(writer, flags, value < 0, ndigits);
+
+        // write string
+        writer.write(ndigits, digits);
+
+        // apply tailing padding
+        write_fill(writer, flags.fill ? flags.fill : ' ', tailSpace);
+
+        return true;
+    }
+
+    inline int32_t count_trailing_zeros(uint32_t value)
+    {
+    #if defined(_MSC_VER)
+        unsigned long index;
+        _BitScanForward(&index, value);
+        return int32_t(index);
+    #else
+        return __builtin_ctz(value);
+    #endif
+    }
+
+    /// Return whether `ch` has to be escaped by the string presentation
+    /// `type`; `j` for JSON, `q` for C and `v` for CSV.
+    inline bool needs_escape(char type, char ch)
+    {
+        const auto uch = uint8_t(ch);
+
+        if (type == 'v') {
+            return ch == ',' || ch == '"' || ch == '\r' || ch == '\n';
+        }
+
+        return uch < 0x20 || ch == '"' || ch == '\\' || (type == 'q' && uch == 0x7f);
+    }
+
+    /// Find the first character in `[ptr, term)` that has to be escaped by the
+    /// string presentation `type`, or `term` if there is none.
+    SP_ENGINE const char* find_escape(const char* ptr, const char* term, char type)
+    {
+    #if defined(SP_HAS_SSE2)
+        const auto quote = _mm_set1_epi8('"');
+        const auto backslash = _mm_set1_epi8('\\');
+        const auto control = _mm_set1_epi8(0x1f);
+        const auto del = _mm_set1_epi8(0x7f);
+        const auto comma = _mm_set1_epi8(',');
+        const auto cr = _mm_set1_epi8('\r');
+        const auto lf = _mm_set1_epi8('\n');
+
+        while (term - ptr >= 16) {
+            const auto chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(ptr));
+            auto mask = _mm_cmpeq_epi8(chunk, quote);
+
+            if (type == 'v') {
+                mask = _mm_or_si128(mask, _mm_cmpeq_epi8(chunk, comma));
+                mask = _mm_or_si128(mask, _mm_cmpeq_epi8(chunk, cr));
+                mask = _mm_or_si128(mask, _mm_cmpeq_epi8(chunk, lf));
+            } else {
+                // unsigned `chunk <= 0x1f`
+                mask = _mm_or_si128(mask, _mm_cmpeq_epi8(_mm_max_epu8(chunk, control), control));
+                mask = _mm_or_si128(mask, _mm_cmpeq_epi8(chunk, backslash));
+
+                if (type == 'q') {
+                    mask = _mm_or_si128(mask, _mm_cmpeq_epi8(chunk, del));
+                }
+            }
+
+            const auto bits = uint32_t(_mm_movemask_epi8(mask));
+
+            if (bits) {
+                return ptr + count_trailing_zeros(bits);
+            }
+
+            ptr += 16;
+        }
+    #endif
+
+        while (ptr < term && !needs_escape(type, *ptr)) {
+            ++ptr;
+        }
+
+        return ptr;
+    }
+
+    /// Produce the escape sequence for `ch` in the string presentation `type`,
+    /// returning its length.
+    SP_ENGINE int32_t escape_char(char type, char ch, char out[6])
+    {
+        static const char hex[] = "0123456789abcdef";
+        const auto uch = uint8_t(ch);
+
+        if (type == 'v') {
+            // only quotes are escaped in quoted CSV fields
+            out[0] = ch;
+            out[1] = '"';
+            return (ch == '"') ? 2 : 1;
+        }
+
+        char simple = 0;
+
+        switch (ch) {
+        case '"':
+        case '\\':
+            simple = ch;
+            break;
+        case '\b':
+            simple = 'b';
+            break;
+        case '\f':
+            simple = 'f';
+            break;
+        case '\n':
+            simple = 'n';
+            break;
+        case '\r':
+            simple = 'r';
+            break;
+        case '\t':
+            simple = 't';
+            break;
+        case '\a':
+            simple = (type == 'q') ? 'a' : 0;
+            break;
+        case '\v':
+            simple = (type == 'q') ? 'v' : 0;
+            break;
+        }
+
+        out[0] = '\\';
+
+        if (simple) {
+            out[1] = simple;
+            return 2;
+        }
+
+        if (type == 'q') {
+            // octal rather than hex, as `\x` consumes any following hex digits
+            out[1] = char('0' + (uch >> 6));
+            out[2] = char('0' + ((uch >> 3) & 7));
+            out[3] = char('0' + (uch & 7));
+            return 4;
+        }
+
+        out[1] = 'u';
+        out[2] = '0';
+        out[3] = '0';
+        out[4] = hex[uch >> 4];
+        out[5] = hex[uch & 0xf];
+        return 6;
+    }
+
+    /// Determine the length of `str` once escaped by the string presentation
+    /// `type`, including any quotes. For CSV, `isQuoted` receives whether the
+    /// field has to be quoted.
+    SP_ENGINE int32_t escaped_length(const StringView& str, char type, bool* isQuoted)
+    {
+        const auto term = str.ptr + str.length;
+        auto ptr = find_escape(str.ptr, term, type);
+
+        *isQuoted = (type != 'v') || (ptr != term);
+
+        if (ptr == term) {
+            return str.length + (*isQuoted ? 2 : 0);
+        }
+
+        auto length = str.length + 2;
+
+        for (; ptr < term; ptr = find_escape(ptr + 1, term, type)) {
+            char escaped[6];
+            length += escape_char(type, *ptr, escaped) - 1;
+        }
+
+        return length;
+    }
+
+    SP_ENGINE bool format_string(IWriter& writer, const FormatFlags& flags, const StringView& str, bool isStable)
+    {
+        return basic_format_string(writer, flags, str, isStable);
+    }
+
+    SP_ENGINE bool format_value(IWriter& writer, const FormatFlags& flags, bool value)
+    {
+        return basic_format_value(writer, flags, value);
+    }
+
+    SP_ENGINE bool format_value(IWriter& writer, const FormatFlags& flags, float value)
+    {
+        return format_float(writer, flags, value);
+    }
+
+    SP_ENGINE bool format_value(IWriter& writer, const FormatFlags& flags, double value)
+    {
+        return format_float(writer, flags, value);
+    }
+
+    SP_ENGINE bool format_value(IWriter& writer, const FormatFlags& flags, char32_t value)
+    {
+        return basic_format_value(writer, flags, value);
+    }
+
+    SP_ENGINE bool format_value(IWriter& writer, const FormatFlags& flags, long long value)
+    {
+        return basic_format_value(writer, flags, value);
+    }
+
+    SP_ENGINE bool format_value(IWriter& writer, const FormatFlags& flags, unsigned long long value)
+    {
+        return basic_format_value(writer, flags, value);
+    }
+
+    SP_ENGINE bool format_value(IWriter& writer, const FormatFlags& flags, const StringView& value)
+    {
+        return basic_format_value(writer, flags, value);
+    }
+
+#if defined(SP_HAS_INT128)
+    SP_ENGINE bool format_value(IWriter& writer, const FormatFlags& flags, int128_t value)
+    {
+        return basic_format_value(writer, flags, value);
+    }
+
+    SP_ENGINE bool format_value(IWriter& writer, const FormatFlags& flags, uint128_t value)
+    {
+        return basic_format_value(writer, flags, value);
+    }
+#endif
+
+    SP_ENGINE bool format_value(IWriter& writer, const FormatFlags& flags, const Decimal& value)
+    {
+        static const uint64_t powers[] = {
+            1ull,
+            10ull,
+            100ull,
+            1000ull,
+            10000ull,
+            100000ull,
+            1000000ull,
+            10000000ull,
+            100000000ull,
+            1000000000ull,
+            10000000000ull,
+            100000000000ull,
+            1000000000000ull,
+            10000000000000ull,
+            100000000000000ull,
+            1000000000000000ull,
+            10000000000000000ull,
+            100000000000000000ull,
+            1000000000000000000ull,
+            10000000000000000000ull,
+        };
+
+        const char* suffix = "";
+        int64_t scale = value.scale;
+
+        switch (flags.type) {
+        case 0:
+        case 'f':
+        case 'F':
+            break;
+        case '%':
+            scale -= 2;
+            suffix = "%";
+            break;
+        default:
+            return false;
+        }
+
+        // trailing zeros of the integer part are only supported within
+        // the range of the mantissa
+        if (scale < -19) {
+            return false;
+        }
+
+        const bool isNegative = value.mantissa < 0;
+        auto abs = isNegative ? uint64_t(0) - uint64_t(value.mantissa) : uint64_t(value.mantissa);
+        const int64_t precision = (flags.precision >= 0) ? flags.precision : std::max(scale, int64_t(0));
+
+        // round half away from zero to the requested precision
+        if (precision < scale) {
+            const auto drop = scale - precision;
+
+            if (drop > 19) {
+                abs = 0;
+            } else {
+                const auto divisor = powers[drop];
+                const auto remainder = abs % divisor;
+                abs = (abs / divisor) + ((remainder >= divisor - remainder) ? 1 : 0);
+            }
+
+            scale = precision;
+        }
+
+        // digits of the integer part, followed by those of the fraction
+        char digitBuffer[20];
+        const auto digitsEnd = digitBuffer + sizeof(digitBuffer);
+        const auto digits = write_decimal(digitsEnd, abs);
+        const auto ndigits = int64_t(digitsEnd - digits);
+        const auto nfraction = std::min(std::max(scale, int64_t(0)), ndigits);
+        const auto nleadingZeros = std::max(scale - ndigits, int64_t(0));
+        const auto ntrailingZeros = precision - std::max(scale, int64_t(0));
+
+        // the integer part, grouped if requested
+        char integer[52];
+        auto integerEnd = integer + sizeof(integer);
+        const auto zeros = abs ? int32_t(std::max(-scale, int64_t(0))) : 0;
+        const auto ninteger = int32_t(ndigits - nfraction) + zeros;
+
+        if (ndigits == nfraction) {
+            *(--integerEnd) = '0';
+        } else {
+            for (int32_t i = 0; i < ninteger; ++i) {
+                const auto ch = (i < zeros) ? '0' : digits[ndigits - nfraction - 1 - (i - zeros)];
+
+                if (flags.grouping && i && !(i % 3)) {
+                    *(--integerEnd) = flags.grouping;
+                }
+
+                *(--integerEnd) = ch;
+            }
+        }
+
+        const auto integerLen = int32_t((integer + sizeof(integer)) - integerEnd);
+        const bool hasPoint = precision > 0 || flags.alternate;
+
+        // sign and padding
+        const auto length = int64_t(integerLen) + (hasPoint ? 1 : 0) + precision + (*suffix ? 1 : 0);
+        const auto tailSpace = write_number_lead(writer, flags, isNegative, int32_t(std::min(length, int64_t(INT32_MAX))));
+
+        // write the number
+        writer.write(size_t(integerLen), integerEnd);
+
+        if (hasPoint) {
+            write_char(writer, '.');
+        }
+
+        write_fill(writer, '0', int32_t(std::min(nleadingZeros, precision)));
+        writer.write(size_t(nfraction), digitsEnd - nfraction);
+        write_fill(writer, '0', int32_t(std::min(ntrailingZeros, int64_t(INT32_MAX))));
+        writer.write(std::strlen(suffix), suffix);
+
+        // apply tailing padding
+        write_fill(writer, flags.fill ? flags.fill : ' ', tailSpace);
+
+        return true;
+    }
+#endif
+
+    template <class T>
+    bool format_value(IWriter& writer, const FormatFlags& flags, T* value)
+    {
+        auto pointerFlags = flags;
+
+        if (!pointerFlags.type) {
+            pointerFlags.type = 'x';
+        }
+
+        return format_int(writer, pointerFlags, false, uint64_t(value));
+    }
+
+    // Formatting for fields without a format spec. These produce the same
+    // output as formatting with empty `FormatFlags`, but skip alignment,
+    // padding and flag handling entirely.
+
+#if SP_DEFINE_ENGINE
+    SP_ENGINE bool format_default(IWriter& writer, bool value)
+    {
+        if (value) {
+            writer.write_ref(4, "true");
+        } else {
+            writer.write_ref(5, "false");
+        }
+        return true;
+    }
+
+    template <class F>
+    bool format_default_float(IWriter& writer, F value)
+    {
+        if (std::isnan(value)) {
+            writer.write_ref(3, "nan");
+            return true;
+        }
+
+        if (std::isinf(value)) {
+            writer.write_ref(value < 0 ? 4 : 3, value < 0 ? "-inf" : "inf");
+            return true;
+        }
+
+    #if defined(__MINGW32__) || (defined(_MSC_VER) && _MSC_VER < 1900)
+        unsigned int prevOutputFormat = _set_output_format(_TWO_DIGIT_EXPONENT);
+    #endif
+
+        char buffer[32];
+        const auto length = snprintf(buffer, sizeof(buffer), "%.*g", std::numeric_limits<F>::digits10, double(value));
+
+    #if defined(__MINGW32__) || (defined(_MSC_VER) && _MSC_VER < 1900)
+        _set_output_format(prevOutputFormat);
+    #endif
+
+        // negative zero is formatted without its sign
+        const auto skip = (value == 0 && buffer[0] == '-') ? 1 : 0;
+
+        writer.write(size_t(length - skip), buffer + skip);
+        return true;
+    }
+
+    SP_ENGINE bool format_default(IWriter& writer, float value)
+    {
+        return format_default_float(writer, value);
+    }
+
+    SP_ENGINE bool format_default(IWriter& writer, double value)
+    {
+        return format_default_float(writer, value);
+    }
+
+    SP_ENGINE bool format_default(IWriter& writer, char32_t value)
+    {
+        if (value >= 0x80) {
+            return format_value(writer, FormatFlags{}, value);
+        }
+
+        const char ch = char(value);
+        writer.write(1, &ch);
+        return true;
+    }
+
+    SP_ENGINE bool format_default(IWriter& writer, unsigned long long value)
+    {
+        char buffer[20];
+        const auto end = buffer + sizeof(buffer);
+        const auto digits = write_decimal(end, uint64_t(value));
+
+        writer.write(size_t(end - digits), digits);
+        return true;
+    }
+
+    SP_ENGINE bool format_default(IWriter& writer, long long value)
+    {
+        char buffer[21];
+        const auto end = buffer + sizeof(buffer);
+        const auto abs = (value >= 0 || value == std::numeric_limits<long long>::min())
+            ? uint64_t(value)
+            : uint64_t(-value);
+        auto digits = write_decimal(end, abs);
+
+        if (value < 0) {
+            *(--digits) = '-';
+        }
+
+        writer.write(size_t(end - digits), digits);
+        return true;
+    }
+
+    SP_ENGINE bool format_default(IWriter& writer, const StringView& value)
+    {
+        writer.write(size_t(value.length), value.ptr);
+        return true;
+    }
+
+    SP_ENGINE bool format_default(IWriter& writer, const Decimal& value)
+    {
+        return format_value(writer, FormatFlags{}, value);
+    }
+
+#if defined(SP_HAS_INT128)
+    SP_ENGINE bool format_default(IWriter& writer, uint128_t value)
+    {
+        char buffer[39];
+        const auto end = buffer + sizeof(buffer);
+        const auto digits = write_decimal(end, value);
+
+        writer.write(size_t(end - digits), digits);
+        return true;
+    }
+
+    SP_ENGINE bool format_default(IWriter& writer, int128_t value)
+    {
+        char buffer[40];
+        const auto end = buffer + sizeof(buffer);
+        const auto abs = (value < 0) ? uint128_t(0) - uint128_t(value) : uint128_t(value);
+        auto digits = write_decimal(end, abs);
+
+        if (value < 0) {
+            *(--digits) = '-';
+        }
+
+        writer.write(size_t(end - digits), digits);
+        return true;
+    }
+#endif
+
+#endif
+
+    template <class T>
+    bool format_default(IWriter& writer, T* value)
+    {
+        char buffer[16];
+        const auto end = buffer + sizeof(buffer);
+        auto digits = end;
+        auto v = uint64_t(value);
+
+        do {
+            *(--digits) = "0123456789abcdef"[v & 0xf];
+            v >>= 4;
+        } while (v);
+
+        writer.write(size_t(end - digits), digits);
+        return true;
+    }
+
+    template <class T>
+    bool parse_and_format(IWriter& writer, const StringView& fmt, const T& value)
+    {
+        FormatFlags flags;
+
+        return parse_format(fmt, &flags)
+            && format_value(writer, flags, value);
+    }
+
+    template <class T>
+    struct Formatter {
+        StringView spec;
+
+        bool parse(const StringView& fmt)
+        {
+            spec = fmt;
+            return true;
+        }
+
+        bool format(IWriter& writer, const T& value) const
+        {
+            return format_value(writer, spec, value);
+        }
+    };
+
+    struct BuiltinFormatterTag {
+    };
+
+    /// Formatter for built-in types, which parses the format spec into
+    /// `FormatFlags` once, and formats values as `Base`. Empty specs are
+    /// formatted through `format_default`.
+    template <class T, class Base>
+    struct BuiltinFormatter : BuiltinFormatterTag {
+        typedef Base BaseType;
+
+        FormatFlags flags;
+        bool isDefault = false;
+
+        bool parse(const StringView& fmt)
+        {
+            isDefault = !fmt.length;
+            return parse_format(fmt, &flags);
+        }
+
+        bool format(IWriter& writer, const T& value) const
+        {
+            return isDefault
+                ? format_default(writer, Base(value))
+                : format_value(writer, flags, Base(value));
+        }
+    };
+
+    template <> struct Formatter<std::nullptr_t> : BuiltinFormatter<std::nullptr_t, void*> {};
+    template <> struct Formatter<bool> : BuiltinFormatter<bool, bool> {};
+    template <> struct Formatter<float> : BuiltinFormatter<float, float> {};
+    template <> struct Formatter<double> : BuiltinFormatter<double, double> {};
+    template <> struct Formatter<char> : BuiltinFormatter<char, char32_t> {};
+    template <> struct Formatter<char16_t> : BuiltinFormatter<char16_t, char32_t> {};
+    template <> struct Formatter<char32_t> : BuiltinFormatter<char32_t, char32_t> {};
+    template <> struct Formatter<wchar_t> : BuiltinFormatter<wchar_t, char32_t> {};
+    template <> struct Formatter<signed char> : BuiltinFormatter<signed char, long long> {};
+    template <> struct Formatter<unsigned char> : BuiltinFormatter<unsigned char, unsigned long long> {};
+    template <> struct Formatter<short> : BuiltinFormatter<short, long long> {};
+    template <> struct Formatter<unsigned short> : BuiltinFormatter<unsigned short, unsigned long long> {};
+    template <> struct Formatter<int> : BuiltinFormatter<int, long long> {};
+    template <> struct Formatter<unsigned> : BuiltinFormatter<unsigned, unsigned long long> {};
+    template <> struct Formatter<long> : BuiltinFormatter<long, long long> {};
+    template <> struct Formatter<unsigned long> : BuiltinFormatter<unsigned long, unsigned long long> {};
+    template <> struct Formatter<long long> : BuiltinFormatter<long long, long long> {};
+    template <> struct Formatter<unsigned long long> : BuiltinFormatter<unsigned long long, unsigned long long> {};
+    template <> struct Formatter<char*> : BuiltinFormatter<char*, StringView> {};
+    template <> struct Formatter<const char*> : BuiltinFormatter<const char*, StringView> {};
+    template <> struct Formatter<StringView> : BuiltinFormatter<StringView, StringView> {};
+    template <> struct Formatter<Decimal> : BuiltinFormatter<Decimal, Decimal> {};
+#if defined(SP_HAS_INT128)
+    template <> struct Formatter<int128_t> : BuiltinFormatter<int128_t, int128_t> {};
+    template <> struct Formatter<uint128_t> : BuiltinFormatter<uint128_t, uint128_t> {};
+#endif
+    template <class T> struct Formatter<T*> : BuiltinFormatter<T*, T*> {};
+
+    class EnumNames {
+    public:
+        /// Build the lookup from `entries`, which are sorted by value in
+        /// place. If several enumerators share a value, the first registered
+        /// name is used.
+        EnumNames(EnumName entries[], size_t count)
+            : m_entries(entries)
+            , m_count(0)
+            , m_isDense(false)
+        {
+            const auto less = [](const EnumName& a, const EnumName& b) {
+                return a.value < b.value;
+            };
+            const auto same = [](const EnumName& a, const EnumName& b) {
+                return a.value == b.value;
+            };
+
+            std::stable_sort(entries, entries + count, less);
+            m_count = size_t(std::unique(entries, entries + count, same) - entries);
+
+            // contiguous values are looked up by index, others by a binary
+            // search
+            m_isDense = m_count && uint64_t(entries[m_count - 1].value) - uint64_t(entries[0].value) == m_count - 1;
+        }
+
+        /// Return the name of `value`, or an empty view if no enumerator has
+        /// that value.
+        StringView find(long long value) const
+        {
+            if (m_isDense) {
+                const auto index = uint64_t(value) - uint64_t(m_entries[0].value);
+                return (index < m_count) ? m_entries[index].name : StringView();
+            }
+
+            const auto term = m_entries + m_count;
+            const auto entry = std::lower_bound(m_entries, term, value, [](const EnumName& a, long long b) {
+                return a.value < b;
+            });
+
+            return (entry != term && entry->value == value) ? entry->name : StringView();
+        }
+
+    private:
+        const EnumName* m_entries;
+        size_t m_count;
+        bool m_isDense;
+    };
+
+    /// Formatter for enums registered with `SP_ENUM`. Values are formatted
+    /// by name like strings, or by value with the integer presentations.
+    template <class T>
+    struct EnumFormatter {
+        FormatFlags flags;
+        bool isName = true;
+        bool isDefault = false;
+
+        bool parse(const StringView& fmt)
+        {
+            isDefault = !fmt.length;
+
+            if (!parse_format(fmt, &flags)) {
+                return false;
+            }
+
+            switch (flags.type) {
+            case 'b':
+            case 'c':
+            case 'd':
+            case 'o':
+            case 'x':
+            case 'X':
+                isName = false;
+                break;
+            }
+
+            return true;
+        }
+
+        bool format(IWriter& writer, const T& value) const
+        {
+            typedef typename std::underlying_type<T>::type Underlying;
+
+            const auto number = static_cast<Underlying>(value);
+
+            if (isName) {
+                const auto name = Formatter<T>::names().find(static_cast<long long>(number));
+
+                if (name.length && isDefault) {
+                    writer.write_ref(size_t(name.length), name.ptr);
+                    return true;
+                } else if (name.length) {
+                    return format_string(writer, flags, name, true);
+                }
+            }
+
+            return std::is_signed<Underlying>::value
+                ? format_value(writer, flags, static_cast<long long>(number))
+                : format_value(writer, flags, static_cast<unsigned long long>(number));
+        }
+    };
+
+    /// A point in time or duration, split in whole seconds and nanoseconds.
+    struct ChronoValue {
+        int64_t seconds;
+        int32_t nanoseconds;
+    };
+
+    /// Output buffer used while rendering chrono patterns. Fields that only
+    /// depend on the sub-second part are recorded while the output still
+    /// fits in `text`, so that cached output can be patched in place.
+    struct ChronoOutput {
+        static const int32_t MAX_LENGTH = 128;
+        static const int32_t MAX_SUBSECONDS = 4;
+
+        struct Subsecond {
+            int32_t offset;
+            int32_t digits;
+        };
+
+        IWriter* writer;
+        char text[MAX_LENGTH];
+        int32_t length;
+        Subsecond subseconds[MAX_SUBSECONDS];
+        int32_t subsecondCount;
+        bool complete;
+        bool cacheable; //< Whether every sub-second field was recorded.
+    };
+
+    /// Per-thread copy of the last rendered time point, keyed by its pattern
+    /// and second.
+    struct ChronoCache {
+        static const int32_t MAX_PATTERN = 64;
+
+        char pattern[MAX_PATTERN];
+        int32_t patternLength;
+        int64_t seconds;
+        ChronoOutput output;
+    };
+
+    SP_ENGINE ChronoCache& chrono_cache();
+    SP_ENGINE void write_fixed(char* ptr, uint32_t value, int32_t width);
+    SP_ENGINE bool parse_chrono(const StringView& pattern, bool allowDate);
+    SP_ENGINE void render_chrono(ChronoOutput* out, const StringView& pattern, const ChronoValue& value, bool isDate);
+
+#if SP_DEFINE_ENGINE
+    SP_ENGINE ChronoCache& chrono_cache()
+    {
+        static SP_THREAD_LOCAL ChronoCache cache;
+        return cache;
+    }
+
+    inline void chrono_write(ChronoOutput* out, const char* data, int32_t length)
+    {
+        if (out->complete && out->length + length <= ChronoOutput::MAX_LENGTH) {
+            std::memcpy(out->text + out->length, data, size_t(length));
+            out->length += length;
+            return;
+        }
+
+        // no longer fits, stream the rest of the output directly
+        if (out->complete) {
+            out->writer->write(size_t(out->length), out->text);
+            out->complete = false;
+        }
+
+        out->writer->write(size_t(length), data);
+    }
+
+    /// Write `value` as exactly `width` zero padded digits.
+    SP_ENGINE void write_fixed(char* ptr, uint32_t value, int32_t width)
+    {
+        for (auto i = width - 1; i >= 0; --i) {
+            ptr[i] = char('0' + value % 10);
+            value /= 10;
+        }
+    }
+
+    inline void chrono_write_fixed(ChronoOutput* out, uint32_t value, int32_t width)
+    {
+        char buffer[9];
+        write_fixed(buffer, value, width);
+        chrono_write(out, buffer, width);
+    }
+
+    /// Convert days since 1970-01-01 to a proleptic Gregorian date.
+    inline void civil_from_days(int64_t days, int64_t* year, uint32_t* month, uint32_t* day)
+    {
+        days += 719468;
+        const auto era = (days >= 0 ? days : days - 146096) / 146097;
+        const auto doe = uint32_t(days - era * 146097);
+        const auto yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+        const auto doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+        const auto mp = (5 * doy + 2) / 153;
+
+        *day = doy - (153 * mp + 2) / 5 + 1;
+        *month = mp < 10 ? mp + 3 : mp - 9;
+        *year = int64_t(yoe) + era * 400 + (*month <= 2);
+    }
+
+    /// Check that `pattern` only uses supported conversions. Date conversions
+    /// are only valid for time points.
+    SP_ENGINE bool parse_chrono(const StringView& pattern, bool allowDate)
+    {
+        const auto term = pattern.ptr + pattern.length;
+
+        for (auto ptr = pattern.ptr; ptr < term; ++ptr) {
+            if (*ptr != '%') {
+                continue;
+            }
+
+            if (++ptr == term) {
+                return false;
+            }
+
+            switch (*ptr) {
+            case 'Y':
+            case 'm':
+            case 'd':
+            case 'F':
+                if (!allowDate) {
+                    return false;
+                }
+                break;
+            case 'H':
+            case 'M':
+            case 'S':
+            case 'T':
+            case 'L':
+            case 'f':
+            case 'N':
+            case '%':
+                break;
+            default:
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    /// Render a pattern previously validated by `parse_chrono`. For time
+    /// points, `value` is relative to the Unix epoch; for durations `%H` is
+    /// the total amount of hours.
+    SP_ENGINE void render_chrono(ChronoOutput* out, const StringView& pattern, const ChronoValue& value, bool isDate)
+    {
+        const auto days = (value.seconds >= 0 ? value.seconds : value.seconds - 86399) / 86400;
+        const auto secondOfDay = uint32_t(value.seconds - days * 86400);
+        const auto hours = isDate ? uint64_t(secondOfDay / 3600) : uint64_t(value.seconds / 3600);
+        const auto minutes = (secondOfDay / 60) % 60;
+        const auto seconds = secondOfDay % 60;
+
+        int64_t year = 0;
+        uint32_t month = 0;
+        uint32_t day = 0;
+
+        if (isDate) {
+            civil_from_days(days, &year, &month, &day);
+        }
+
+        const auto subsecond = [&](int32_t digits) {
+            if (out->complete && out->subsecondCount < ChronoOutput::MAX_SUBSECONDS) {
+                out->subseconds[out->subsecondCount++] = ChronoOutput::Subsecond{ out->length, digits };
+            } else {
+                out->cacheable = false;
+            }
+
+            auto ns = uint32_t(value.nanoseconds);
+            for (auto i = digits; i < 9; ++i) {
+                ns /= 10;
+            }
+
+            chrono_write_fixed(out, ns, digits);
+        };
+
+        const auto writeYear = [&]() {
+            char buffer[21];
+            const auto end = buffer + sizeof(buffer);
+            auto digits = write_decimal(end, uint64_t(year < 0 ? -year : year));
+
+            while (end - digits < 4) {
+                *(--digits) = '0';
+            }
+
+            if (year < 0) {
+                *(--digits) = '-';
+            }
+
+            chrono_write(out, digits, int32_t(end - digits));
+        };
+
+        const auto writeHours = [&]() {
+            if (hours < 100) {
+                chrono_write_fixed(out, uint32_t(hours), 2);
+            } else {
+                char buffer[20];
+                const auto end = buffer + sizeof(buffer);
+                const auto digits = write_decimal(end, hours);
+                chrono_write(out, digits, int32_t(end - digits));
+            }
+        };
+
+        const auto term = pattern.ptr + pattern.length;
+        auto literal = pattern.ptr;
+
+        for (auto ptr = pattern.ptr; ptr < term; ++ptr) {
+            if (*ptr != '%') {
+                continue;
+            }
+
+            chrono_write(out, literal, int32_t(ptr - literal));
+            literal = (++ptr) + 1;
+
+            switch (*ptr) {
+            case 'Y':
+                writeYear();
+                break;
+            case 'm':
+                chrono_write_fixed(out, month, 2);
+                break;
+            case 'd':
+                chrono_write_fixed(out, day, 2);
+                break;
+            case 'F':
+                writeYear();
+                chrono_write(out, "-", 1);
+                chrono_write_fixed(out, month, 2);
+                chrono_write(out, "-", 1);
+                chrono_write_fixed(out, day, 2);
+                break;
+            case 'H':
+                writeHours();
+                break;
+            case 'M':
+                chrono_write_fixed(out, minutes, 2);
+                break;
+            case 'S':
+                chrono_write_fixed(out, seconds, 2);
+                break;
+            case 'T':
+                writeHours();
+                chrono_write(out, ":", 1);
+                chrono_write_fixed(out, minutes, 2);
+                chrono_write(out, ":", 1);
+                chrono_write_fixed(out, seconds, 2);
+                break;
+            case 'L':
+                subsecond(3);
+                break;
+            case 'f':
+                subsecond(6);
+                break;
+            case 'N':
+                subsecond(9);
+                break;
+            case '%':
+                chrono_write(out, "%", 1);
+                break;
+            }
+        }
+
+        chrono_write(out, literal, int32_t(term - literal));
+    }
+
+#endif
+
+    template <class Rep, class Period>
+    ChronoValue to_chrono_value(const std::chrono::duration<Rep, Period>& value)
+    {
+        using namespace std::chrono;
+
+        // round towards negative infinity, so that the sub-second part is
+        // always positive
+        auto secs = duration_cast<seconds>(value);
+
+        if (secs > value) {
+            secs -= seconds(1);
+        }
+
+        return ChronoValue{ int64_t(secs.count()), int32_t(duration_cast<nanoseconds>(value - secs).count()) };
+    }
+
+    /// Formatter for `std::chrono::system_clock` time points, rendered as UTC.
+    /// The spec is a strftime-like pattern, defaulting to `%F %T`. Rendered
+    /// output is cached per thread, so that consecutive time points within
+    /// the same second only re-render their sub-second digits.
+    template <class Duration>
+    struct Formatter<std::chrono::time_point<std::chrono::system_clock, Duration>> {
+        StringView pattern;
+
+        bool parse(const StringView& fmt)
+        {
+            pattern = fmt.length ? fmt : StringView("%F %T");
+            return parse_chrono(pattern, true);
+        }
+
+        bool format(IWriter& writer, const std::chrono::time_point<std::chrono::system_clock, Duration>& value) const
+        {
+            const auto time = to_chrono_value(value.time_since_epoch());
+
+            if (pattern.length > ChronoCache::MAX_PATTERN) {
+                ChronoOutput out;
+                out.writer = &writer;
+                out.length = 0;
+                out.subsecondCount = 0;
+                out.complete = true;
+                out.cacheable = true;
+
+                render_chrono(&out, pattern, time, true);
+
+                if (out.complete) {
+                    writer.write(size_t(out.length), out.text);
+                }
+
+                return true;
+            }
+
+            auto& cache = chrono_cache();
+            auto& out = cache.output;
+
+            const bool hit = cache.seconds == time.seconds
+                && cache.patternLength == pattern.length
+                && !std::memcmp(cache.pattern, pattern.ptr, size_t(pattern.length));
+
+            if (hit) {
+                for (auto i = 0; i < out.subsecondCount; ++i) {
+                    const auto& field = out.subseconds[i];
+                    auto ns = uint32_t(time.nanoseconds);
+
+                    for (auto j = field.digits; j < 9; ++j) {
+                        ns /= 10;
+                    }
+
+                    write_fixed(out.text + field.offset, ns, field.digits);
+                }
+            } else {
+                out.writer = &writer;
+                out.length = 0;
+                out.subsecondCount = 0;
+                out.complete = true;
+                out.cacheable = true;
+
+                render_chrono(&out, pattern, time, true);
+
+                // output that couldn't be patched in place isn't cached
+                if (!out.complete || !out.cacheable) {
+                    cache.patternLength = 0;
+
+                    if (out.complete) {
+                        writer.write(size_t(out.length), out.text);
+                    }
+                    return true;
+                }
+
+                std::memcpy(cache.pattern, pattern.ptr, size_t(pattern.length));
+                cache.patternLength = pattern.length;
+                cache.seconds = time.seconds;
+            }
+
+            writer.write(size_t(out.length), out.text);
+            return true;
+        }
+    };
+
+    /// Suffix for durations with the unit `Period`.
+    template <class Period>
+    void write_duration_suffix(IWriter& writer)
+    {
+        if (Period::num == 1 && Period::den == 1000000000) {
+            writer.write_ref(2, "ns");
+        } else if (Period::num == 1 && Period::den == 1000000) {
+            writer.write_ref(2, "us");
+        } else if (Period::num == 1 && Period::den == 1000) {
+            writer.write_ref(2, "ms");
+        } else if (Period::num == 1 && Period::den == 1) {
+            writer.write_ref(1, "s");
+        } else if (Period::num == 60 && Period::den == 1) {
+            writer.write_ref(3, "min");
+        } else if (Period::num == 3600 && Period::den == 1) {
+            writer.write_ref(1, "h");
+        } else if (Period::den == 1) {
+            format(writer, "[{}]s", (long long)Period::num);
+        } else {
+            format(writer, "[{}/{}]s", (long long)Period::num, (long long)Period::den);
+        }
+    }
+
+    /// Formatter for durations. Specs containing `%` are patterns like for
+    /// time points, without the date conversions. Any other spec formats the
+    /// count like a `Rep` would be, followed by the unit, e.g. `15ms`.
+    template <class Rep, class Period>
+    struct Formatter<std::chrono::duration<Rep, Period>> {
+        Formatter<Rep> count;
+        StringView pattern;
+
+        bool parse(const StringView& fmt)
+        {
+            for (auto i = 0; i < fmt.length; ++i) {
+                if (fmt.ptr[i] == '%') {
+                    pattern = fmt;
+                    return parse_chrono(pattern, false);
+                }
+            }
+
+            return count.parse(fmt);
+        }
+
+        bool format(IWriter& writer, const std::chrono::duration<Rep, Period>& value) const
+        {
+            if (!pattern.length) {
+                if (!count.format(writer, value.count())) {
+                    return false;
+                }
+
+                write_duration_suffix<Period>(writer);
+                return true;
+            }
+
+            auto time = to_chrono_value(value);
+
+            if (time.seconds < 0) {
+                writer.write(1, "-");
+                time = (time.nanoseconds > 0)
+                    ? ChronoValue{ -time.seconds - 1, 1000000000 - time.nanoseconds }
+                    : ChronoValue{ -time.seconds, 0 };
+            }
+
+            ChronoOutput out;
+            out.writer = &writer;
+            out.length = 0;
+            out.subsecondCount = 0;
+            out.complete = true;
+            out.cacheable = false;
+
+            render_chrono(&out, pattern, time, false);
+
+            if (out.complete) {
+                writer.write(size_t(out.length), out.text);
+            }
+
+            return true;
+        }
+    };
+
+    template <class T>
+    bool format_arg(IWriter& writer, const StringView& spec, const T& value, std::false_type)
+    {
+        Formatter<T> formatter;
+
+        return formatter.parse(spec)
+            && formatter.format(writer, value);
+    }
+
+    template <class T>
+    bool format_arg(IWriter& writer, const StringView& spec, const T& value, std::true_type)
+    {
+        if (!spec.length) {
+            return format_default(writer, typename Formatter<T>::BaseType(value));
+        }
+
+        return format_arg(writer, spec, value, std::false_type());
+    }
+
+    template <class T>
+    bool format_arg(IWriter& writer, const StringView& spec, const T& value)
+    {
+        return format_arg(writer, spec, value, std::is_base_of<BuiltinFormatterTag, Formatter<T>>());
+    }
+
+    template <class T>
+    struct NamedArg {
+        StringView name;
+        const T& value;
+    };
+
+    template <class T>
+    NamedArg<T> arg(const StringView& name, const T& value)
+    {
+        return NamedArg<T>{ name, value };
+    }
+
+    template <class T>
+    struct Formatter<NamedArg<T>> {
+        Formatter<T> formatter;
+
+        bool parse(const StringView& fmt)
+        {
+            return formatter.parse(fmt);
+        }
+
+        bool format(IWriter& writer, const NamedArg<T>& value) const
+        {
+            return formatter.format(writer, value.value);
+        }
+    };
+
+    template <class F>
+    struct Lazy {
+        mutable F func;
+    };
+
+    template <class F>
+    Lazy<typename std::decay<F>::type> lazy(F&& func)
+    {
+        return Lazy<typename std::decay<F>::type>{ std::forward<F>(func) };
+    }
+
+    template <class F>
+    struct Formatter<Lazy<F>> {
+        typedef typename std::decay<decltype(std::declval<F&>()())>::type Result;
+
+        Formatter<Result> formatter;
+
+        bool parse(const StringView& fmt)
+        {
+            return formatter.parse(fmt);
+        }
+
+        bool format(IWriter& writer, const Lazy<F>& value) const
+        {
+            return formatter.format(writer, value.func());
+        }
+    };
+
+    template <class T>
+    bool has_name(const T&, const StringView&)
+    {
+        return false;
+    }
+
+    template <class T>
+    bool has_name(const NamedArg<T>& arg, const StringView& name)
+    {
+        return arg.name.length == name.length
+            && !std::memcmp(arg.name.ptr, name.ptr, size_t(name.length));
+    }
+
+    inline int32_t find_named(const StringView&, int32_t)
+    {
+        return -1;
+    }
+
+    /// Find the index of the argument with the provided name, or `-1`.
+    template <class Arg, class... Rest>
+    int32_t find_named(const StringView& name, int32_t index, const Arg& arg, const Rest&... rest)
+    {
+        return has_name(arg, name)
+            ? index
+            : find_named(name, index + 1, rest...);
+    }
+
+    /// Type-erased format argument. Format strings are processed against
+    /// arrays of these, so that only the argument conversion is instantiated
+    /// per call signature.
+    struct FormatArg {
+        const void* value = nullptr; //< Address of the argument.
+        StringView name; //< Argument name, for named arguments.
+        bool (*format)(IWriter& writer, const StringView& spec, const void* value) = nullptr;
+    };
+
+    template <class T>
+    StringView arg_name(const T&)
+    {
+        return StringView();
+    }
+
+    template <class T>
+    StringView arg_name(const NamedArg<T>& arg)
+    {
+        return arg.name;
+    }
+
+    template <class T>
+    bool format_erased(IWriter& writer, const StringView& spec, const void* value)
+    {
+        return format_arg<typename std::decay<T>::type>(writer, spec, *static_cast<T*>(const_cast<void*>(value)));
+    }
+
+    template <class Arg>
+    FormatArg make_format_arg(Arg&& arg)
+    {
+        typedef typename std::remove_reference<Arg>::type Value;
+
+        FormatArg result;
+        result.value = &arg;
+        result.name = arg_name(arg);
+        result.format = &format_erased<Value>;
+        return result;
+    }
+
+    template <class... Args>
+    int32_t print(const StringView& fmt, Args&&... args)
+    {
+        return format(stdout, fmt, std::forward<Args>(args)...);
+    }
+
+    struct FormatToken {
+        StringView text; //< Raw text of the token.
+        StringView spec; //< Format spec, if this is a replacement field.
+        StringView name; //< Argument name, for named replacement fields.
+        int32_t index = -1; //< Argument index, or `-1` if this is literal text or a named field.
+        bool nested = false; //< Whether the format spec has nested replacement fields.
+    };
+
+    /// Read the next token from the provided format string, starting at the
+    /// provided offset, and advance the offset past it. Tokens are either
+    /// literal text, to be written as-is, or replacement fields. Invalid
+    /// replacement fields are returned as literal text. Return `false` once
+    /// the end of the format string has been reached.
+    SP_ENGINE bool next_token(const StringView& fmt, int32_t* offset, int32_t* prevIndex, FormatToken* token);
+
+    SP_CONSTEXPR bool basic_next_token(const StringView& fmt, int32_t* offset, int32_t* prevIndex, FormatToken* token)
+    {
+        const auto start = fmt.ptr + *offset;
+        const auto term = fmt.ptr + fmt.length;
+
+        if (start >= term) {
+            return false;
+        }
+
+        *token = FormatToken{};
+
+        const auto literal = [&](const char* end, const char* resume) {
+            token->text = StringView(start, int32_t(end - start));
+            *offset = int32_t(resume - fmt.ptr);
+            return true;
+        };
+
+        auto next = start;
+
+        while (next < term) {
+            const auto ptr = next++;
+
+            if (*ptr == '}') {
+                // `}}` is an escaped `}`, but a lone `}` is written as-is too
+                return literal(next, (next < term && *next == '}') ? next + 1 : next);
+            }
+
+            if (*ptr != '{') {
+                continue;
+            }
+
+            if (next < term && *next == '{') {
+                return literal(next, next + 1);
+            }
+
+            // write the preceding text first, so that the field becomes its
+            // own token
+            if (ptr != start || next == term) {
+                return literal((ptr != start) ? ptr : next, (ptr != start) ? ptr : next);
+            }
+
+            // index or name
+            const auto isNameChar = [](char ch, bool first) {
+                return (ch >= 'a' && ch <= 'z')
+                    || (ch >= 'A' && ch <= 'Z')
+                    || ch == '_'
+                    || (!first && ch >= '0' && ch <= '9');
+            };
+
+            auto index = -1;
+            const auto nameStart = next;
+
+            if (next < term && isNameChar(*next, true)) {
+                while (next < term && isNameChar(*next, false)) {
+                    ++next;
+                }
+            } else {
+                // indices saturate rather than overflow, as no call has that
+                // many arguments anyway
+                while (next < term && *next >= '0' && *next <= '9') {
+                    index = (index < 0)
+                        ? (*next - '0')
+                        : (index < 100000000) ? (index * 10) + (*next - '0') : index;
+                    ++next;
+                }
+            }
+
+            if (next == term) {
+                return literal(term, term);
+            }
+
+            const auto name = StringView(nameStart, int32_t(next - nameStart));
+            const auto isNamed = (index < 0) && name.length;
+
+            // named fields advance the previous index like non-indexed ones,
+            // until resolved against the arguments. Those that aren't keep
+            // the index they would have had before names were supported.
+            if (index < 0) {
+                index = *prevIndex + 1;
+            }
+            *prevIndex = index;
+
+            // marker and format spec, which may contain nested fields
+            const char* specStart = nullptr;
+
+            if (*next == ':') {
+                specStart = ++next;
+                auto opened = 0;
+                auto deepest = 0;
+
+                for (; next < term; ++next) {
+                    if (*next == '{') {
+                        deepest = (++opened > deepest) ? opened : deepest;
+                        token->nested = true;
+                    } else if (*next == '}') {
+                        if (!opened) {
+                            break;
+                        }
+                        --opened;
+                    }
+                }
+
+                if (next == term) {
+                    token->nested = false;
+                    return literal(term, term);
+                }
+
+                // nested fields are formatted recursively, so their depth is
+                // bounded
+                if (deepest > SP_MAX_NESTING) {
+                    token->nested = false;
+                    return literal(next + 1, next + 1);
+                }
+            }
+
+            // closer
+            if (*next != '}') {
+                return literal(next + 1, next + 1);
+            }
+
+            token->index = isNamed ? -1 : index;
+            token->name = isNamed ? name : StringView();
+            token->spec = specStart
+                ? StringView(specStart, int32_t(next - specStart))
+                : StringView();
+            return literal(next + 1, next + 1);
+        }
+
+        return literal(term, term);
+    }
+
+#if SP_DEFINE_ENGINE
+    SP_ENGINE bool next_token(const StringView& fmt, int32_t* offset, int32_t* prevIndex, FormatToken* token)
+    {
+        return basic_next_token(fmt, offset, prevIndex, token);
+    }
+#endif
+
+    /// Null-terminated string of up to `N` `char`s, stored inline. It can be
+    /// written to like a writer, which truncates anything beyond `N`.
+    template <size_t N>
+    struct FixedString {
+        char data[N + 1] = {}; //< Contents, followed by a null terminator.
+        size_t length = 0; //< Amount of `char`s in `data`.
+
+        SP_CONSTEXPR size_t write(size_t count, const char* str)
+        {
+            const auto toWrite = std::min(count, N - length);
+
+            for (size_t i = 0; i < toWrite; ++i) {
+                data[length + i] = str[i];
+            }
+
+            length += toWrite;
+            return toWrite;
+        }
+
+        SP_CONSTEXPR size_t write_ref(size_t count, const char* str)
+        {
+            return write(count, str);
+        }
+
+        constexpr bool stopped() const
+        {
+            return length == N;
+        }
+
+        constexpr const char* c_str() const
+        {
+            return data;
+        }
+
+        constexpr size_t size() const
+        {
+            return length;
+        }
+
+        static constexpr size_t capacity()
+        {
+            return N;
+        }
+
+        constexpr operator StringView() const
+        {
+            return StringView(data, int32_t(length));
+        }
+    };
+
+    SP_CONSTEXPR int32_t string_length(const char* str)
+    {
+        int32_t length = 0;
+
+        while (str[length]) {
+            ++length;
+        }
+
+        return length;
+    }
+
+    // The values `format_to_fixed` formats arguments as. Like the built-in
+    // formatters, but without measuring strings with `std::strlen`.
+    template <class T>
+    constexpr typename Formatter<T>::BaseType fixed_base(const T& value)
+    {
+        return typename Formatter<T>::BaseType(value);
+    }
+
+    constexpr StringView fixed_base(const StringView& value)
+    {
+        return value;
+    }
+
+    SP_CONSTEXPR StringView fixed_base(const char* value)
+    {
+        return StringView(value, string_length(value));
+    }
+
+    SP_CONSTEXPR StringView fixed_base(char* value)
+    {
+        return StringView(value, string_length(value));
+    }
+
+    /// Writer appending to a `FixedString`, for the formatters that are only
+    /// written against `IWriter`.
+    template <size_t N>
+    class FixedStringWriter : public IWriter {
+    public:
+        explicit FixedStringWriter(FixedString<N>& string)
+            : m_string(string)
+        {
+        }
+
+        size_t write(size_t length, const void* data) override
+        {
+            return m_string.write(length, static_cast<const char*>(data));
+        }
+
+        bool stopped() const override
+        {
+            return m_string.stopped();
+        }
+
+    private:
+        FixedString<N>& m_string;
+    };
+
+    template <class Writer, class T>
+    SP_CONSTEXPR bool format_fixed_value(Writer& writer, const FormatFlags& flags, const T& value)
+    {
+        return basic_format_value(writer, flags, value);
+    }
+
+    template <size_t N>
+    bool format_fixed_value(FixedString<N>& string, const FormatFlags& flags, float value)
+    {
+        FixedStringWriter<N> writer(string);
+        return format_value(writer, flags, value);
+    }
+
+    template <size_t N>
+    bool format_fixed_value(FixedString<N>& string, const FormatFlags& flags, double value)
+    {
+        FixedStringWriter<N> writer(string);
+        return format_value(writer, flags, value);
+    }
+
+    template <size_t N>
+    bool format_fixed_value(FixedString<N>& string, const FormatFlags& flags, const Decimal& value)
+    {
+        FixedStringWriter<N> writer(string);
+        return format_value(writer, flags, value);
+    }
+
+    template <class Writer>
+    constexpr bool format_fixed_index(Writer&, const StringView&, int32_t)
+    {
+        return false;
+    }
+
+    template <class Writer, class Arg, class... Rest>
+    SP_CONSTEXPR bool format_fixed_index(Writer& writer, const StringView& spec, int32_t index, const Arg& arg, const Rest&... rest)
+    {
+        if (index) {
+            return format_fixed_index(writer, spec, index - 1, rest...);
+        }
+
+        FormatFlags flags;
+
+        return basic_parse_format(spec, &flags)
+            && format_fixed_value(writer, flags, fixed_base(arg));
+    }
+
+    template <size_t N, class... Args>
+    SP_CONSTEXPR void format_fixed_string(FixedString<N>& result, const StringView& fmt, const Args&... args)
+    {
+        FormatToken token;
+        int32_t offset = 0;
+        int32_t prevIndex = -1;
+
+        while (basic_next_token(fmt, &offset, &prevIndex, &token)) {
+            const bool isField = token.index >= 0 && !token.nested;
+
+            if (!isField || !format_fixed_index(result, token.spec, token.index, args...)) {
+                result.write(size_t(token.text.length), token.text.ptr);
+            }
+        }
+    }
+
+    template <size_t N, size_t M, class... Args>
+    SP_CONSTEXPR FixedString<N> format_to_fixed(const char (&fmt)[M], const Args&... args)
+    {
+        FixedString<N> result;
+        format_fixed_string(result, StringView(fmt, int32_t(M - 1)), args...);
+        return result;
+    }
+
+#if defined(SP_HAS_CONSTEXPR)
+    /// Return the amount of decimal digits in `2^bits`, which bounds those of
+    /// any `bits`-bit value. `2^bits` is never a power of ten, so this is
+    /// `floor(bits * log10(2)) + 1`, with `log10(2)` rounded up.
+    constexpr int32_t decimal_digits(int32_t bits)
+    {
+        return int32_t((int64_t(bits) * 30103) / 100000) + 1;
+    }
+
+    // Maximum lengths of the values formatted by `format_fixed_value`, given
+    // the amount of value bits of the original argument type, or the maximum
+    // decimal exponent for floats. Zero if the value can't be formatted with
+    // `flags`, in which case the field is written as-is. The width is
+    // applied by `max_field_length`.
+
+    constexpr int32_t max_base_length(const FormatFlags& flags, const unsigned long long*, int32_t bits)
+    {
+        if (flags.grouping) {
+            return 0;
+        }
+
+        switch (flags.type) {
+        case 'j':
+        case 'q':
+        case 'v':
+            return 0;
+        case 'b':
+            return bits + 3;
+        case 'o':
+            return ((bits + 2) / 3) + 3;
         case 'x':
         case 'X':
-            base = 16;
+            return ((bits + 3) / 4) + 3;
+        case 'c':
+            // either the char itself, or its code as `(-0x...)`
+            return ((bits + 3) / 4) + 5;
+        default:
+            return decimal_digits(bits) + 1;
+        }
+    }
+
+    constexpr int32_t max_base_length(const FormatFlags& flags, const long long*, int32_t bits)
+    {
+        return max_base_length(flags, static_cast<const unsigned long long*>(nullptr), bits);
+    }
+
+#if defined(SP_HAS_INT128)
+    // `std::numeric_limits` isn't specialized for 128-bit integers in strict
+    // standard modes, so their bits are fixed here
+    constexpr int32_t max_base_length(const FormatFlags& flags, const int128_t*, int32_t)
+    {
+        return max_base_length(flags, static_cast<const unsigned long long*>(nullptr), 128);
+    }
+
+    constexpr int32_t max_base_length(const FormatFlags& flags, const uint128_t*, int32_t)
+    {
+        return max_base_length(flags, static_cast<const unsigned long long*>(nullptr), 128);
+    }
+#endif
+
+    constexpr int32_t max_base_length(const FormatFlags& flags, const char32_t*, int32_t)
+    {
+        auto charFlags = flags;
+
+        if (!charFlags.type) {
+            charFlags.type = 'c';
+        }
+
+        return max_base_length(charFlags, static_cast<const unsigned long long*>(nullptr), 32);
+    }
+
+    constexpr int32_t max_base_length(const FormatFlags& flags, const bool*, int32_t)
+    {
+        switch (flags.type) {
+        case 'b':
+        case 'c':
+        case 'd':
+        case 'o':
+        case 'x':
+        case 'X':
+            return max_base_length(flags, static_cast<const unsigned long long*>(nullptr), 1);
+        case 'j':
+        case 'q':
+        case 'v':
+            return 0;
+        default:
+            return flags.grouping ? 0 : (flags.precision >= 0) ? std::min(flags.precision, 5) : 5;
+        }
+    }
+
+    constexpr int32_t max_base_length(const FormatFlags& flags, const Decimal*, int32_t)
+    {
+        // the scale is only known at runtime, so only a precision bounds the
+        // amount of decimals
+        if (flags.precision < 0) {
+            return -1;
+        }
+
+        switch (flags.type) {
+        case 0:
+        case 'f':
+        case 'F':
+            // sign, up to 39 integer digits and 12 separators, point and
+            // decimals
+            return flags.precision + 53;
+        case '%':
+            return flags.precision + 54;
+        default:
+            return 0;
+        }
+    }
+
+    constexpr int32_t max_base_length(const FormatFlags& flags, const StringView*, int32_t)
+    {
+        if (flags.grouping) {
+            return 0;
+        }
+
+        if (flags.precision < 0) {
+            return -1;
+        }
+
+        switch (flags.type) {
+        case 'j':
+            return (flags.precision * 6) + 2;
+        case 'q':
+            return (flags.precision * 4) + 2;
+        case 'v':
+            return (flags.precision * 2) + 2;
+        default:
+            return flags.precision;
+        }
+    }
+
+    constexpr int32_t max_base_length(const FormatFlags& flags, const double*, int32_t maxExponent)
+    {
+        const auto precision = (flags.precision >= 0) ? flags.precision : 17;
+
+        if (flags.grouping) {
+            return 0;
+        }
+
+        switch (flags.type) {
+        case 'j':
+        case 'q':
+        case 'v':
+            return 0;
+        case 'f':
+        case 'F':
+            // sign, integer digits, point and decimals
+            return maxExponent + precision + 3;
+        case '%':
+            return maxExponent + precision + 6;
+        default:
+            // sign, digits, point and `e+XXX`, which also covers the
+            // shortest form of `g`, and nan/inf
+            return precision + 9;
+        }
+    }
+
+    constexpr int32_t max_base_length(const FormatFlags& flags, const float*, int32_t maxExponent)
+    {
+        return max_base_length(flags, static_cast<const double*>(nullptr), maxExponent);
+    }
+
+    template <class T>
+    constexpr int32_t max_value_length(const FormatFlags& flags)
+    {
+        typedef decltype(fixed_base(std::declval<const T&>())) Base;
+        typedef std::numeric_limits<typename std::decay<T>::type> Limits;
+
+        // the magnitude of a signed minimum needs the sign bit too
+        const auto bits = std::is_floating_point<Base>::value
+            ? Limits::max_exponent10 + 1
+            : Limits::digits + (Limits::is_signed ? 1 : 0);
+        const auto length = max_base_length(flags, static_cast<const Base*>(nullptr), bits);
+
+        return (length > 0) ? std::max(flags.width, length) : length;
+    }
+
+    template <int32_t = 0>
+    constexpr int32_t max_index_length(const FormatFlags&, int32_t)
+    {
+        return 0;
+    }
+
+    template <class Arg, class... Rest>
+    constexpr int32_t max_index_length(const FormatFlags& flags, int32_t index)
+    {
+        return index
+            ? max_index_length<Rest...>(flags, index - 1)
+            : max_value_length<Arg>(flags);
+    }
+
+    template <class... Args, class Fmt>
+    constexpr int32_t max_length(const Fmt&)
+    {
+        const auto fmt = Fmt::view();
+        FormatToken token;
+        int32_t offset = 0;
+        int32_t prevIndex = -1;
+        int32_t total = 0;
+
+        while (basic_next_token(fmt, &offset, &prevIndex, &token)) {
+            auto length = token.text.length;
+            FormatFlags flags;
+
+            if (token.index >= 0 && !token.nested && basic_parse_format(token.spec, &flags)) {
+                const auto field = max_index_length<Args...>(flags, token.index);
+
+                if (field < 0) {
+                    return -1;
+                }
+
+                length = std::max(length, field);
+            }
+
+            total += length;
+        }
+
+        return total;
+    }
+
+    template <class Fmt, class... Args>
+    constexpr auto format_fixed(const Fmt&, const Args&... args)
+    {
+        constexpr auto length = max_length<Args...>(Fmt());
+        static_assert(length >= 0, "string arguments to format_fixed need a precision, as in `{:.16}`");
+
+        FixedString<(length >= 0) ? size_t(length) : 0> result;
+        format_fixed_string(result, Fmt::view(), args...);
+        return result;
+    }
+#endif
+
+    /// Format the provided format string against type-erased arguments, and
+    /// return the offset into it at which formatting stopped. This is the
+    /// length of the format string, unless the writer stopped accepting
+    /// output.
+    SP_ENGINE int32_t vformat(IWriter& writer, const StringView& fmt, int32_t* prevIndex, const FormatArg* args, int32_t count);
+
+    /// Format a single replacement field against type-erased arguments.
+    /// Return `false` if the field could not be formatted.
+    SP_ENGINE bool vformat_field(IWriter& writer, const FormatToken& token, int32_t* prevIndex, const FormatArg* args, int32_t count);
+
+#if SP_DEFINE_ENGINE
+    // Format argument `index` with a spec that has nested replacement fields.
+    // Kept out of line, so that the buffer for the resolved spec is only on
+    // the stack for nested fields. A template, because GCC rejects `noinline`
+    // on an `inline` function.
+    template <class = void>
+    SP_NOINLINE bool vformat_nested(IWriter& writer, const StringView& spec, int32_t index, int32_t* prevIndex, const FormatArg* args, int32_t count)
+    {
+        char buffer[64];
+        StringWriter nestedWriter(buffer, sizeof(buffer));
+        vformat(nestedWriter, spec, prevIndex, args, count);
+
+        const auto fullLen = nestedWriter.result();
+        const auto realLen = std::min(size_t(fullLen), sizeof(buffer));
+
+        return index >= 0
+            && index < count
+            && args[index].format(writer, StringView(buffer, int32_t(realLen)), args[index].value);
+    }
+
+    SP_ENGINE bool vformat_field(IWriter& writer, const FormatToken& token, int32_t* prevIndex, const FormatArg* args, int32_t count)
+    {
+        auto index = token.index;
+
+        if (token.name.length) {
+            index = 0;
+
+            while (index < count
+                && (args[index].name.length != token.name.length
+                    || std::memcmp(args[index].name.ptr, token.name.ptr, size_t(token.name.length)))) {
+                ++index;
+            }
+
+            if (index == count) {
+                return false;
+            }
+
+            *prevIndex = index;
+        }
+
+        if (token.nested) {
+            return vformat_nested(writer, token.spec, index, prevIndex, args, count);
+        }
+
+        return index >= 0
+            && index < count
+            && args[index].format(writer, token.spec, args[index].value);
+    }
+
+    SP_ENGINE int32_t vformat(IWriter& writer, const StringView& fmt, int32_t* prevIndex, const FormatArg* args, int32_t count)
+    {
+        FormatToken token;
+        int32_t offset = 0;
+        int32_t tokenStart = 0;
+
+        while (!writer.stopped() && next_token(fmt, &offset, prevIndex, &token)) {
+            const bool isField = token.index >= 0 || token.name.length;
+
+            if (!isField || !vformat_field(writer, token, prevIndex, args, count)) {
+                writer.write_ref(token.text.length, token.text.ptr);
+            }
+
+            if (writer.stopped()) {
+                return tokenStart;
+            }
+
+            tokenStart = offset;
+        }
+
+        return offset;
+    }
+#endif
+
+    template <class... Args>
+    bool format_field(IWriter& writer, const FormatToken& token, int32_t* prevIndex, Args&&... args)
+    {
+        // the trailing argument keeps the array non-empty
+        const FormatArg erased[] = { make_format_arg(std::forward<Args>(args))..., FormatArg() };
+        return vformat_field(writer, token, prevIndex, erased, int32_t(sizeof...(Args)));
+    }
+
+    /// Format the provided format string, and return the offset into it at
+    /// which formatting stopped. This is the length of the format string,
+    /// unless the writer stopped accepting output.
+    template <class... Args>
+    int32_t do_format(IWriter& writer, const StringView& fmt, int32_t* prevIndex, Args&&... args)
+    {
+        const FormatArg erased[] = { make_format_arg(std::forward<Args>(args))..., FormatArg() };
+        return vformat(writer, fmt, prevIndex, erased, int32_t(sizeof...(Args)));
+    }
+
+    template <class... Args>
+    void format(IWriter& writer, const StringView& fmt, Args&&... args)
+    {
+        int32_t prevIndex = -1;
+        do_format(writer, fmt, &prevIndex, std::forward<Args>(args)...);
+    }
+
+    /// Format into this thread's staging buffer followed by `suffix`, and
+    /// pass the result to `emit`. Nested calls, e.g. from within a custom
+    /// formatter, use a temporary buffer instead. Return the amount of
+    /// `char`s formatted, or `-1` in case of an error.
+    template <class Emit, class... Args>
+    int32_t format_staged(const Emit& emit, const StringView& suffix, const StringView& fmt, Args&&... args)
+    {
+        auto& staging = staging_buffer();
+        BufferWriter temporary;
+        auto& writer = staging.inUse ? temporary : staging.writer;
+        const bool wasInUse = staging.inUse;
+
+        staging.inUse = true;
+        writer.clear();
+        format(writer, fmt, std::forward<Args>(args)...);
+        writer.write(size_t(suffix.length), suffix.ptr);
+        staging.inUse = wasInUse;
+
+        const auto length = writer.result();
+
+        if (length < 0 || !emit(writer.data(), writer.size())) {
+            return -1;
+        }
+
+        return length;
+    }
+
+    template <class... Args>
+    int32_t format(std::FILE* file, const StringView& fmt, Args&&... args)
+    {
+        const auto emit = [file](const char* data, size_t length) {
+            return std::fwrite(data, 1, length, file) == length;
+        };
+
+        return format_staged(emit, StringView(), fmt, std::forward<Args>(args)...);
+    }
+
+    /// Level-gated logging front end. Every message is formatted in full
+    /// before being written to the writer in one go, followed by a newline.
+    /// Use `SP_LOG` to also skip evaluating the arguments of messages whose
+    /// level is disabled.
+    class Logger {
+    public:
+        Logger(IWriter& writer, LogLevel level = LOGLEVEL_INFO)
+            : m_writer(writer)
+            , m_level(level)
+        {
+        }
+
+        LogLevel level() const
+        {
+            return m_level;
+        }
+
+        void set_level(LogLevel level)
+        {
+            m_level = level;
+        }
+
+        /// Return whether messages of the provided level are written.
+        bool enabled(LogLevel level) const
+        {
+            return level >= m_level && level < LOGLEVEL_OFF;
+        }
+
+        template <class... Args>
+        void log(LogLevel level, const StringView& fmt, Args&&... args)
+        {
+            if (!enabled(level)) {
+                return;
+            }
+
+            auto& writer = m_writer;
+            const auto emit = [&writer](const char* data, size_t length) {
+                return writer.write(length, data) == length;
+            };
+
+            format_staged(emit, StringView("\n", 1), fmt, std::forward<Args>(args)...);
+        }
+
+    private:
+        IWriter& m_writer;
+        LogLevel m_level;
+    };
+
+#if defined(SP_ENABLE_THREADS)
+    template <class... Args>
+    int32_t format(SharedBuffer& buffer, const StringView& fmt, Args&&... args)
+    {
+        const auto emit = [&buffer](const char* data, size_t length) {
+            return buffer.append(length, data);
+        };
+
+        return format_staged(emit, StringView(), fmt, std::forward<Args>(args)...);
+    }
+#endif
+
+    template <class... Args>
+    int32_t format(char buffer[], size_t size, const StringView& fmt, Args&&... args)
+    {
+        StringWriter writer(buffer, size);
+        format(writer, fmt, std::forward<Args>(args)...);
+        return writer.result();
+    }
+
+    template <size_t N, class... Args>
+    int32_t format(char (&buffer)[N], const StringView& fmt, Args&&... args)
+    {
+        StringWriter writer(buffer, N);
+        format(writer, fmt, std::forward<Args>(args)...);
+        return writer.result();
+    }
+
+    /// Writer for short-lived intermediate output, which only allocates
+    /// once its inline storage is exceeded.
+    class ScratchWriter : public IWriter {
+    public:
+        ScratchWriter()
+            : m_length(0)
+            , m_spilled(false)
+        {
+        }
+
+        StringView view() const
+        {
+            return m_spilled
+                ? StringView(m_spill.data(), int32_t(m_spill.size()))
+                : StringView(m_inline, int32_t(m_length));
+        }
+
+        void clear()
+        {
+            m_length = 0;
+            m_spilled = false;
+            m_spill.clear();
+        }
+
+        size_t write(size_t length, const void* data) override
+        {
+            if (!m_spilled && m_length + length <= sizeof(m_inline)) {
+                std::memcpy(m_inline + m_length, data, length);
+                m_length += length;
+                return length;
+            }
+
+            if (!m_spilled) {
+                m_spill.write(m_length, m_inline);
+                m_spilled = true;
+            }
+
+            return m_spill.write(length, data);
+        }
+
+    private:
+        char m_inline[SP_SCRATCH_BUFFER_SIZE];
+        size_t m_length;
+        bool m_spilled;
+        BufferWriter m_spill;
+    };
+
+    /// How a value is represented in structured records.
+    enum RecordKind {
+        RECORDKIND_STRING,
+        RECORDKIND_NUMBER,
+        RECORDKIND_BOOL,
+    };
+
+    template <class T>
+    struct RecordKindOf : std::integral_constant<RecordKind, std::is_arithmetic<T>::value ? RECORDKIND_NUMBER : RECORDKIND_STRING> {};
+
+    template <> struct RecordKindOf<bool> : std::integral_constant<RecordKind, RECORDKIND_BOOL> {};
+    template <> struct RecordKindOf<char> : std::integral_constant<RecordKind, RECORDKIND_STRING> {};
+    template <> struct RecordKindOf<wchar_t> : std::integral_constant<RecordKind, RECORDKIND_STRING> {};
+    template <> struct RecordKindOf<char16_t> : std::integral_constant<RecordKind, RECORDKIND_STRING> {};
+    template <> struct RecordKindOf<char32_t> : std::integral_constant<RecordKind, RECORDKIND_STRING> {};
+    template <> struct RecordKindOf<Decimal> : std::integral_constant<RecordKind, RECORDKIND_NUMBER> {};
+#if defined(SP_HAS_INT128)
+    template <> struct RecordKindOf<int128_t> : std::integral_constant<RecordKind, RECORDKIND_NUMBER> {};
+    template <> struct RecordKindOf<uint128_t> : std::integral_constant<RecordKind, RECORDKIND_NUMBER> {};
+#endif
+    template <class T> struct RecordKindOf<NamedArg<T>> : RecordKindOf<T> {};
+    template <class F> struct RecordKindOf<Lazy<F>> : RecordKindOf<typename Formatter<Lazy<F>>::Result> {};
+
+    inline RecordKind record_kind(int32_t)
+    {
+        return RECORDKIND_STRING;
+    }
+
+    template <class Arg, class... Rest>
+    RecordKind record_kind(int32_t index, const Arg&, const Rest&... rest)
+    {
+        return index
+            ? record_kind(index - 1, rest...)
+            : RecordKindOf<typename std::decay<Arg>::type>::value;
+    }
+
+    SP_ENGINE bool is_json_number(const StringView& str);
+    SP_ENGINE void write_record_value(IWriter& record, RecordFormat recordFormat, RecordKind kind, const StringView& value);
+
+#if SP_DEFINE_ENGINE
+    /// Return whether `str` is a valid JSON number.
+    SP_ENGINE bool is_json_number(const StringView& str)
+    {
+        const auto term = str.ptr + str.length;
+        auto ptr = str.ptr;
+
+        const auto digits = [&]() {
+            const auto start = ptr;
+            while (ptr < term && *ptr >= '0' && *ptr <= '9') {
+                ++ptr;
+            }
+            return int32_t(ptr - start);
+        };
+
+        if (ptr < term && *ptr == '-') {
+            ++ptr;
+        }
+
+        const auto intStart = ptr;
+        const auto intDigits = digits();
+
+        if (!intDigits || (intDigits > 1 && *intStart == '0')) {
+            return false;
+        }
+
+        if (ptr < term && *ptr == '.') {
+            ++ptr;
+            if (!digits()) {
+                return false;
+            }
+        }
+
+        if (ptr < term && (*ptr == 'e' || *ptr == 'E')) {
+            ++ptr;
+            if (ptr < term && (*ptr == '+' || *ptr == '-')) {
+                ++ptr;
+            }
+            if (!digits()) {
+                return false;
+            }
+        }
+
+        return ptr == term;
+    }
+
+    /// Write a formatted value to a structured record. Numbers and booleans
+    /// are written as-is, without any padding, as long as they are valid in
+    /// the record format. Anything else is written as a quoted string.
+    SP_ENGINE void write_record_value(IWriter& record, RecordFormat recordFormat, RecordKind kind, const StringView& value)
+    {
+        auto trimmed = value;
+
+        while (trimmed.length && trimmed.ptr[0] == ' ') {
+            ++trimmed.ptr;
+            --trimmed.length;
+        }
+
+        while (trimmed.length && trimmed.ptr[trimmed.length - 1] == ' ') {
+            --trimmed.length;
+        }
+
+        bool isBare = false;
+
+        switch (kind) {
+        case RECORDKIND_NUMBER:
+            isBare = is_json_number(trimmed);
+            break;
+        case RECORDKIND_BOOL:
+            isBare = (trimmed.length == 4 && !std::memcmp(trimmed.ptr, "true", 4))
+                || (trimmed.length == 5 && !std::memcmp(trimmed.ptr, "false", 5));
+            break;
+        case RECORDKIND_STRING:
             break;
         }
 
-        // count digits, and copy them to a buffer (so we don't have to repeat
-        // this later)
-        char buffer[67]; // max needed; 64-bit binary + sign + alternate prefix
-        char* digits = buffer + sizeof(buffer);
-        char* prefix = buffer + 3;
-        int32_t ndigits = 0;
-        int32_t nprefix = 0;
-        char type = flags.type;
+        if (!isBare && recordFormat == RECORD_LOGFMT && value.length) {
+            const auto term = value.ptr + value.length;
+            isBare = find_escape(value.ptr, term, 'j') == term
+                && std::find(value.ptr, term, ' ') == term
+                && std::find(value.ptr, term, '=') == term;
+            trimmed = value;
+        }
 
-        const bool isChar = type == 'c';
-        const bool charAsHex = (value >= 0x80 || isNegative);
+        if (isBare) {
+            record.write(size_t(trimmed.length), trimmed.ptr);
+        } else {
+            write_escaped(record, value, 'j', true, false);
+        }
+    }
+#endif
+
+    template <class... Args>
+    void format_structured(IWriter& text, IWriter& record, RecordFormat recordFormat, const StringView& fmt, Args&&... args)
+    {
+        FormatToken token;
+        ScratchWriter value;
+        int32_t offset = 0;
+        int32_t prevIndex = -1;
+        bool written[sizeof...(Args) + 1] = {};
+        bool isFirst = true;
+
+        if (recordFormat == RECORD_JSON) {
+            record.write_ref(1, "{");
+        }
+
+        while (!text.stopped() && next_token(fmt, &offset, &prevIndex, &token)) {
+            const auto index = token.name.length
+                ? find_named(token.name, 0, args...)
+                : token.index;
+
+            value.clear();
+
+            if (index < 0 || !format_field(value, token, &prevIndex, std::forward<Args>(args)...)) {
+                text.write_ref(token.text.length, token.text.ptr);
+                continue;
+            }
+
+            const auto str = value.view();
+            text.write(size_t(str.length), str.ptr);
+
+            // each argument is only recorded once, even if used repeatedly
+            if (written[index]) {
+                continue;
+            }
+
+            written[index] = true;
+
+            if (!isFirst) {
+                record.write_ref(1, (recordFormat == RECORD_JSON) ? "," : " ");
+            }
+
+            isFirst = false;
+
+            if (recordFormat == RECORD_JSON) {
+                record.write_ref(1, "\"");
+            }
+
+            if (token.name.length) {
+                record.write_ref(size_t(token.name.length), token.name.ptr);
+            } else {
+                char digits[11];
+                const auto end = digits + sizeof(digits);
+                const auto start = write_decimal(end, uint64_t(index));
+                record.write(size_t(end - start), start);
+            }
+
+            record.write_ref((recordFormat == RECORD_JSON) ? 2 : 1, (recordFormat == RECORD_JSON) ? "\":" : "=");
+            write_record_value(record, recordFormat, record_kind(index, args...), str);
+        }
+
+        if (recordFormat == RECORD_JSON) {
+            record.write_ref(1, "}");
+        }
+    }
+
+    template <class... Args>
+    TruncatedResult format_truncated(char buffer[], size_t size, const StringView& fmt, Args&&... args)
+    {
+        StringWriter writer(buffer, size, true);
+        int32_t prevIndex = -1;
+
+        TruncatedResult result;
+        result.position = do_format(writer, fmt, &prevIndex, std::forward<Args>(args)...);
+        result.length = writer.result();
+        result.truncated = writer.truncated();
+        return result;
+    }
+
+    template <size_t... I>
+    struct IndexSequence {
+    };
+
+    template <size_t N, size_t... I>
+    struct MakeIndexSequence : MakeIndexSequence<N - 1, N - 1, I...> {
+    };
+
+    template <size_t... I>
+    struct MakeIndexSequence<0, I...> {
+        using Type = IndexSequence<I...>;
+    };
+
+    template <class Tuple, size_t... I>
+    void format_tuple(IWriter& writer, const StringView& fmt, const Tuple& record, IndexSequence<I...>)
+    {
+        format(writer, fmt, std::get<I>(record)...);
+    }
+
+    template <class... Ts>
+    void format_record(IWriter& writer, const StringView& fmt, const std::tuple<Ts...>& record)
+    {
+        format_tuple(writer, fmt, record, typename MakeIndexSequence<sizeof...(Ts)>::Type());
+    }
+
+    template <class T>
+    void format_record(IWriter& writer, const StringView& fmt, const T& record)
+    {
+        format(writer, fmt, record);
+    }
+
+    /// Writer for a single chunk of a `FormatCursor`. It skips the part of a
+    /// field already produced, fills the chunk and then the spill buffer, and
+    /// drops the rest, which is formatted again for the next chunks.
+    class ChunkWriter : public IWriter {
+    public:
+        ChunkWriter(char buffer[], size_t size, size_t skip, char spill[], size_t spillSize)
+            : m_buffer(buffer)
+            , m_size(size)
+            , m_used(0)
+            , m_skip(skip)
+            , m_spill(spill)
+            , m_spillSize(spillSize)
+            , m_spilled(0)
+            , m_dropped(false)
+        {
+        }
+
+        size_t used() const
+        {
+            return m_used;
+        }
+
+        size_t spilled() const
+        {
+            return m_spilled;
+        }
+
+        size_t write(size_t length, const void* data) override
+        {
+            auto src = (const char*)data;
+            const auto skipped = std::min(m_skip, length);
+            m_skip -= skipped;
+            src += skipped;
+            auto remaining = length - skipped;
+
+            auto toCopy = std::min(m_size - m_used, remaining);
+            std::memcpy(m_buffer + m_used, src, toCopy);
+            m_used += toCopy;
+            src += toCopy;
+            remaining -= toCopy;
+
+            toCopy = std::min(m_spillSize - m_spilled, remaining);
+            std::memcpy(m_spill + m_spilled, src, toCopy);
+            m_spilled += toCopy;
+            m_dropped |= remaining > toCopy;
+            return length;
+        }
+
+        /// Return whether output had to be dropped, after which the rest of
+        /// the field isn't needed for this chunk.
+        bool stopped() const override
+        {
+            return m_dropped;
+        }
+
+    private:
+        char* m_buffer;
+        size_t m_size;
+        size_t m_used;
+        size_t m_skip;
+        char* m_spill;
+        size_t m_spillSize;
+        size_t m_spilled;
+        bool m_dropped;
+    };
+
+    template <class... Args>
+    class FormatCursor {
+    public:
+        FormatCursor(const StringView& fmt, const Args&... args)
+            : m_args(args...)
+            , m_fmt(fmt)
+            , m_offset(0)
+            , m_prevIndex(-1)
+            , m_tokenPrevIndex(-1)
+            , m_emitted(0)
+            , m_spillOffset(0)
+            , m_spillSize(0)
+            , m_isPending(false)
+            , m_isLiteral(false)
+            , m_done(false)
+        {
+        }
+
+        /// Return whether the entire result has been produced.
+        bool done() const
+        {
+            return m_done;
+        }
+
+        /// Write the next chunk of the result to the provided buffer, and
+        /// return its length. Only the last chunk is shorter than `size`, and
+        /// a `size` of zero produces nothing.
+        size_t next(char buffer[], size_t size)
+        {
+            if (!size) {
+                return 0;
+            }
+
+            size_t used = 0;
+
+            while (used < size) {
+                // the part of a field that did not fit in the previous chunk
+                if (m_spillOffset < m_spillSize) {
+                    const auto toCopy = std::min(size - used, m_spillSize - m_spillOffset);
+                    std::memcpy(buffer + used, m_spill + m_spillOffset, toCopy);
+                    m_spillOffset += toCopy;
+                    used += toCopy;
+                    continue;
+                }
+
+                if (!m_isPending) {
+                    if (!next_token(m_fmt, &m_offset, &m_prevIndex, &m_token)) {
+                        m_done = true;
+                        break;
+                    }
+
+                    m_tokenPrevIndex = m_prevIndex;
+                    m_emitted = 0;
+                    m_isPending = true;
+                    m_isLiteral = m_token.index < 0 && !m_token.name.length;
+                }
+
+                used += next_part(buffer + used, size - used);
+            }
+
+            return used;
+        }
+
+    private:
+        enum {
+            SPILL_SIZE = 256,
+        };
+
+        // Write as much of the current token as fits, after the part already
+        // produced. Literal text, including invalid fields, is resumed in
+        // place, while fields that don't fit the chunk and spill buffer are
+        // formatted again.
+        size_t next_part(char buffer[], size_t size)
+        {
+            if (m_isLiteral) {
+                const auto toCopy = std::min(size, size_t(m_token.text.length) - m_emitted);
+                std::memcpy(buffer, m_token.text.ptr + m_emitted, toCopy);
+                m_emitted += toCopy;
+                m_isPending = m_emitted < size_t(m_token.text.length);
+                return toCopy;
+            }
+
+            m_prevIndex = m_tokenPrevIndex;
+            ChunkWriter writer(buffer, size, m_emitted, m_spill, SPILL_SIZE);
+
+            if (!format_field(writer, typename MakeIndexSequence<sizeof...(Args)>::Type())) {
+                m_isLiteral = true;
+                writer.write(size_t(m_token.text.length), m_token.text.ptr);
+            }
+
+            m_emitted += writer.used() + writer.spilled();
+            m_spillOffset = 0;
+            m_spillSize = writer.spilled();
+            m_isPending = writer.stopped();
+            return writer.used();
+        }
+
+        template <size_t... I>
+        bool format_field(IWriter& writer, IndexSequence<I...>)
+        {
+            return sp::format_field(writer, m_token, &m_prevIndex, std::get<I>(m_args)...);
+        }
+
+        std::tuple<Args...> m_args;
+        StringView m_fmt;
+        FormatToken m_token;
+        int32_t m_offset;
+        int32_t m_prevIndex;
+        int32_t m_tokenPrevIndex; //< Automatic index before the current token.
+        size_t m_emitted; //< Length of the current token produced so far.
+        char m_spill[SPILL_SIZE]; //< Part of the current field that didn't fit.
+        size_t m_spillOffset;
+        size_t m_spillSize;
+        bool m_isPending;
+        bool m_isLiteral;
+        bool m_done;
+    };
+
+    template <class... Args>
+    FormatCursor<typename std::decay<Args>::type...> make_cursor(const StringView& fmt, Args&&... args)
+    {
+        return FormatCursor<typename std::decay<Args>::type...>(fmt, args...);
+    }
+
+    /// Format string that is tokenized once, and where the format spec of
+    /// each replacement field is parsed once by the `Formatter` of the
+    /// argument type it refers to. The format string must outlive it. Format
+    /// strings with nested replacement fields can't be parsed ahead of time,
+    /// and fall back to being formatted as usual.
+    template <class... Args>
+    class CompiledFormat {
+    public:
+        CompiledFormat(const StringView& fmt)
+            : m_fmt(fmt)
+            , m_dynamic(false)
+        {
+            FormatToken token;
+            int32_t offset = 0;
+            int32_t prevIndex = -1;
+
+            while (next_token(fmt, &offset, &prevIndex, &token)) {
+                // names are only known once formatting
+                if (token.nested || token.name.length) {
+                    m_dynamic = true;
+                    m_segments.clear();
+                    return;
+                }
+
+                Segment segment;
+                segment.text = token.text;
+                segment.index = token.index;
+                segment.slot = -1;
+
+                // fields whose spec doesn't parse are written as-is, just as
+                // they would be when formatting as usual
+                if (segment.index >= 0) {
+                    segment.slot = parse_field(token.spec, segment.index, SizeConstant<0>());
+                    segment.index = (segment.slot >= 0) ? segment.index : -1;
+                }
 
-        if (isChar) {
-            if (charAsHex) {
-                *(--digits) = ')';
-            } else {
-                *(--digits) = char(value);
+                m_segments.push_back(segment);
             }
-            ndigits = 1;
         }
 
-        if (!isChar || charAsHex) {
-            const auto digitchars = (flags.type == 'X')
-                ? "0123456789ABCDEFX"
-                : "0123456789abcdefx";
+        void format(IWriter& writer, const Args&... args) const
+        {
+            if (m_dynamic) {
+                sp::format(writer, m_fmt, args...);
+                return;
+            }
 
-            uint64_t v = value;
-            do {
-                *(--digits) = digitchars[v % base];
-                v /= base;
-                ++ndigits;
-            } while (v);
+            const std::tuple<const Args&...> values(args...);
 
-            if (flags.alternate) {
-                switch (base) {
-                case 2:
-                    *(--prefix) = 'b';
-                    *(--prefix) = '0';
-                    nprefix += 2;
-                    break;
-                case 8:
-                    *(--prefix) = 'o';
-                    *(--prefix) = '0';
-                    nprefix += 2;
-                    break;
-                case 16:
-                    *(--prefix) = digitchars[16];
-                    *(--prefix) = '0';
-                    nprefix += 2;
+            for (const auto& segment : m_segments) {
+                if (writer.stopped()) {
                     break;
                 }
+
+                if (segment.index < 0 || !format_field(writer, segment, values, SizeConstant<0>())) {
+                    writer.write_ref(segment.text.length, segment.text.ptr);
+                }
             }
         }
 
-        // determine sign
-        if (isNegative) {
-            *(--prefix) = '-';
-            ++nprefix;
-        } else if (flags.sign == '+' || flags.sign == ' ') {
-            *(--prefix) = flags.sign;
-            ++nprefix;
+    private:
+        template <size_t I>
+        using SizeConstant = std::integral_constant<size_t, I>;
+
+        using Count = SizeConstant<sizeof...(Args)>;
+
+        struct Segment {
+            StringView text;
+            int32_t index;
+            int32_t slot;
+        };
+
+        template <size_t I>
+        int32_t parse_field(const StringView& spec, int32_t index, SizeConstant<I>)
+        {
+            if (index != int32_t(I)) {
+                return parse_field(spec, index, SizeConstant<I + 1>());
+            }
+
+            using Arg = typename std::tuple_element<I, std::tuple<Args...>>::type;
+            Formatter<Arg> formatter;
+
+            if (!formatter.parse(spec)) {
+                return -1;
+            }
+
+            auto& formatters = std::get<I>(m_formatters);
+            formatters.push_back(formatter);
+            return int32_t(formatters.size() - 1);
         }
 
-        // for hex chars, the prefix should be part of the value
-        if (isChar && charAsHex) {
-            if (nprefix) {
-                digits -= nprefix;
-                ndigits += nprefix;
-                memcpy(digits, prefix, nprefix);
-                nprefix = 0;
+        int32_t parse_field(const StringView&, int32_t, Count)
+        {
+            return -1;
+        }
+
+        template <size_t I>
+        bool format_field(IWriter& writer, const Segment& segment, const std::tuple<const Args&...>& values, SizeConstant<I>) const
+        {
+            if (segment.index != int32_t(I)) {
+                return format_field(writer, segment, values, SizeConstant<I + 1>());
             }
-            *(--digits) = '(';
-            ++ndigits;
+
+            return std::get<I>(m_formatters)[size_t(segment.slot)].format(writer, std::get<I>(values));
         }
 
-        // determine spacing
-        int32_t leadSpace = 0;
-        int32_t tailSpace = 0;
+        bool format_field(IWriter&, const Segment&, const std::tuple<const Args&...>&, Count) const
+        {
+            return false;
+        }
+
+        StringView m_fmt;
+        std::vector<Segment> m_segments;
+        std::tuple<std::vector<Formatter<Args>>...> m_formatters;
+        bool m_dynamic;
+    };
+
+    template <class... Args, class... Values>
+    void format(IWriter& writer, const CompiledFormat<Args...>& fmt, Values&&... values)
+    {
+        fmt.format(writer, std::forward<Values>(values)...);
+    }
+
+    // Whether two values of a template argument are known to format the same.
+    // Types that can't be compared never are, and neither are `char` strings,
+    // as the string may have changed behind the same pointer.
+    template <class T>
+    auto same_template_value(const T& a, const T& b, int) -> decltype(bool(a == b))
+    {
+        return a == b;
+    }
+
+    template <class T>
+    bool same_template_value(const T&, const T&, long)
+    {
+        return false;
+    }
+
+    inline bool same_template_value(const char*, const char*, int)
+    {
+        return false;
+    }
+
+    inline bool same_template_value(char*, char*, int)
+    {
+        return false;
+    }
+
+    // Width of a template field, taken from the flags of formatters that
+    // parse the spec into `FormatFlags`, and from the spec itself for others.
+    template <class F>
+    auto template_width(const F& formatter, const StringView&, int) -> decltype(int32_t(formatter.flags.width))
+    {
+        return formatter.flags.width;
+    }
+
+    template <class F>
+    auto template_width(const F& formatter, const StringView& spec, long) -> decltype(template_width(formatter.formatter, spec, 0))
+    {
+        return template_width(formatter.formatter, spec, 0);
+    }
+
+    template <class F>
+    int32_t template_width(const F&, const StringView& spec, ...)
+    {
+        FormatFlags flags;
+        return parse_format(spec, &flags) ? flags.width : 0;
+    }
+
+    /// Fixed-layout format string, rendered into a buffer that the template
+    /// owns. Each update only re-formats the arguments that differ from the
+    /// previous one, patches their fields in place, and reports the ranges of
+    /// the output that changed. Every replacement field needs an explicit
+    /// width, which is the exact amount of `char`s it occupies: shorter output
+    /// is padded with spaces, and longer output fills the field with `#`.
+    /// The width is taken from the argument's `Formatter` if it parses specs
+    /// into `FormatFlags`, as those of built-in types and enums do, and from
+    /// the spec otherwise, which must then be a standard one. Format strings
+    /// with fields that have no width, such as chrono patterns, or with named
+    /// or nested fields, are not valid templates. Arguments are copied to
+    /// compare them against the next update, so they must be default
+    /// constructible and copyable. The format string must outlive the
+    /// template.
+    template <class... Args>
+    class Template {
+    public:
+        /// Range of `char`s in the rendered output.
+        struct Range {
+            int32_t offset;
+            int32_t length;
+        };
+
+        Template(const StringView& fmt)
+            : m_valid(true)
+            , m_rendered(false)
         {
-            int32_t nchars = ndigits + nprefix;
-            int32_t width = std::max(flags.width, nchars);
+            FormatToken token;
+            int32_t offset = 0;
+            int32_t prevIndex = -1;
+            int32_t length = 0;
+            int32_t maxWidth = 0;
+
+            while (m_valid && next_token(fmt, &offset, &prevIndex, &token)) {
+                Segment segment;
+                segment.text = token.text;
+                segment.index = -1;
+                segment.slot = -1;
+                segment.range = Range{ length, token.text.length };
+
+                // the layout can't depend on the arguments
+                m_valid = !token.nested && !token.name.length;
+
+                // fields whose spec doesn't parse are written as-is, just as
+                // they would be when formatting as usual
+                int32_t width = 0;
+
+                if (m_valid && token.index >= 0) {
+                    segment.slot = parse_field(token.spec, token.index, &width, SizeConstant<0>());
+                }
 
-            switch (flags.align) {
-            case '^':
-                leadSpace = (width / 2) - ((nchars + 1) / 2); // nchars rounded up
-                tailSpace = ((width + 1) / 2) - (nchars / 2); // width rounded up
-                leadSpace += (width & 1) & (nchars & 1); // if both are odd, we need to add one for correction
-                tailSpace -= (width & 1) & (nchars & 1); // if both are odd, we need to remove one for correction
-                break;
-            case '<':
-                tailSpace = width - nchars;
-                break;
-            case '>':
-            case '=':
-            default:
-                leadSpace = width - nchars;
-                break;
+                if (segment.slot >= 0) {
+                    m_valid = width > 0;
+                    segment.index = token.index;
+                    segment.range.length = width;
+                    maxWidth = std::max(maxWidth, width);
+                    m_fields.push_back(segment.range);
+                }
+
+                m_valid = m_valid && segment.range.length <= INT32_MAX - length;
+                length += m_valid ? segment.range.length : 0;
+                m_segments.push_back(segment);
+            }
+
+            if (!m_valid) {
+                m_segments.clear();
+                m_fields.clear();
+                return;
             }
+
+            // one more than the widest field, to tell whether output overflows
+            m_buffer.resize(size_t(length));
+            m_scratch.resize(size_t(maxWidth) + 1);
         }
 
-        // print sign and alternate prefix, if they should be before the padding
-        if (nprefix) {
-            switch (flags.align) {
-            case '^':
-            case '>':
-                break;
-            case '<':
-            case '=':
-            default:
-                writer.write(nprefix, prefix);
-                nprefix = 0;
-                break;
+        /// Return whether the format string is a valid template.
+        bool valid() const
+        {
+            return m_valid;
+        }
+
+        /// Render the provided arguments, and return the amount of ranges
+        /// that changed since the previous update. The first update renders
+        /// everything, after which only the fields of arguments that differ
+        /// from the previous update are formatted again, and only the parts
+        /// of them that differ are reported.
+        size_t update(const Args&... args)
+        {
+            m_dirty.clear();
+
+            if (!m_valid) {
+                return 0;
+            }
+
+            const std::tuple<const Args&...> values(args...);
+            bool changed[sizeof...(Args) + 1];
+            compare_values(values, changed, SizeConstant<0>());
+
+            for (const auto& segment : m_segments) {
+                if (segment.index >= 0 && changed[segment.index]) {
+                    render_field(segment, values);
+                } else if (!m_rendered) {
+                    std::memcpy(&m_buffer[size_t(segment.range.offset)], segment.text.ptr, size_t(segment.text.length));
+                }
+            }
+
+            if (!m_rendered) {
+                m_dirty.clear();
+                m_rendered = true;
+
+                if (!m_buffer.empty()) {
+                    m_dirty.push_back(Range{ 0, int32_t(m_buffer.size()) });
+                }
             }
+
+            return m_dirty.size();
         }
 
-        // apply the leading padding
-        const char fill = flags.fill ? flags.fill : ' ';
+        /// Return the ranges that changed in the last update, in order.
+        /// Adjoining changes are merged into a single range.
+        const std::vector<Range>& dirty() const
+        {
+            return m_dirty;
+        }
 
-        while (leadSpace--) {
-            write_char(writer, fill);
+        /// Return the range of each replacement field, in the order they
+        /// appear in the format string.
+        const std::vector<Range>& fields() const
+        {
+            return m_fields;
         }
 
-        // print the prefix, if it should be after the padding
-        if (nprefix) {
-            writer.write(nprefix, prefix);
+        /// Return the rendered output.
+        StringView str() const
+        {
+            return m_buffer.empty()
+                ? StringView()
+                : StringView(&m_buffer[0], int32_t(m_buffer.size()));
         }
 
-        // print digits
-        writer.write(ndigits, digits);
+    private:
+        template <size_t I>
+        using SizeConstant = std::integral_constant<size_t, I>;
 
-        // print tailing padding
-        while (tailSpace--) {
-            write_char(writer, fill);
+        using Count = SizeConstant<sizeof...(Args)>;
+        using Values = std::tuple<const Args&...>;
+
+        struct Segment {
+            StringView text;
+            Range range;
+            int32_t index;
+            int32_t slot;
+        };
+
+        template <size_t I>
+        int32_t parse_field(const StringView& spec, int32_t index, int32_t* width, SizeConstant<I>)
+        {
+            if (index != int32_t(I)) {
+                return parse_field(spec, index, width, SizeConstant<I + 1>());
+            }
+
+            using Arg = typename std::tuple_element<I, std::tuple<Args...>>::type;
+            Formatter<Arg> formatter;
+
+            if (!formatter.parse(spec)) {
+                return -1;
+            }
+
+            *width = template_width(formatter, spec, 0);
+
+            auto& formatters = std::get<I>(m_formatters);
+            formatters.push_back(formatter);
+            return int32_t(formatters.size() - 1);
         }
 
-        return true;
-    }
+        int32_t parse_field(const StringView&, int32_t, int32_t*, Count)
+        {
+            return -1;
+        }
 
-    template <class F>
-    bool format_float(IWriter& writer, const StringView& format, F value)
-    {
-        FormatFlags flags;
+        template <size_t I>
+        void compare_values(const Values& values, bool changed[], SizeConstant<I>)
+        {
+            auto& previous = std::get<I>(m_values);
+            const auto& value = std::get<I>(values);
+            changed[I] = !m_rendered || !same_template_value(previous, value, 0);
+
+            if (changed[I]) {
+                previous = value;
+            }
+
+            compare_values(values, changed, SizeConstant<I + 1>());
+        }
+
+        void compare_values(const Values&, bool[], Count)
+        {
+        }
+
+        template <size_t I>
+        bool format_field(IWriter& writer, const Segment& segment, const Values& values, SizeConstant<I>) const
+        {
+            if (segment.index != int32_t(I)) {
+                return format_field(writer, segment, values, SizeConstant<I + 1>());
+            }
 
-        if (!parse_format(format, &flags)) {
+            return std::get<I>(m_formatters)[size_t(segment.slot)].format(writer, std::get<I>(values));
+        }
+
+        bool format_field(IWriter&, const Segment&, const Values&, Count) const
+        {
             return false;
         }
 
-        // I *really* have no interest in serializing floats/doubles... so
-        // let's not. Instead, let's build a format string for snprintf to do
-        // the heavy work, and we'll just do alignment and stuff.
-        const char* suffix = "";
+        void render_field(const Segment& segment, const Values& values)
+        {
+            const auto width = segment.range.length;
+            auto scratch = &m_scratch[0];
+            StringWriter writer(scratch, size_t(width) + 1, true);
+            int32_t length;
+
+            if (format_field(writer, segment, values, SizeConstant<0>())) {
+                length = writer.result();
+            } else {
+                length = std::min(segment.text.length, width + 1);
+                std::memcpy(scratch, segment.text.ptr, size_t(length));
+            }
+
+            // output that doesn't fit is marked rather than cut short, so
+            // that a truncated number can't be mistaken for another
+            if (length < 0 || length > width) {
+                std::memset(scratch, '#', size_t(width));
+            } else {
+                std::memset(scratch + length, ' ', size_t(width - length));
+            }
+
+            // only the part of the field that differs is patched
+            auto target = &m_buffer[size_t(segment.range.offset)];
+            int32_t first = 0;
+            int32_t last = width;
+
+            while (first < last && target[first] == scratch[first]) {
+                ++first;
+            }
+
+            while (last > first && target[last - 1] == scratch[last - 1]) {
+                --last;
+            }
+
+            if (first == last) {
+                return;
+            }
+
+            std::memcpy(target + first, scratch + first, size_t(last - first));
+
+            const auto offset = segment.range.offset + first;
+
+            if (!m_dirty.empty() && m_dirty.back().offset + m_dirty.back().length == offset) {
+                m_dirty.back().length += last - first;
+            } else {
+                m_dirty.push_back(Range{ offset, last - first });
+            }
+        }
+
+        std::vector<Segment> m_segments;
+        std::vector<Range> m_fields;
+        std::vector<Range> m_dirty;
+        std::vector<char> m_buffer;
+        std::vector<char> m_scratch;
+        std::tuple<std::vector<Formatter<Args>>...> m_formatters;
+        std::tuple<Args...> m_values;
+        bool m_valid;
+        bool m_rendered;
+    };
+
+    // Catalog file layout: a header, followed by the entries sorted by key,
+    // the tokens of all formats, and the text that keys, literal text and
+    // format specs point into. Offsets are from the start of the file and
+    // sizes are fixed, so a mapped file is used as-is.
+
+    enum {
+        CATALOG_MAGIC = 0x31435053, //< `SPC1`, read back differently on other byte orders.
+        CATALOG_VERSION = 1,
+    };
+
+    struct CatalogHeader {
+        uint32_t magic;
+        uint32_t version;
+        uint32_t entryCount;
+        uint32_t tokenCount;
+        uint32_t textOffset;
+        uint32_t textSize;
+    };
+
+    struct CatalogEntry {
+        uint32_t key; //< Text offset of the key.
+        uint32_t keyLength;
+        uint32_t format; //< Text offset of the original format string.
+        uint32_t formatLength;
+        uint32_t firstToken;
+        uint32_t tokenCount;
+        uint32_t isDynamic; //< Whether the format has named or nested fields, which are only resolved when formatting.
+    };
+
+    struct CatalogToken {
+        uint32_t text; //< Text offset of the raw token, written as-is for literal text and failed fields.
+        uint32_t textLength;
+        uint32_t spec; //< Text offset of the format spec.
+        uint32_t specLength;
+        int32_t index; //< Argument index, or `-1` for literal text.
+        int32_t width;
         int32_t precision;
+        char fill;
+        char align;
+        char sign;
         char type;
+        char grouping;
+        uint8_t alternate;
+        uint8_t hasFlags; //< Whether the spec decoded into `FormatFlags`, as it must for built-in types.
+        uint8_t reserved;
+    };
 
-        switch (flags.type) {
-        case 'f':
-        case 'F':
-        case 'e':
-        case 'E':
-            precision = flags.precision >= 0 ? flags.precision : 6;
-            type = flags.type;
-            break;
-        case 'g':
-        case 'G':
-            precision = (flags.precision != 0)
-                ? (flags.precision > 0 ? flags.precision : 6)
-                : 1;
-            type = flags.type;
-            break;
-        case '%':
-            precision = flags.precision >= 0 ? flags.precision : 6;
-            type = 'f';
-            value *= 100;
-            suffix = "%%";
-            break;
-        default:
-            precision = flags.precision >= 0 ? flags.precision : std::numeric_limits<F>::digits10;
-            type = 'g';
-            break;
+    static_assert(sizeof(CatalogHeader) == 24 && sizeof(CatalogEntry) == 28 && sizeof(CatalogToken) == 36, "catalog structs must not be padded");
+
+    /// Format from a `Catalog`, pointing into its file.
+    struct CatalogFormat {
+        StringView fmt; //< Original format string.
+        const CatalogToken* tokens = nullptr;
+        int32_t tokenCount = 0;
+        const char* text = nullptr; //< Text the tokens point into.
+        bool isDynamic = false;
+    };
+
+    /// Read-only catalog of formats written by `write_catalog`, looked up by
+    /// key. It is either mapped from a file, so that its pages are shared by
+    /// every process using it, or used in place from memory.
+    class Catalog {
+    public:
+        Catalog()
+            : m_data(nullptr)
+            , m_size(0)
+            , m_isMapped(false)
+        {
         }
 
-        // produce the formatted value
-        char buffer[512];
-        const char* digits = buffer;
-        int32_t ndigits = 0;
+        Catalog(const Catalog&) = delete;
+        Catalog& operator=(const Catalog&) = delete;
 
-        if (std::isnan(value)) {
-            const char* str = std::isupper(flags.type) ? "NAN" : "nan";
-            strncpy(buffer, str, 3);
-            ndigits = 3;
-        } else if (std::isinf(value)) {
-            const char* str = std::isupper(flags.type) ? "INF" : "inf";
-            strncpy(buffer, str, 3);
-            ndigits = 3;
-        } else {
-            char numFormat[17];
-            snprintf(numFormat, sizeof(numFormat), "%%+.%d%c%s", precision, type, suffix);
+        ~Catalog()
+        {
+            close();
+        }
 
-            // produce the formatted value
-    #if defined(__MINGW32__) || (defined(_MSC_VER) && _MSC_VER < 1900)
-            unsigned int prevOutputFormat = _set_output_format(_TWO_DIGIT_EXPONENT);
-    #endif
+        /// Use the catalog in `data`, which must be aligned to 4 bytes, and
+        /// stay alive and unchanged while the catalog is in use. Return
+        /// `false` if it isn't a valid catalog.
+        bool load(const void* data, size_t size)
+        {
+            close();
 
-            ndigits = snprintf(buffer, sizeof(buffer), numFormat, value) - 1;
-            digits = buffer + 1;
+            if (!is_valid(data, size)) {
+                return false;
+            }
 
-    #if defined(__MINGW32__) || (defined(_MSC_VER) && _MSC_VER < 1900)
-            _set_output_format(prevOutputFormat);
-    #endif
+            m_data = static_cast<const char*>(data);
+            m_size = size;
+            return true;
         }
 
-        // determine sign
-        char sign = 0;
+#if !defined(_WIN32)
+        /// Map the catalog file at `path` read-only. Return `false` if it
+        /// can't be mapped or isn't a valid catalog.
+        bool map(const char* path)
+        {
+            close();
 
-        if (value < 0) {
-            sign = '-';
-        } else if (flags.sign == '+' || flags.sign == ' ') {
-            sign = flags.sign;
+            const int fd = ::open(path, O_RDONLY | O_CLOEXEC);
+
+            if (fd < 0) {
+                return false;
+            }
+
+            struct stat info;
+            void* data = MAP_FAILED;
+
+            if (!::fstat(fd, &info) && info.st_size > 0) {
+                data = ::mmap(nullptr, size_t(info.st_size), PROT_READ, MAP_SHARED, fd, 0);
+            }
+
+            ::close(fd);
+
+            if (data == MAP_FAILED) {
+                return false;
+            }
+
+            if (!is_valid(data, size_t(info.st_size))) {
+                ::munmap(data, size_t(info.st_size));
+                return false;
+            }
+
+            m_data = static_cast<const char*>(data);
+            m_size = size_t(info.st_size);
+            m_isMapped = true;
+            return true;
         }
+#endif
 
-        // determine width
-        const int nchars = sign ? ndigits + 1 : ndigits;
-        const int32_t width = std::max(flags.width, nchars);
+        void close()
+        {
+#if !defined(_WIN32)
+            if (m_isMapped) {
+                ::munmap(const_cast<char*>(m_data), m_size);
+            }
+#endif
 
-        // determine alignment
-        int32_t leadSpace = 0;
-        int32_t tailSpace = 0;
+            m_data = nullptr;
+            m_size = 0;
+            m_isMapped = false;
+        }
 
-        switch (flags.align) {
-        case '^':
-            leadSpace = (width / 2) - ((nchars + 1) / 2); // nchars rounded up
-            tailSpace = ((width + 1) / 2) - (nchars / 2); // width rounded up
-            leadSpace += (width & 1) & (nchars & 1); // if both are odd, we need to add one for correction
-            tailSpace -= (width & 1) & (nchars & 1); // if both are odd, we need to remove one for correction
-            break;
-        case '<':
-            tailSpace = width - nchars;
-            break;
-        case '>':
-        default:
-            leadSpace = width - nchars;
-            break;
+        /// Return the amount of formats in the catalog.
+        size_t size() const
+        {
+            return m_data ? header().entryCount : 0;
         }
 
-        // print sign, if it should be before the padding
-        if (sign && flags.align == '=') {
-            write_char(writer, sign);
+        /// Find the format with the provided key. Return `false` if there is
+        /// none, or its entry points outside of the catalog.
+        bool find(const StringView& key, CatalogFormat* format) const
+        {
+            if (!m_data) {
+                return false;
+            }
+
+            const auto& head = header();
+            const auto text = m_data + head.textOffset;
+            const auto entries = reinterpret_cast<const CatalogEntry*>(m_data + sizeof(CatalogHeader));
+            const auto term = entries + head.entryCount;
+
+            // keys outside of the text only ever compare as smaller, so a
+            // corrupt file can't make the search read outside of it
+            const auto entry = std::lower_bound(entries, term, key, [this, text](const CatalogEntry& a, const StringView& b) {
+                return !in_text(a.key, a.keyLength)
+                    || compare_keys(StringView(text + a.key, int32_t(a.keyLength)), b) < 0;
+            });
+
+            const auto isMatch = entry != term
+                && !compare_keys(StringView(text + entry->key, int32_t(entry->keyLength)), key);
+
+            if (!isMatch
+                || !in_text(entry->format, entry->formatLength)
+                || entry->firstToken > head.tokenCount
+                || entry->tokenCount > head.tokenCount - entry->firstToken) {
+                return false;
+            }
+
+            const auto tokens = reinterpret_cast<const CatalogToken*>(term) + entry->firstToken;
+
+            for (uint32_t i = 0; i < entry->tokenCount; ++i) {
+                if (!in_text(tokens[i].text, tokens[i].textLength) || !in_text(tokens[i].spec, tokens[i].specLength)) {
+                    return false;
+                }
+            }
+
+            format->fmt = StringView(text + entry->format, int32_t(entry->formatLength));
+            format->tokens = tokens;
+            format->tokenCount = int32_t(entry->tokenCount);
+            format->text = text;
+            format->isDynamic = entry->isDynamic != 0;
+            return true;
         }
 
-        // apply leading padding
-        const char fill = flags.fill ? flags.fill : ' ';
+        /// Order keys by their bytes, and then by their length.
+        static int32_t compare_keys(const StringView& a, const StringView& b)
+        {
+            const auto result = std::memcmp(a.ptr, b.ptr, size_t(std::min(a.length, b.length)));
+            return result ? result : (a.length - b.length);
+        }
 
-        while (leadSpace--) {
-            write_char(writer, fill);
+    private:
+        const CatalogHeader& header() const
+        {
+            return *reinterpret_cast<const CatalogHeader*>(m_data);
         }
 
-        // print sign, if it should be after the padding
-        if (sign && flags.align != '=') {
-            write_char(writer, sign);
+        bool in_text(uint32_t offset, uint32_t length) const
+        {
+            const auto& head = header();
+            return offset <= head.textSize && length <= head.textSize - offset;
         }
 
-        // write string
-        writer.write(ndigits, digits);
+        static bool is_valid(const void* data, size_t size)
+        {
+            if (!data || size < sizeof(CatalogHeader) || (uintptr_t(data) & 3)) {
+                return false;
+            }
 
-        // apply tailing padding
-        while (tailSpace--) {
-            write_char(writer, fill);
+            const auto& head = *static_cast<const CatalogHeader*>(data);
+            const auto tables = uint64_t(sizeof(CatalogHeader))
+                + uint64_t(head.entryCount) * sizeof(CatalogEntry)
+                + uint64_t(head.tokenCount) * sizeof(CatalogToken);
+
+            return head.magic == CATALOG_MAGIC
+                && head.version == CATALOG_VERSION
+                && head.textOffset == tables
+                && uint64_t(head.textOffset) + head.textSize <= size;
         }
 
-        return true;
-    }
+        const char* m_data;
+        size_t m_size;
+        bool m_isMapped;
+    };
 
-    inline bool format_string(IWriter& writer, const sp::FormatFlags& flags, const StringView& str)
+    inline bool write_catalog(IWriter& writer, const StringView keys[], const StringView formats[], size_t count)
     {
-        // determine the amount of characters to write
-        auto nchars = str.length;
+        std::vector<size_t> order(count);
 
-        if (flags.precision >= 0) {
-            nchars = std::min(flags.precision, nchars);
+        for (size_t i = 0; i < count; ++i) {
+            order[i] = i;
         }
 
-        // determine width
-        const int32_t width = std::max(flags.width, nchars);
+        std::sort(order.begin(), order.end(), [keys](size_t a, size_t b) {
+            return Catalog::compare_keys(keys[a], keys[b]) < 0;
+        });
 
-        // determine alignment
-        int32_t leadSpace = 0;
-        int32_t tailSpace = 0;
+        std::vector<CatalogEntry> entries;
+        std::vector<CatalogToken> tokens;
+        uint64_t textSize = 0;
 
-        switch (flags.align) {
-        case '^':
-            leadSpace = (width / 2) - ((nchars + 1) / 2); // nchars rounded up
-            tailSpace = ((width + 1) / 2) - (nchars / 2); // width rounded up
-            leadSpace += (width & 1) & (nchars & 1); // if both are odd, we need to add one for correction
-            tailSpace -= (width & 1) & (nchars & 1); // if both are odd, we need to remove one for correction
-            break;
-        case '>':
-            leadSpace = width - nchars;
-            break;
-        case '<':
-        default:
-            tailSpace = width - nchars;
-            break;
+        for (const auto i : order) {
+            if (!entries.empty() && !Catalog::compare_keys(keys[order[entries.size() - 1]], keys[i])) {
+                return false;
+            }
+
+            // each key is followed by its format in the text
+            CatalogEntry entry = {};
+            entry.key = uint32_t(textSize);
+            entry.keyLength = uint32_t(keys[i].length);
+            entry.format = uint32_t(textSize + uint64_t(keys[i].length));
+            entry.formatLength = uint32_t(formats[i].length);
+            entry.firstToken = uint32_t(tokens.size());
+
+            const auto& fmt = formats[i];
+            FormatToken token;
+            int32_t offset = 0;
+            int32_t prevIndex = -1;
+
+            while (next_token(fmt, &offset, &prevIndex, &token)) {
+                // named and nested fields depend on the arguments, so these
+                // formats are formatted from their original string instead
+                if (token.nested || token.name.length) {
+                    entry.isDynamic = 1;
+                }
+
+                FormatFlags flags;
+
+                CatalogToken out = {};
+                out.text = entry.format + uint32_t(token.text.ptr - fmt.ptr);
+                out.textLength = uint32_t(token.text.length);
+                out.spec = token.spec.ptr ? entry.format + uint32_t(token.spec.ptr - fmt.ptr) : entry.format;
+                out.specLength = uint32_t(token.spec.length);
+                out.index = token.index;
+                out.hasFlags = (token.index >= 0 && parse_format(token.spec, &flags)) ? 1 : 0;
+                out.width = flags.width;
+                out.precision = flags.precision;
+                out.fill = flags.fill;
+                out.align = flags.align;
+                out.sign = flags.sign;
+                out.type = flags.type;
+                out.grouping = flags.grouping;
+                out.alternate = flags.alternate ? 1 : 0;
+                tokens.push_back(out);
+            }
+
+            entry.tokenCount = uint32_t(tokens.size() - entry.firstToken);
+            entries.push_back(entry);
+            textSize += uint64_t(keys[i].length) + uint64_t(formats[i].length);
         }
 
-        // apply leading padding
-        const char fill = flags.fill ? flags.fill : ' ';
+        CatalogHeader header = {};
+        header.magic = CATALOG_MAGIC;
+        header.version = CATALOG_VERSION;
+        header.entryCount = uint32_t(entries.size());
+        header.tokenCount = uint32_t(tokens.size());
 
-        while (leadSpace--) {
-            write_char(writer, fill);
+        const auto textOffset = uint64_t(sizeof(CatalogHeader))
+            + uint64_t(entries.size()) * sizeof(CatalogEntry)
+            + uint64_t(tokens.size()) * sizeof(CatalogToken);
+
+        if (textOffset + textSize > UINT32_MAX) {
+            return false;
         }
 
-        // write string
-        writer.write(nchars, str.ptr);
+        header.textOffset = uint32_t(textOffset);
+        header.textSize = uint32_t(textSize);
 
-        // apply tailing padding
-        while (tailSpace--) {
-            write_char(writer, fill);
+        writer.write(sizeof(header), &header);
+        writer.write(entries.size() * sizeof(CatalogEntry), entries.data());
+        writer.write(tokens.size() * sizeof(CatalogToken), tokens.data());
+
+        for (const auto i : order) {
+            writer.write(size_t(keys[i].length), keys[i].ptr);
+            writer.write(size_t(formats[i].length), formats[i].ptr);
         }
 
         return true;
     }
 
-    struct DummyArg {
+    /// Type-erased argument for formatting catalog tokens, which formats
+    /// built-in types with the token's decoded flags.
+    struct CatalogArg {
+        const void* value = nullptr;
+        bool (*format)(IWriter& writer, const CatalogToken& token, const char* text, const void* value) = nullptr;
     };
 
-    inline bool format_value(IWriter&, const StringView&, const DummyArg&)
+    template <class T>
+    bool format_catalog_arg(IWriter& writer, const CatalogToken& token, const char*, const T& value, std::true_type)
     {
-        return false;
-    }
+        if (!token.hasFlags) {
+            return false;
+        }
 
-    inline bool format_index(IWriter&, const StringView&, int32_t)
-    {
-        return false;
+        Formatter<T> formatter;
+        formatter.isDefault = !token.specLength;
+        formatter.flags.fill = token.fill;
+        formatter.flags.align = token.align;
+        formatter.flags.sign = token.sign;
+        formatter.flags.alternate = token.alternate != 0;
+        formatter.flags.width = token.width;
+        formatter.flags.grouping = token.grouping;
+        formatter.flags.precision = token.precision;
+        formatter.flags.type = token.type;
+
+        return formatter.format(writer, value);
     }
 
-    template <class Arg, class... Rest>
-    bool format_index(IWriter& writer, const StringView& format, int32_t index, Arg&& arg, Rest&&... rest)
+    template <class T>
+    bool format_catalog_arg(IWriter& writer, const CatalogToken& token, const char* text, const T& value, std::false_type)
     {
-        if (!index) {
-            return format_value(writer, format, std::forward<Arg>(arg));
-        } else {
-            return format_index(writer, format, index - 1, std::forward<Rest>(rest)...);
-        }
+        return format_arg(writer, StringView(text + token.spec, int32_t(token.specLength)), value, std::false_type());
     }
 
-    template <class... Args>
-    int32_t print(const StringView& fmt, Args&&... args)
+    template <class T>
+    bool format_catalog_erased(IWriter& writer, const CatalogToken& token, const char* text, const void* value)
     {
-        StreamWriter writer(stdout);
-        format(writer, fmt, std::forward<Args>(args)...);
-        return writer.result();
+        typedef typename std::decay<T>::type Value;
+
+        return format_catalog_arg<Value>(writer, token, text, *static_cast<const T*>(value), std::is_base_of<BuiltinFormatterTag, Formatter<Value>>());
     }
 
-    template <class... Args>
-    void do_format(IWriter& writer, const StringView& fmt, int32_t* prevIndex, Args&&... args)
+    template <class Arg>
+    CatalogArg make_catalog_arg(Arg&& arg)
     {
-        enum State {
-            STATE_OPENER,
-            STATE_INDEX,
-            STATE_MARKER,
-            STATE_FLAGS,
-            STATE_CLOSER,
-        };
+        typedef typename std::remove_reference<Arg>::type Value;
 
-        auto state = STATE_OPENER;
-        auto next = fmt.ptr;
-        auto start = fmt.ptr;
-        auto term = fmt.ptr + fmt.length;
+        CatalogArg result;
+        result.value = &arg;
+        result.format = &format_catalog_erased<Value>;
+        return result;
+    }
 
-        const char* formatStart = nullptr;
-        auto index = -1;
-        auto opened = 0;
-        auto nested = false;
+    /// Format the tokens of a catalog format against type-erased arguments.
+    SP_ENGINE void vformat_catalog(IWriter& writer, const CatalogFormat& fmt, const CatalogArg* args, int32_t count);
 
-        while (next < term) {
-            const auto ptr = next++;
-            const auto ch = *ptr;
+#if SP_DEFINE_ENGINE
+    SP_ENGINE void vformat_catalog(IWriter& writer, const CatalogFormat& fmt, const CatalogArg* args, int32_t count)
+    {
+        for (int32_t i = 0; i < fmt.tokenCount && !writer.stopped(); ++i) {
+            const auto& token = fmt.tokens[i];
+            const bool isField = token.index >= 0 && token.index < count;
 
-            switch (state) {
-            case STATE_OPENER:
-                if (ch == '{') {
-                    writer.write(int32_t(ptr - start), start);
-
-                    if (next < term) {
-                        if (*next != '{') {
-                            index = -1;
-                            start = ptr;
-                            nested = false;
-                            formatStart = nullptr;
-                            state = STATE_INDEX;
-                        } else {
-                            start = next++;
-                        }
-                    }
-                } else if (ch == '}') {
-                    writer.write(int32_t(next - start), start);
-                    if (next < term && *next == '}') {
-                        ++next;
-                    }
-                    start = next;
-                }
-                break;
+            // copied, as the catalog may be closed before the writer flushes
+            if (!isField || !args[token.index].format(writer, token, fmt.text, args[token.index].value)) {
+                writer.write(token.textLength, fmt.text + token.text);
+            }
+        }
+    }
+#endif
 
-            case STATE_INDEX:
-                if (ch >= '0' && ch <= '9') {
-                    index = (index < 0)
-                        ? (ch - '0')
-                        : (index * 10) + (ch - '0');
-                } else {
-                    if (index < 0) {
-                        index = *prevIndex + 1;
-                    }
-                    *prevIndex = index;
-                    state = STATE_MARKER;
-                    --next;
-                }
-                break;
+    template <class... Args>
+    void format(IWriter& writer, const CatalogFormat& fmt, Args&&... args)
+    {
+        if (fmt.isDynamic) {
+            format(writer, fmt.fmt, std::forward<Args>(args)...);
+            return;
+        }
 
-            case STATE_MARKER:
-                if (ch == ':') {
-                    state = STATE_FLAGS;
-                } else {
-                    state = STATE_CLOSER;
-                    --next;
-                }
-                break;
+        const CatalogArg erased[] = { make_catalog_arg(std::forward<Args>(args))..., CatalogArg() };
+        vformat_catalog(writer, fmt, erased, int32_t(sizeof...(Args)));
+    }
 
-            case STATE_FLAGS:
-                if (!formatStart) {
-                    formatStart = ptr;
+#if defined(SP_ENABLE_THREADS)
+    /// Joins any of the provided threads that are still joinable once
+    /// destroyed, so that none are left running if starting or waiting for
+    /// another one throws.
+    struct ThreadJoiner {
+        std::thread* threads;
+        size_t count;
+
+        ~ThreadJoiner()
+        {
+            for (size_t i = 0; i < count; ++i) {
+                if (threads[i].joinable()) {
+                    threads[i].join();
                 }
+            }
+        }
+    };
+#endif
 
-                switch (ch) {
-                case '{':
-                    ++opened;
-                    nested = true;
-                    break;
-                case '}':
-                    if (opened > 0) {
-                        --opened;
-                    }
-                    else {
-                        state = STATE_CLOSER;
-                        --next;
-                    }
-                    break;
+    template <class T>
+    void format_parallel(IWriter& writer, const StringView& fmt, const T records[], size_t count, int32_t threads)
+    {
+#if defined(SP_ENABLE_THREADS)
+        // more threads than cores only adds overhead
+        const auto cores = std::thread::hardware_concurrency();
+        const auto maxThreads = cores ? std::min(std::max(threads, 1), int32_t(cores)) : std::max(threads, 1);
+        const auto nchunks = std::min(size_t(maxThreads), count);
+
+        if (nchunks > 1) {
+            std::unique_ptr<BufferWriter[]> buffers(new BufferWriter[nchunks]);
+            std::unique_ptr<std::thread[]> workers(new std::thread[nchunks - 1]);
+            const ThreadJoiner joiner{ workers.get(), nchunks - 1 };
+
+            const auto formatChunk = [&](size_t chunk) {
+                const auto first = count * chunk / nchunks;
+                const auto last = count * (chunk + 1) / nchunks;
+
+                for (auto i = first; i < last; ++i) {
+                    format_record(buffers[chunk], fmt, records[i]);
                 }
+            };
 
-                break;
+            for (size_t i = 1; i < nchunks; ++i) {
+                workers[i - 1] = std::thread(formatChunk, i);
+            }
 
-            case STATE_CLOSER:
-                if (ch == '}') {
-                    StringView format = formatStart
-                        ? StringView(formatStart, int32_t(ptr - formatStart))
-                        : StringView();
-
-                    // handle nested format specifiers
-                    char buffer[64];
-
-                    if (nested) {
-                        StringWriter nestedWriter(buffer, sizeof(buffer));
-                        sp::do_format(nestedWriter, format, prevIndex, std::forward<Args>(args)...);
-                        const auto fullLen = nestedWriter.result();
-                        const auto realLen = std::min(size_t(fullLen), sizeof(buffer));
-                        format = StringView(buffer, int32_t(realLen));
-                    }
+            // the first chunk is formatted on this thread, and each chunk is
+            // written as soon as it (and everything before it) is done
+            formatChunk(0);
 
-                    if (format_index(writer, format, index, std::forward<Args>(args)...)) {
-                        start = next;
-                    }
+            for (size_t i = 0; i < nchunks; ++i) {
+                if (i) {
+                    workers[i - 1].join();
                 }
-                state = STATE_OPENER;
-                break;
+
+                writer.write(buffers[i].size(), buffers[i].data());
             }
-        }
 
-        // Print remaining data
-        if (start != term) {
-            writer.write(int32_t(term - start), start);
+            return;
         }
-    }
-
-    template <class... Args>
-    void format(IWriter& writer, const StringView& fmt, Args&&... args)
-    {
-        int32_t prevIndex = -1;
-        do_format(writer, fmt, &prevIndex, std::forward<Args>(args)...);
-    }
+#else
+        (void)threads;
+#endif
 
-    template <class... Args>
-    int32_t format(std::FILE* file, const StringView& fmt, Args&&... args)
-    {
-        StreamWriter writer(file);
-        format(writer, fmt, std::forward<Args>(args)...);
-        return writer.result();
-    }
-
-    template <class... Args>
-    int32_t format(char buffer[], size_t size, const StringView& fmt, Args&&... args)
-    {
-        StringWriter writer(buffer, size);
-        format(writer, fmt, std::forward<Args>(args)...);
-        return writer.result();
+        for (size_t i = 0; i < count; ++i) {
+            format_record(writer, fmt, records[i]);
+        }
     }
 
-    template <size_t N, class... Args>
-    int32_t format(char (&buffer)[N], const StringView& fmt, Args&&... args)
+    template <class Records>
+    void format_parallel(IWriter& writer, const StringView& fmt, const Records& records, int32_t threads)
     {
-        StringWriter writer(buffer, N);
-        format(writer, fmt, std::forward<Args>(args)...);
-        return writer.result();
+        format_parallel(writer, fmt, records.data(), records.size(), threads);
     }
 
     inline bool format_value(IWriter& writer, const StringView& fmt, std::nullptr_t)
@@ -892,33 +6508,17 @@ namespace sp {
 
     inline bool format_value(IWriter& writer, const StringView& fmt, bool value)
     {
-        FormatFlags flags;
-
-        if (parse_format(fmt, &flags)) {
-            switch (flags.type) {
-                case 'b':
-                case 'c':
-                case 'd':
-                case 'o':
-                case 'x':
-                case 'X':
-                    return format_int(writer, flags, false, (uint64_t)value);
-                default:
-                    return format_string(writer, flags, value ? "true" : "false");
-            }
-        }
-
-        return false;
+        return parse_and_format(writer, fmt, value);
     }
 
     inline bool format_value(IWriter& writer, const StringView& fmt, float value)
     {
-        return format_float(writer, fmt, value);
+        return parse_and_format(writer, fmt, value);
     }
 
     inline bool format_value(IWriter& writer, const StringView& fmt, double value)
     {
-        return format_float(writer, fmt, value);
+        return parse_and_format(writer, fmt, value);
     }
 
     inline bool format_value(IWriter& writer, const StringView& fmt, char value)
@@ -933,21 +6533,7 @@ namespace sp {
 
     inline bool format_value(IWriter& writer, const StringView& fmt, char32_t value)
     {
-        FormatFlags flags;
-
-        if (parse_format(fmt, &flags)) {
-            if (!flags.type) {
-                flags.type = 'c';
-            }
-
-            if (!flags.align) {
-                flags.align = '<';
-            }
-
-            return format_int(writer, flags, false, uint64_t(value));
-        }
-
-        return false;
+        return parse_and_format(writer, fmt, value);
     }
 
     template <size_t S> struct WcharSelector;
@@ -1002,24 +6588,12 @@ namespace sp {
 
     inline bool format_value(IWriter& writer, const StringView& fmt, long long value)
     {
-        static_assert(sizeof(value) == sizeof(uint64_t), "invalid cast on negation");
-
-        const auto abs = (value >= 0 || value == std::numeric_limits<long long>::min())
-            ? uint64_t(value)
-            : uint64_t(-value);
-
-        FormatFlags flags;
-
-        return parse_format(fmt, &flags)
-            && format_int(writer, flags, value < 0, abs);
+        return parse_and_format(writer, fmt, value);
     }
 
     inline bool format_value(IWriter& writer, const StringView& fmt, unsigned long long value)
     {
-        FormatFlags flags;
-
-        return parse_format(fmt, &flags)
-            && format_int(writer, flags, false, uint64_t(value));
+        return parse_and_format(writer, fmt, value);
     }
 
     inline bool format_value(IWriter& writer, const StringView& fmt, char value[])
@@ -1034,27 +6608,13 @@ namespace sp {
 
     inline bool format_value(IWriter& writer, const StringView& fmt, const StringView& value)
     {
-        FormatFlags flags;
-
-        return parse_format(fmt, &flags)
-            ? format_string(writer, flags, value)
-            : false;
+        return parse_and_format(writer, fmt, value);
     }
 
     template <class T>
     bool format_value(IWriter& writer, const StringView& fmt, T* value)
     {
-        FormatFlags flags;
-
-        if (parse_format(fmt, &flags)) {
-            if (!flags.type) {
-                flags.type = 'x';
-            }
-
-            return format_int(writer, flags, false, uint64_t(value));
-        }
-
-        return false;
+        return parse_and_format(writer, fmt, value);
     }
 
 } // namespace sp
@@ -0,0 +1,202 @@
+// sp - string formatting micro-library
+//
+// Written in 2017 by Johan Sköld
+//
+// To the extent possible under law, the author(s) have dedicated all
+// copyright and related and neighboring rights to this software to the public
+// domain worldwide. This software is distributed without any warranty.
+//
+// You should have received a copy of the CC0 Public Domain Dedication along
+// with this software. If not, see <http://creativecommons.org/publicdomain/zero/1.0/>.
+
+// Fuzz `sp::format`, `sp::FormatCursor` and `sp::Template` with arbitrary
+// format strings, failing on any input that takes more than a budgeted time
+// per byte of format string and output, or whose output exceeds what the
+// format spec limits allow.
+//
+// Standalone, it formats inputs generated from a dictionary of format string
+// fragments, including long repeated runs of them:
+//
+//     fuzz [iterations] [seed]
+//
+// Built with libFuzzer (`clang++ -fsanitize=fuzzer -DSP_LIBFUZZER`), it only
+// provides `LLVMFuzzerTestOneInput`.
+
+#include <algorithm> // std::min
+#include <chrono> // std::chrono::steady_clock
+#include <cstdio> // std::printf
+#include <cstdlib> // std::abort, std::atoi
+#include <random> // std::mt19937
+#include <string> // std::string
+
+#include "../include/sp.hpp"
+
+// Time allowed per input, plus per byte of format string and output, which
+// catches anything that grows faster than the input. Each input is formatted
+// five ways, and runs of nested fields cost up to 80 ns per byte across them.
+// Float formatting is left to `snprintf`, which is slower, so inputs are
+// formatted with and without a float argument, against separate budgets.
+#if !defined(SP_FUZZ_FIXED_NS)
+#define SP_FUZZ_FIXED_NS 200000
+#endif
+#if !defined(SP_FUZZ_NS_PER_BYTE)
+#define SP_FUZZ_NS_PER_BYTE 150
+#endif
+#if !defined(SP_FUZZ_FLOAT_NS_PER_BYTE)
+#define SP_FUZZ_FLOAT_NS_PER_BYTE 300
+#endif
+
+class CountWriter : public sp::IWriter {
+public:
+    size_t write(size_t length, const void*) override
+    {
+        m_length += length;
+        return length;
+    }
+
+    size_t result() const
+    {
+        return m_length;
+    }
+
+private:
+    size_t m_length = 0;
+};
+
+// Format `fmt` every way the fuzzer covers, with `second` as the argument at
+// index 1, and return the length of the output.
+template <class T>
+static size_t format_once(const sp::StringView& fmt, T second)
+{
+    // the cursor outlives the call making it, so named arguments must not
+    // reference temporaries
+    const unsigned named = 7u;
+
+    CountWriter counter;
+    sp::format(counter, fmt, 42, second, "str", sp::decimal(-12345, 2), true, 'c', sp::arg("name", named));
+
+    char buffer[256];
+    sp::StringWriter truncated(buffer, sizeof(buffer), true);
+    sp::format(truncated, fmt, 42, second, "str", sp::decimal(-12345, 2), true, 'c', sp::arg("name", named));
+
+    // the cursor produces the same output in chunks
+    auto cursor = sp::make_cursor(fmt, 42, second, "str", sp::decimal(-12345, 2), true, 'c', sp::arg("name", named));
+    size_t chunked = 0;
+
+    while (!cursor.done()) {
+        chunked += cursor.next(buffer, 61);
+    }
+
+    if (chunked != counter.result()) {
+        sp::print("cursor produced {} bytes rather than {}:\n{:.4096q}\n", chunked, counter.result(), fmt);
+        std::abort();
+    }
+
+    // templates render everything, and then only what changed
+    sp::Template<int, T, const char*, sp::Decimal, bool, char> fixed(fmt);
+    fixed.update(42, second, "str", sp::decimal(-12345, 2), true, 'c');
+    fixed.update(43, second, "str", sp::decimal(-12345, 2), false, 'c');
+
+    return counter.result() + chunked + size_t(fixed.str().length);
+}
+
+template <class T>
+static void fuzz_with(const sp::StringView& fmt, T second, double nsPerByte)
+{
+    const auto size = size_t(fmt.length);
+    size_t output = 0;
+    double best = 0;
+
+    // retry before failing, so that being descheduled isn't reported
+    for (int attempt = 0; attempt < 3; ++attempt) {
+        const auto start = std::chrono::steady_clock::now();
+        output = format_once(fmt, second);
+        const auto elapsed = std::chrono::steady_clock::now() - start;
+        const auto ns = std::chrono::duration<double, std::nano>(elapsed).count();
+        best = attempt ? std::min(best, ns) : ns;
+
+        if (best <= SP_FUZZ_FIXED_NS + nsPerByte * double(size + output)) {
+            break;
+        }
+    }
+
+    // every field needs at least two bytes, and is bounded by the limits,
+    // for each of the three outputs
+    const auto maxOutput = 3 * size * size_t(SP_MAX_WIDTH + SP_MAX_PRECISION + 1024);
+    const auto isSlow = best > SP_FUZZ_FIXED_NS + nsPerByte * double(size + output);
+
+    if (isSlow || output > maxOutput) {
+        sp::print("{} for a {} byte format string with {} bytes of output ({:.1f} ns/byte):\n{:.4096q}\n",
+            isSlow ? "too slow" : "too much output", size, output, best / double(size + output), fmt);
+        std::abort();
+    }
+}
+
+static void fuzz_one(const char* data, size_t size)
+{
+    if (size > size_t(INT32_MAX)) {
+        return;
+    }
+
+    const sp::StringView fmt(data, int32_t(size));
+    fuzz_with(fmt, -15, SP_FUZZ_NS_PER_BYTE);
+    fuzz_with(fmt, -1.5, SP_FUZZ_FLOAT_NS_PER_BYTE);
+}
+
+#if defined(SP_LIBFUZZER)
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size)
+{
+    fuzz_one(reinterpret_cast<const char*>(data), size);
+    return 0;
+}
+#else
+static const char* const s_fragments[] = {
+    "{", "}", "{{", "}}", "{}", "{:", ":", "{0}", "{1:", "{3:", "{name}", "{name:",
+    "{:{}}", "{:{:{}}}", "{:{{}}}", "{:>{}.{}}", "0", "9", "99999", "65535", "65536",
+    "999999999999", ".", ".9", ",", "_", "#", "+", " ", "<", ">", "^", "=", "*<",
+    "b", "c", "d", "e", "f", "g", "o", "x", "X", "%", "j", "q", "s", "csv", "text ",
+};
+
+static const size_t FRAGMENT_COUNT = sizeof(s_fragments) / sizeof(s_fragments[0]);
+
+static std::string generate(std::mt19937& rng)
+{
+    std::string result;
+    const auto pieces = rng() % 32;
+
+    for (uint32_t i = 0; i < pieces; ++i) {
+        const auto choice = rng() % 16;
+
+        if (choice == 0) {
+            result += char(rng());
+        } else if (choice == 1) {
+            // a long run of one fragment, to show up anything superlinear
+            const std::string fragment = s_fragments[rng() % FRAGMENT_COUNT];
+            const auto repeats = 1 + (rng() % 20000);
+
+            for (uint32_t r = 0; r < repeats; ++r) {
+                result += fragment;
+            }
+        } else {
+            result += s_fragments[rng() % FRAGMENT_COUNT];
+        }
+    }
+
+    return result;
+}
+
+int main(int argc, char* argv[])
+{
+    const auto iterations = (argc > 1) ? std::atoi(argv[1]) : 20000;
+    const auto seed = (argc > 2) ? uint32_t(std::atoi(argv[2])) : 1u;
+    std::mt19937 rng(seed);
+
+    for (int i = 0; i < iterations; ++i) {
+        const auto input = generate(rng);
+        fuzz_one(input.data(), input.size());
+    }
+
+    sp::print("Formatted {} generated format strings within budget.\n", iterations);
+    return 0;
+}
+#endif
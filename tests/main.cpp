@@ -10,9 +10,19 @@
 // with this software. If not, see <http://creativecommons.org/publicdomain/zero/1.0/>.
 
 #include <cfloat> // DBL_MAX, FLT_MIN, FLT_MAX
+#include <chrono> // std::chrono
 #include <cstdio> // std::printf, fmemopen
 #include <cstdlib> // std::malloc, std::free
+#include <sstream> // std::ostringstream
 #include <string> // std::string
+#include <thread> // std::thread
+#include <tuple> // std::tuple, std::make_tuple
+#include <vector> // std::vector
+
+#if defined(__linux__)
+#include <fcntl.h> // fcntl, O_APPEND
+#include <ucontext.h> // getcontext, makecontext, swapcontext
+#endif
 
 #include "../include/sp.hpp"
 
@@ -56,6 +66,42 @@ static int s_failed = 0;
         break;                                                                           \
     }
 
+#if defined(__linux__)
+static ucontext_t s_stackCaller;
+static void (*s_stackFn)();
+
+static void run_stack_fn()
+{
+    s_stackFn();
+}
+
+// Run `fn` on a stack filled with a pattern, and return how many bytes of it
+// were overwritten.
+static size_t stack_high_water(void (*fn)())
+{
+    // resolve lazily bound symbols before measuring
+    fn();
+
+    static char stack[64 * 1024];
+    std::memset(stack, 0xa5, sizeof(stack));
+
+    ucontext_t context;
+    getcontext(&context);
+    context.uc_stack.ss_sp = stack;
+    context.uc_stack.ss_size = sizeof(stack);
+    context.uc_link = &s_stackCaller;
+    s_stackFn = fn;
+    makecontext(&context, run_stack_fn, 0);
+    swapcontext(&s_stackCaller, &context);
+
+    size_t untouched = 0;
+    while (untouched < sizeof(stack) && stack[untouched] == char(0xa5)) {
+        ++untouched;
+    }
+    return sizeof(stack) - untouched;
+}
+#endif
+
 struct Foo {
 };
 
@@ -69,6 +115,93 @@ static bool format_value(sp::IWriter& writer, const sp::StringView& format, cons
     return true;
 }
 
+struct Point {
+    int x;
+    int y;
+};
+
+static int s_pointParses = 0;
+
+namespace sp {
+    template <>
+    struct Formatter<Point> {
+        bool brackets = false;
+
+        bool parse(const StringView& spec)
+        {
+            ++s_pointParses;
+            brackets = (spec.length == 1 && spec.ptr[0] == 'b');
+            return brackets || !spec.length;
+        }
+
+        bool format(IWriter& writer, const Point& point) const
+        {
+            sp::format(writer, brackets ? "[{}, {}]" : "{},{}", point.x, point.y);
+            return true;
+        }
+    };
+} // namespace sp
+
+struct Counted {
+    int* count;
+};
+
+static bool format_value(sp::IWriter& writer, const sp::StringView&, const Counted& value)
+{
+    ++*value.count;
+    writer.write(7, "counted");
+    return true;
+}
+
+namespace net {
+    enum class State : uint8_t {
+        Idle,
+        Connecting,
+        Open,
+        Closed,
+    };
+
+    enum Event {
+        EVENT_TIMEOUT = -1,
+        EVENT_READ = 1,
+        EVENT_WRITE = 4,
+        EVENT_ERROR = 1000,
+        EVENT_FAILURE = EVENT_ERROR,
+    };
+} // namespace net
+
+SP_ENUM(net::State, Idle, Connecting, Open, Closed)
+SP_ENUM(net::Event, EVENT_TIMEOUT, EVENT_READ, EVENT_WRITE, EVENT_ERROR, EVENT_FAILURE)
+
+#if defined(SP_HAS_CONSTEXPR)
+static constexpr bool equals(const char* a, const char* b)
+{
+    while (*a && *a == *b) {
+        ++a;
+        ++b;
+    }
+    return *a == *b;
+}
+
+static constexpr auto s_header = sp::format_to_fixed<32>("{:>4}|{:<6}|{:#x}|{}", "id", "name", 255, true);
+static_assert(equals(s_header.c_str(), "  id|name  |0xff|true"), "formatted at compile time");
+static_assert(sp::format_to_fixed<4>("{}", 123456).size() == 4, "truncated at compile time");
+
+static_assert(sp::max_length<int8_t, bool>(SP_STRING("[{}] {}")) == 12, "sign, digits and literal text");
+static_assert(sp::max_length<uint16_t>(SP_STRING("{:#b}")) == 19, "binary digits and prefix");
+static_assert(sp::max_length<int>(SP_STRING("{:>20}")) == 20, "width");
+static_assert(sp::max_length<const char*>(SP_STRING("{:.8}")) == 8, "string precision");
+static_assert(sp::max_length<const char*>(SP_STRING("{:.8j}")) == 50, "escaped string precision");
+static_assert(sp::max_length<const char*>(SP_STRING("{}")) == -1, "unbounded string");
+static_assert(sp::max_length<sp::Decimal>(SP_STRING("{:,.2f}")) == 55, "decimal precision");
+static_assert(sp::max_length<int>(SP_STRING("{:j} {name} {1}")) == 15, "fields written as-is");
+static_assert(sp::format_fixed(SP_STRING("{:+}|{:x}"), 7, 255u).capacity() == 23, "capacity");
+#if defined(SP_HAS_INT128)
+static_assert(sp::max_length<sp::int128_t, sp::uint128_t>(SP_STRING("{} {:#b}")) == 172, "128-bit integers");
+static_assert(equals(sp::format_to_fixed<48>("{}", ~sp::uint128_t(0)).c_str(), "340282366920938463463374607431768211455"), "128-bit decimal");
+#endif
+#endif
+
 int main()
 {
     TEST_CASE("Output with a string buffer")
@@ -128,6 +261,34 @@ int main()
         TEST_FORMAT("{{0}}", "{{{{0}}}}", 1);
         TEST_FORMAT("a{b", "a{{b");
         TEST_FORMAT("a}b", "a}}b");
+        TEST_FORMAT("a{", "a{");
+        TEST_FORMAT("a{b{", "a{{b{");
+    }
+
+    TEST_CASE("Format limits")
+    {
+        // fields beyond the limits are invalid, and written as-is
+        TEST_FORMAT("{:65536}|{:.65536f}", "{:65536}|{:.65536f}", 1, 1.5);
+        TEST_FORMAT("{:99999999999}|{:.99999999999}", "{:99999999999}|{:.99999999999}", 1, "a");
+        TEST_FORMAT("Hello", "{0:{0:{0:{0:{0:{0:{0:{0:{1}}}}}}}}}", Foo{}, "Hello");
+        TEST_FORMAT("{0:{0:{0:{0:{0:{0:{0:{0:{0:{1}}}}}}}}}}", "{0:{0:{0:{0:{0:{0:{0:{0:{0:{1}}}}}}}}}}", Foo{}, "Hello");
+        TEST_FORMAT("{99999999999} 1", "{99999999999} {0}", 1);
+
+        auto buffer = (char*)std::malloc(128 * 1024);
+        REQUIRE(sp::format(buffer, 128 * 1024, "{:65535}", 1) == 65535);
+        REQUIRE(sp::format(buffer, 128 * 1024, "{:.65535}", 1.5) == 3);
+        REQUIRE(sp::format(buffer, 128 * 1024, "{:.2000f}", 1e300) == 301 + 1 + 2000);
+        REQUIRE(buffer[0] == '1' && buffer[301] == '.' && buffer[2301] == '0');
+        std::free(buffer);
+
+        // lengths that don't fit the result are an error, not an overflow
+        std::string fields;
+        for (int i = 0; i < 33000; ++i) {
+            fields += "{0:65535}";
+        }
+        sp::StringWriter counter(nullptr, 0);
+        sp::format(counter, sp::StringView(fields.data(), int32_t(fields.size())), 1);
+        REQUIRE(counter.result() == -1);
     }
 
     TEST_CASE("Custom format")
@@ -137,6 +298,333 @@ int main()
         TEST_FORMAT("<empty>}", "{:}}", Foo{});
     }
 
+    TEST_CASE("Enum formats")
+    {
+        // dense values are looked up by index
+        TEST_FORMAT("Idle Open", "{} {}", net::State::Idle, net::State::Open);
+        TEST_FORMAT("2 0x3 11", "{:d} {:#x} {:b}", net::State::Open, net::State::Closed, net::State::Closed);
+        TEST_FORMAT("  Connecting|\"Open\"", "{:>12}|{:q}", net::State::Connecting, net::State::Open);
+        TEST_FORMAT("9 +9", "{} {:+}", net::State(9), net::State(9));
+
+        // sparse ones by a binary search, with aliases using the first name
+        TEST_FORMAT("EVENT_TIMEOUT EVENT_READ EVENT_WRITE", "{} {} {}", net::EVENT_TIMEOUT, net::EVENT_READ, net::EVENT_WRITE);
+        TEST_FORMAT("EVENT_ERROR -1", "{} {:d}", net::EVENT_FAILURE, net::EVENT_TIMEOUT);
+        TEST_FORMAT("2 5", "{} {}", net::Event(2), net::Event(5));
+    }
+
+    TEST_CASE("Two-phase formatter")
+    {
+        TEST_FORMAT("1,2", "{}", Point{ 1, 2 });
+        TEST_FORMAT("[1, 2]", "{:b}", Point{ 1, 2 });
+        TEST_FORMAT("{:x}", "{:x}", Point{ 1, 2 });
+    }
+
+    TEST_CASE("Compiled formats")
+    {
+        s_pointParses = 0;
+        const sp::CompiledFormat<Point, int> compiled("{0:b} {1:>3} {0} {2} {:x} {{}} {1:q}");
+        REQUIRE(s_pointParses == 2);
+
+        for (int i = 0; i < 3; ++i) {
+            char expected[64];
+            const auto expectedLen = sp::format(expected, "{0:b} {1:>3} {0} {2} {:x} {{}} {1:q}", Point{ i, 2 }, i);
+
+            // specs are only parsed when compiling
+            s_pointParses = 0;
+
+            char buffer[64];
+            sp::StringWriter writer(buffer, sizeof(buffer));
+            sp::format(writer, compiled, Point{ i, 2 }, i);
+            REQUIRE(s_pointParses == 0);
+            REQUIRE(writer.result() == expectedLen);
+            REQUIRE(std::memcmp(buffer, expected, size_t(expectedLen)) == 0);
+        }
+
+        // nested fields fall back to regular formatting
+        const sp::CompiledFormat<int, int> nested("{:>{}}|");
+        char buffer[16];
+        sp::StringWriter writer(buffer, sizeof(buffer));
+        sp::format(writer, nested, 7, 3);
+        REQUIRE(writer.result() == 4);
+        REQUIRE(std::memcmp(buffer, "  7|", 4) == 0);
+    }
+
+    TEST_CASE("Templates")
+    {
+        sp::Template<int, double, const char*> status("cpu {0:>3}% load {1:6.2f} [{2:<8}] {{{0:>4x}}}");
+        REQUIRE(status.valid());
+        REQUIRE(status.fields().size() == 4);
+        REQUIRE(status.fields()[1].offset == 14 && status.fields()[1].length == 6);
+
+        const auto text = [&] {
+            return std::string(status.str().ptr, size_t(status.str().length));
+        };
+
+        // everything is dirty at first
+        char name[] = "idle";
+        REQUIRE(status.update(42, 1.5, name) == 1);
+        REQUIRE(text() == "cpu  42% load   1.50 [idle    ] {  2a}");
+        REQUIRE(status.dirty()[0].offset == 0 && status.dirty()[0].length == 38);
+
+        // then only the bytes that changed
+        REQUIRE(status.update(43, 1.5, name) == 2);
+        REQUIRE(status.dirty()[0].offset == 6 && status.dirty()[0].length == 1);
+        REQUIRE(status.dirty()[1].offset == 36 && status.dirty()[1].length == 1);
+        REQUIRE(status.update(43, 1.5, name) == 0);
+
+        // strings are compared by content, as they may change in place
+        std::memcpy(name, "busy", 4);
+        REQUIRE(status.update(43, 1.5, name) == 1);
+        REQUIRE(status.dirty()[0].offset == 22 && status.dirty()[0].length == 4);
+
+        // output that doesn't fit fills its field with a marker
+        REQUIRE(status.update(12345, 99.999, name) == 3);
+        REQUIRE(text() == "cpu ###% load 100.00 [busy    ] {3039}");
+
+        // fields that don't parse are written as-is, but every field that
+        // does needs a width
+        sp::Template<int> literal("{:>3}|{:5q}");
+        REQUIRE(literal.update(7) == 1);
+        REQUIRE(literal.str().length == 9 && std::memcmp(literal.str().ptr, "  7|{:5q}", 9) == 0);
+        REQUIRE(!sp::Template<int>("{}").valid());
+        REQUIRE(!(sp::Template<int, int>("{:>{}}").valid()));
+        REQUIRE(sp::Template<int>("{0:>4}").update(1) == 1);
+
+        // widths come from the formatter, or from a standard spec
+        int count = 0;
+        sp::Template<net::State, Counted> custom("{:>7}|{:>9}");
+        REQUIRE(custom.update(net::State::Open, Counted{ &count }) == 1);
+        REQUIRE(custom.str().length == 17 && std::memcmp(custom.str().ptr, "   Open|counted  ", 17) == 0);
+        REQUIRE(!sp::Template<Point>("{:b}").valid());
+        REQUIRE(!sp::Template<std::chrono::system_clock::time_point>("{:%T}").valid());
+    }
+
+    TEST_CASE("Catalog")
+    {
+        const sp::StringView keys[] = { "greeting", "files", "point", "named", "invalid", "" };
+        const sp::StringView formats[] = { "{2}, {0} {1}!", "{:>5} {{files}} in {:q}", "at {:b}", "{name}: {0:>{1}}", "{:j} {:e} {5}", "empty key" };
+
+        sp::BufferWriter file;
+        REQUIRE(sp::write_catalog(file, keys, formats, 6));
+
+        sp::Catalog catalog;
+        REQUIRE(catalog.load(file.data(), file.size()));
+        REQUIRE(catalog.size() == 6);
+
+        // catalog formats match formatting their original strings
+        for (int i = 0; i < 3; ++i) {
+            char expected[64];
+            char buffer[64];
+            sp::CatalogFormat fmt;
+
+            const auto check = [&](int32_t expectedLen, const sp::StringWriter& writer) {
+                REQUIRE(writer.result() == expectedLen);
+                REQUIRE(std::memcmp(buffer, expected, size_t(expectedLen)) == 0);
+            };
+
+            REQUIRE(catalog.find("greeting", &fmt));
+            sp::StringWriter greeting(buffer, sizeof(buffer));
+            sp::format(greeting, fmt, "dear", i, "Hello");
+            check(sp::format(expected, "{2}, {0} {1}!", "dear", i, "Hello"), greeting);
+
+            REQUIRE(catalog.find("files", &fmt));
+            sp::StringWriter files(buffer, sizeof(buffer));
+            sp::format(files, fmt, i * 100, "/tmp");
+            check(sp::format(expected, "{:>5} {{files}} in {:q}", i * 100, "/tmp"), files);
+
+            REQUIRE(catalog.find("point", &fmt));
+            sp::StringWriter point(buffer, sizeof(buffer));
+            sp::format(point, fmt, Point{ i, 2 });
+            check(sp::format(expected, "at {:b}", Point{ i, 2 }), point);
+
+            REQUIRE(catalog.find("named", &fmt) && fmt.isDynamic);
+            sp::StringWriter named(buffer, sizeof(buffer));
+            sp::format(named, fmt, i, 4, sp::arg("name", "x"));
+            check(sp::format(expected, "{name}: {0:>{1}}", i, 4, sp::arg("name", "x")), named);
+
+            // invalid fields and missing arguments are written as-is
+            REQUIRE(catalog.find("invalid", &fmt));
+            sp::StringWriter invalid(buffer, sizeof(buffer));
+            sp::format(invalid, fmt, i, "s");
+            check(sp::format(expected, "{:j} {:e} {5}", i, "s"), invalid);
+        }
+
+        sp::CatalogFormat fmt;
+        REQUIRE(catalog.find("", &fmt) && fmt.fmt.length == 9);
+        REQUIRE(!catalog.find("greetings", &fmt));
+        REQUIRE(!catalog.find("a", &fmt));
+
+        // repeated keys, and data that isn't a catalog, are rejected
+        const sp::StringView repeated[] = { "a", "b", "a" };
+        sp::BufferWriter rejected;
+        REQUIRE(!sp::write_catalog(rejected, repeated, repeated, 3));
+        REQUIRE(!catalog.load(formats, sizeof(formats)));
+        REQUIRE(catalog.size() == 0 && !catalog.find("files", &fmt));
+
+#if !defined(_WIN32)
+        char path[] = "/tmp/sp-test-XXXXXX";
+        const int fd = mkstemp(path);
+        REQUIRE(fd >= 0 && write(fd, file.data(), file.size()) == ssize_t(file.size()));
+        close(fd);
+
+        REQUIRE(catalog.map(path));
+        unlink(path);
+
+        char buffer[32];
+        sp::StringWriter writer(buffer, sizeof(buffer));
+        REQUIRE(catalog.find("greeting", &fmt));
+        sp::format(writer, fmt, "world", 1, "Hi");
+        REQUIRE(writer.result() == 12 && std::memcmp(buffer, "Hi, world 1!", 12) == 0);
+        REQUIRE(!catalog.map(path));
+#endif
+    }
+
+    TEST_CASE("Chrono formats")
+    {
+        using namespace std::chrono;
+
+        // 2017-03-04 05:06:07.089012345 UTC
+        const auto time = system_clock::time_point(duration_cast<system_clock::duration>(nanoseconds(1488603967089012345ll)));
+        const auto secs = time_point<system_clock, seconds>(seconds(1488603967));
+
+        TEST_FORMAT("2017-03-04 05:06:07", "{}", secs);
+        TEST_FORMAT("2017-03-04T05:06:07.089Z", "{:%FT%T.%LZ}", time);
+        TEST_FORMAT("2017/03/04 05h06m07s 100%", "{:%Y/%m/%d %Hh%Mm%Ss 100%%}", secs);
+        TEST_FORMAT("07.089012", "{:%S.%f}", time_point<system_clock, microseconds>(microseconds(1488603967089012ll)));
+        TEST_FORMAT("07.000000000", "{:%S.%N}", secs);
+        TEST_FORMAT("1969-12-31 23:59:59.500", "{:%F %T.%L}", time_point<system_clock, milliseconds>(milliseconds(-500)));
+        TEST_FORMAT("0000-03-01", "{:%F}", time_point<system_clock, seconds>(seconds(-62162035200ll)));
+        TEST_FORMAT("{:%Q}", "{:%Q}", secs);
+        TEST_FORMAT("{:%}", "{:%}", secs);
+
+        // consecutive time points within one second reuse the cached output
+        for (int i = 0; i < 3; ++i) {
+            char expected[32];
+            std::snprintf(expected, sizeof(expected), "05:06:07.%03d|2017", i * 400);
+            TEST_FORMAT(expected, "{:%T.%L|%Y}", secs + milliseconds(i * 400));
+        }
+        TEST_FORMAT("05:06:08.200|2017", "{:%T.%L|%Y}", secs + milliseconds(1200));
+        TEST_FORMAT("05:06:08", "{:%T}", secs + milliseconds(1200));
+
+        // more sub-second fields than can be patched aren't cached
+        TEST_FORMAT("111.111.111.111.111", "{:%L.%L.%L.%L.%L}", secs + milliseconds(111));
+        TEST_FORMAT("222.222.222.222.222", "{:%L.%L.%L.%L.%L}", secs + milliseconds(222));
+
+        TEST_FORMAT("15ms", "{}", milliseconds(15));
+        TEST_FORMAT("-3s", "{}", seconds(-3));
+        TEST_FORMAT("2min", "{}", minutes(2));
+        TEST_FORMAT(" 1.5h", "{:>4}", duration<double, std::ratio<3600>>(1.5));
+        TEST_FORMAT("0x10ns", "{:#x}", nanoseconds(16));
+        TEST_FORMAT("7[10]s", "{}", duration<int, std::ratio<10>>(7));
+        TEST_FORMAT("7[1/30]s", "{}", duration<int, std::ratio<1, 30>>(7));
+        TEST_FORMAT("26:03:04.500", "{:%T.%L}", hours(26) + minutes(3) + milliseconds(4500));
+        TEST_FORMAT("-00:00:01.250", "{:%T.%L}", milliseconds(-1250));
+        TEST_FORMAT("{:%F}", "{:%F}", seconds(1));
+    }
+
+    TEST_CASE("Named arguments")
+    {
+        TEST_FORMAT("bob is 42", "{name} is {age}", sp::arg("name", "bob"), sp::arg("age", 42));
+        TEST_FORMAT("  42|bob", "{age:>4}|{name}", sp::arg("name", "bob"), sp::arg("age", 42));
+        TEST_FORMAT("1 x 2", "{} {x} {}", 1, sp::arg("x", 'x'), 2);
+        TEST_FORMAT("2", "{:{w}}", 2, sp::arg("w", 1));
+        TEST_FORMAT("  a b", "{x:>{}} {}", sp::arg("x", 'a'), 3, 'b');
+        TEST_FORMAT("{missing}", "{missing}", sp::arg("name", 1));
+        TEST_FORMAT("{foo.bar} 2", "{foo.bar} {}", 1, 2);
+        TEST_FORMAT("{a} 2", "{a} {}", 1, 2);
+        TEST_FORMAT("{missing} 2", "{missing} {}", sp::arg("name", 1), 2);
+        TEST_FORMAT("{9a}", "{9a}", 1);
+
+        const sp::CompiledFormat<sp::NamedArg<int>> compiled("<{n}>");
+        char buffer[8];
+        sp::StringWriter writer(buffer, sizeof(buffer));
+        sp::format(writer, compiled, sp::arg("n", 5));
+        REQUIRE(writer.result() == 3);
+        REQUIRE(std::memcmp(buffer, "<5>", 3) == 0);
+    }
+
+    TEST_CASE("Lazy arguments")
+    {
+        int calls = 0;
+        const auto expensive = sp::lazy([&calls] {
+            ++calls;
+            return 42;
+        });
+
+        TEST_FORMAT("  42|42", "{0:>4}|{0}", expensive);
+        REQUIRE(calls == 2);
+
+        TEST_FORMAT("unused", "{1}", expensive, "unused");
+        REQUIRE(calls == 2);
+
+        TEST_FORMAT("abc", "{}", sp::lazy([] { return "abc"; }));
+        TEST_FORMAT("x", "{n}", sp::arg("n", sp::lazy([] { return 'x'; })));
+    }
+
+    TEST_CASE("Logger")
+    {
+        sp::BufferWriter output;
+        sp::Logger logger(output, sp::LOGLEVEL_INFO);
+        int evaluated = 0;
+
+        const auto evaluate = [&evaluated](int value) {
+            ++evaluated;
+            return value;
+        };
+
+        REQUIRE(!logger.enabled(sp::LOGLEVEL_DEBUG));
+        REQUIRE(logger.enabled(sp::LOGLEVEL_ERROR));
+
+        SP_LOG(logger, sp::LOGLEVEL_DEBUG, "debug {}", evaluate(1));
+        SP_LOG(logger, sp::LOGLEVEL_WARNING, "warning {}", evaluate(2));
+        logger.log(sp::LOGLEVEL_TRACE, "trace {}", sp::lazy([&] { return evaluate(3); }));
+        REQUIRE(evaluated == 1);
+
+        logger.set_level(sp::LOGLEVEL_OFF);
+        SP_LOG(logger, sp::LOGLEVEL_ERROR, "error {}", evaluate(4));
+        REQUIRE(evaluated == 1);
+
+        // the logger and level are only evaluated once
+        sp::BufferWriter once;
+        sp::Logger onceLogger(once, sp::LOGLEVEL_INFO);
+        int loggers = 0;
+        int levels = 0;
+        SP_LOG((++loggers, onceLogger), (++levels, sp::LOGLEVEL_INFO), "info");
+        REQUIRE(loggers == 1 && levels == 1);
+        REQUIRE(once.size() == 5);
+
+        const char expected[] = "warning 2\n";
+        REQUIRE(output.size() == sizeof(expected) - 1);
+        REQUIRE(std::memcmp(output.data(), expected, output.size()) == 0);
+    }
+
+    TEST_CASE("Structured formatting")
+    {
+        const auto structured = [](sp::RecordFormat recordFormat, const char* expectedText, const char* expectedRecord, const char* fmt, int count) {
+            sp::BufferWriter text;
+            sp::BufferWriter record;
+            sp::format_structured(text, record, recordFormat, fmt, sp::arg("user", "bob \"b\""), sp::arg("count", count), 1.5, true, Point{ 1, 2 });
+            REQUIRE(text.size() == std::strlen(expectedText));
+            REQUIRE(text.size() == 0 || std::memcmp(text.data(), expectedText, text.size()) == 0);
+            REQUIRE(record.size() == std::strlen(expectedRecord));
+            REQUIRE(record.size() == 0 || std::memcmp(record.data(), expectedRecord, record.size()) == 0);
+        };
+
+        structured(sp::RECORD_JSON,
+            "bob \"b\" sent    3 items in 1.5s (true) [1, 2] {x}",
+            "{\"user\":\"bob \\\"b\\\"\",\"count\":3,\"2\":1.5,\"3\":true,\"4\":\"[1, 2]\"}",
+            "{user} sent {count:>4} items in {2}s ({}) {:b} {x}", 3);
+
+        structured(sp::RECORD_LOGFMT,
+            "bob \"b\" ff 255 ff",
+            "user=\"bob \\\"b\\\"\" count=ff",
+            "{user} {count:x} {count} {count:x}", 255);
+
+        structured(sp::RECORD_JSON, "007 1,2", "{\"count\":\"007\",\"4\":\"1,2\"}", "{count:03} {4}", 7);
+        structured(sp::RECORD_LOGFMT, "-7 1", "count=-7 3=1", "{count} {3:x}", -7);
+        structured(sp::RECORD_JSON, "", "{}", "", 0);
+    }
+
     TEST_CASE("Nested formats")
     {
         TEST_FORMAT("a b ", "{:{}}{:{}}", 'a', 2, 'b', 2);
@@ -272,7 +760,35 @@ int main()
         TEST_FORMAT("+  177", "{:=+6o}", INT8_MAX);
         TEST_FORMAT(">> 18446744073709551615", "{:>> 23}", UINT64_MAX);
         TEST_FORMAT("0x7fffffffffffffff", "{:#x}", INT64_MAX);
+        TEST_FORMAT("-9223372036854775808", "{}", INT64_MIN);
+        TEST_FORMAT("18446744073709551615", "{}", UINT64_MAX);
+        TEST_FORMAT("1000000000", "{}", 1000000000);
+    }
+
+#if defined(SP_HAS_INT128)
+    TEST_CASE("128-bit integer formats")
+    {
+        const auto e19 = sp::uint128_t(10000000000000000000ull);
+        const auto max = ~sp::uint128_t(0);
+        const auto min = sp::int128_t(sp::uint128_t(1) << 127);
+
+        TEST_FORMAT("0 -1 42", "{} {} {}", sp::uint128_t(0), sp::int128_t(-1), sp::int128_t(42));
+        TEST_FORMAT("340282366920938463463374607431768211455", "{}", max);
+        TEST_FORMAT("-170141183460469231731687303715884105728", "{}", min);
+
+        // inner 19-digit chunks keep their leading zeros
+        TEST_FORMAT("10000000000000000000", "{}", e19);
+        TEST_FORMAT("100000000000000000000000000000000000005", "{}", e19 * e19 + 5);
+        TEST_FORMAT("+12345678901234567890123", "{:+}", sp::int128_t(e19 * 1234 + 5678901234567890123ull));
+        TEST_FORMAT("   -10000000000000000000", "{:>24}", -sp::int128_t(e19));
+
+        TEST_FORMAT("0x7fffffffffffffffffffffffffffffff", "{:#x}", sp::int128_t(max >> 1));
+        TEST_FORMAT("-0X80000000000000000000000000000000", "{:#X}", min);
+        TEST_FORMAT("0o3777777777777777777777777777777777777777777", "{:#o}", max);
+        TEST_FORMAT("10000000000000000000000000000000000000000000000000000000000000000", "{:b}", sp::uint128_t(1) << 64);
+        TEST_FORMAT("{:j}", "{:j}", max);
     }
+#endif
 
     TEST_CASE("Float formats")
     {
@@ -284,6 +800,7 @@ int main()
         TEST_FORMAT("-INF", "{:F}", -INFINITY);
 
         TEST_FORMAT("1", "{}", 1.0);
+        TEST_FORMAT("0", "{}", -0.0);
         TEST_FORMAT("1.5", "{}", 1.5f);
         TEST_FORMAT("1.79769313486232e+308", "{}", DBL_MAX);
         TEST_FORMAT("1.17549e-38", "{}", FLT_MIN);
@@ -380,6 +897,65 @@ int main()
         }
     }
 
+    TEST_CASE("Escaped string formats")
+    {
+        TEST_FORMAT("\"plain\"", "{:j}", "plain");
+        TEST_FORMAT("\"a\\\"b\\\\c\\n\\t\\u0001\x7f\xc3\xa9\"", "{:j}", "a\"b\\c\n\t\x01\x7f\xc3\xa9");
+        TEST_FORMAT("\"\\a\\v\\001\\177\"", "{:q}", "\a\v\x01\x7f");
+        TEST_FORMAT("plain", "{:csv}", "plain");
+        TEST_FORMAT("\"a,b\"", "{:csv}", "a,b");
+        TEST_FORMAT("\"say \"\"hi\"\"\n\"", "{:csv}", "say \"hi\"\n");
+        TEST_FORMAT("\"\"", "{:j}", "");
+        TEST_FORMAT("\"ab\"", "{:.2j}", "abc\n");
+        TEST_FORMAT("  \"a\\nb\"", "{:>8j}", "a\nb");
+        TEST_FORMAT("\"a,b\"..", "{:.<7csv}", "a,b");
+
+        // long strings are scanned in blocks, escapes may be anywhere
+        for (int i = 0; i < 40; ++i) {
+            std::string str(40, 'x');
+            str[i] = '"';
+            std::string expected = "\"" + str.substr(0, i) + "\\\"" + str.substr(i + 1) + "\"";
+            TEST_FORMAT(expected.c_str(), "{:j}", str.c_str());
+        }
+
+        // escaping only applies to strings
+        TEST_FORMAT("{:j}", "{:j}", 1);
+        TEST_FORMAT("{:q}", "{:q}", 1.0);
+        TEST_FORMAT("{:csv}", "{:csv}", true);
+        TEST_FORMAT("{:v}", "{:v}", "a");
+        TEST_FORMAT("{:csvx}", "{:csvx}", "a");
+    }
+
+    TEST_CASE("Decimal formats")
+    {
+        // the scale determines the default amount of decimals
+        TEST_FORMAT("123.45", "{}", sp::decimal(12345, 2));
+        TEST_FORMAT("-0.005", "{}", sp::decimal(-5, 3));
+        TEST_FORMAT("42000", "{}", sp::decimal(42, -3));
+        TEST_FORMAT("0", "{}", sp::decimal(0, -3));
+        TEST_FORMAT("-9223372036854775808", "{}", sp::decimal(INT64_MIN, 0));
+        TEST_FORMAT("0.000000000000000000000000000001", "{}", sp::decimal(1, 30));
+
+        // rounds half away from zero, or pads with zeros
+        TEST_FORMAT("123.5", "{:.1f}", sp::decimal(12345, 2));
+        TEST_FORMAT("-1.3", "{:.1f}", sp::decimal(-125, 2));
+        TEST_FORMAT("1", "{:.0f}", sp::decimal(INT64_MAX, 19));
+        TEST_FORMAT("0.00", "{:.2f}", sp::decimal(INT64_MAX, 25));
+        TEST_FORMAT("0.7000", "{:.4}", sp::decimal(7, 1));
+        TEST_FORMAT("1.", "{:#.0f}", sp::decimal(125, 2));
+
+        // grouping, percentages, sign and alignment
+        TEST_FORMAT("123,456,789.012", "{:,}", sp::decimal(123456789012, 3));
+        TEST_FORMAT("-9_223_372_036_854_775.81", "{:_.2f}", sp::decimal(INT64_MIN, 3));
+        TEST_FORMAT("  1,234,567.89", "{:>14,.2f}", sp::decimal(123456789, 2));
+        TEST_FORMAT("12.34% 12.6%", "{:%} {:.1%}", sp::decimal(1234, 4), sp::decimal(1255, 4));
+        TEST_FORMAT("+1.5|1.5  | 1.5 |-001.50", "{:+}|{:<5}|{:^5}|{:07.2f}", sp::decimal(15, 1), sp::decimal(15, 1), sp::decimal(15, 1), sp::decimal(-15, 1));
+
+        // other presentations, and grouping for other types, are invalid
+        TEST_FORMAT("{:e} {:x}", "{:e} {:x}", sp::decimal(1, 0), sp::decimal(1, 0));
+        TEST_FORMAT("{:,} {:_} {:,s}", "{:,} {:_} {:,s}", 1.5, 2, "a");
+    }
+
     TEST_CASE("StringWriter") {
         char buffer[64];
         sp::StringWriter writer(buffer, sizeof(buffer));
@@ -395,6 +971,330 @@ int main()
         REQUIRE(writer.result() == sizeof(data) * 3);
     }
 
+    TEST_CASE("Truncated formatting") {
+        char buffer[8];
+        int count = 0;
+
+        // fits exactly
+        auto result = sp::format_truncated(buffer, sizeof(buffer), "{}-{}", 123, "abc");
+        REQUIRE(result.length == 7);
+        REQUIRE(result.position == 5);
+        REQUIRE(!result.truncated);
+
+        // stops in the middle of a field, without formatting the rest
+        result = sp::format_truncated(buffer, sizeof(buffer), "ab{:>20}{}{}", 1, Counted{ &count }, Counted{ &count });
+        REQUIRE(result.length == 8);
+        REQUIRE(result.position == 2);
+        REQUIRE(result.truncated);
+        REQUIRE(std::memcmp(buffer, "ab      ", 8) == 0);
+        REQUIRE(count == 0);
+
+        // stops in literal text
+        result = sp::format_truncated(buffer, sizeof(buffer), "{}{} and then some", Counted{ &count }, 1);
+        REQUIRE(result.length == 8);
+        REQUIRE(result.position == 4);
+        REQUIRE(result.truncated);
+        REQUIRE(count == 1);
+
+        // the regular format keeps counting
+        REQUIRE(sp::format(buffer, "{}{} and then some", Counted{ &count }, 1) == 22);
+        REQUIRE(count == 2);
+    }
+
+    TEST_CASE("Fixed strings") {
+        // matches the regular format
+        auto result = sp::format_to_fixed<64>("{:>4}|{:<6}|{:^7}|{:+08d}|{:#b}", "id", "name", 'c', -42, 5u);
+        REQUIRE(std::strcmp(result.c_str(), "  id|name  |   c   |-0000042|0b101") == 0);
+        REQUIRE(result.size() == 34);
+
+        // literal text, escapes and unsupported fields are written as-is
+        result = sp::format_to_fixed<64>("{{{}}} {name} {:{}} {5}", false, 3);
+        REQUIRE(std::strcmp(result.c_str(), "{false} {name} {:{}} {5}") == 0);
+
+        // truncates, and stays null-terminated
+        const auto truncated = sp::format_to_fixed<5>("{}", 1234567);
+        REQUIRE(std::strcmp(truncated.c_str(), "12345") == 0);
+        REQUIRE(truncated.capacity() == 5);
+    }
+
+#if defined(SP_HAS_CONSTEXPR)
+    TEST_CASE("Fixed formatting") {
+        // extremes fill up the computed capacity without truncating
+        const auto ints = sp::format_fixed(SP_STRING("{}|{:#b}|{:c}"), INT64_MIN, UINT64_MAX, char32_t(0x10ffff));
+        char expected[1024];
+        const auto expectedLen = sp::format(expected, "{}|{:#b}|{:c}", INT64_MIN, UINT64_MAX, char32_t(0x10ffff));
+        REQUIRE(ints.size() == size_t(expectedLen));
+        REQUIRE(std::memcmp(ints.c_str(), expected, ints.size()) == 0);
+
+        // signed minimums need one more digit than their value bits
+        const auto minimums = sp::format_fixed(SP_STRING("{:#b}|{:#o}|{:#b}|{:#o}"), int8_t(-128), int8_t(-128), INT64_MIN, INT64_MIN);
+        const auto minimumsLen = sp::format(expected, "{:#b}|{:#o}|{:#b}|{:#o}", int8_t(-128), int8_t(-128), INT64_MIN, INT64_MIN);
+        REQUIRE(minimums.size() == size_t(minimumsLen));
+        REQUIRE(std::memcmp(minimums.c_str(), expected, minimums.size()) == 0);
+        REQUIRE(std::memcmp(minimums.c_str(), "-0b10000000|-0o200|", 19) == 0);
+
+#if defined(SP_HAS_INT128)
+        const auto int128Min = -(sp::int128_t(1) << 126) - (sp::int128_t(1) << 126);
+        const auto wide = sp::format_fixed(SP_STRING("{:#b}"), int128Min);
+        REQUIRE(wide.size() == 131);
+        REQUIRE(wide.size() == size_t(sp::format(expected, "{:#b}", int128Min)));
+        REQUIRE(std::memcmp(wide.c_str(), expected, wide.size()) == 0);
+#endif
+
+        const auto floats = sp::format_fixed(SP_STRING("{:f}|{:.3e}|{}"), -DBL_MAX, -FLT_MAX, -DBL_MIN);
+        REQUIRE(floats.size() == size_t(sp::format(expected, "{:f}|{:.3e}|{}", -DBL_MAX, -FLT_MAX, -DBL_MIN)));
+        REQUIRE(floats.size() <= floats.capacity());
+
+        const auto decimals = sp::format_fixed(SP_STRING("{:,.2f}"), sp::decimal(INT64_MIN, -19));
+        REQUIRE(decimals.size() == size_t(sp::format(expected, "{:,.2f}", sp::decimal(INT64_MIN, -19))));
+        REQUIRE(std::memcmp(decimals.c_str(), expected, decimals.size()) == 0);
+
+        const auto strings = sp::format_fixed(SP_STRING("{:.4j} {:>6.2}"), "\x01\x02\x03\x04\x05", "abc");
+        REQUIRE(std::strcmp(strings.c_str(), "\"\\u0001\\u0002\\u0003\\u0004\"     ab") == 0);
+    }
+
+#endif
+    TEST_CASE("Format cursor") {
+        std::string large(300, 'x');
+        large += "end";
+        const auto largeView = sp::StringView(large.data(), int32_t(large.size()));
+
+        const char* fmt = "a{{{}}} {:>{}} [{:^9}] {} {:{}.{}f}|{";
+        char expected[512];
+        const auto expectedLen = sp::format(expected, fmt, 42, "mid", 6, "ctr", largeView, 1.5, 8, 2);
+
+        for (size_t chunkSize = 1; chunkSize < 40; ++chunkSize) {
+            auto cursor = sp::make_cursor(fmt, 42, "mid", 6, "ctr", largeView, 1.5, 8, 2);
+            std::string actual;
+            char chunk[40];
+            size_t chunkLen;
+
+            do {
+                chunkLen = cursor.next(chunk, chunkSize);
+                REQUIRE(chunkLen == chunkSize || cursor.done());
+                actual.append(chunk, chunkLen);
+            } while (!cursor.done());
+
+            REQUIRE(actual == std::string(expected, size_t(expectedLen)));
+        }
+
+        // fields spanning chunks are only formatted once
+        int count = 0;
+        auto cursor = sp::make_cursor("<{}>", Counted{ &count });
+        char chunk[2];
+        std::string actual;
+        REQUIRE(cursor.next(chunk, 0) == 0);
+
+        while (!cursor.done()) {
+            actual.append(chunk, cursor.next(chunk, sizeof(chunk)));
+        }
+
+        REQUIRE(actual == "<counted>");
+        REQUIRE(count == 1);
+
+        // fields much larger than a chunk plus the spill buffer are formatted
+        // again for each chunk, rather than buffered
+        const std::string huge(200000, 'y');
+        const std::string quotes(5000, '"');
+        std::string hugeExpected = "[" + huge + "] " + std::string(65532, ' ') + "pad \"";
+
+        for (size_t i = 0; i < quotes.size(); ++i) {
+            hugeExpected += "\\\"";
+        }
+
+        hugeExpected += "\"";
+
+        auto hugeCursor = sp::make_cursor("[{}] {:>65535} {:q}",
+            sp::StringView(huge.data(), int32_t(huge.size())), "pad",
+            sp::StringView(quotes.data(), int32_t(quotes.size())));
+        REQUIRE(sizeof(hugeCursor) < 1024);
+        std::string hugeActual;
+        char hugeChunk[100];
+
+        while (!hugeCursor.done()) {
+            const auto chunkLen = hugeCursor.next(hugeChunk, sizeof(hugeChunk));
+            REQUIRE(chunkLen == sizeof(hugeChunk) || hugeCursor.done());
+            hugeActual.append(hugeChunk, chunkLen);
+        }
+
+        REQUIRE(hugeActual == hugeExpected);
+    }
+
+    TEST_CASE("BufferWriter") {
+        sp::BufferWriter writer;
+        std::string expected;
+
+        for (int i = 0; i < 1000; ++i) {
+            sp::format(writer, "{},", i);
+            expected += std::to_string(i) + ",";
+        }
+
+        REQUIRE(writer.result() == int32_t(expected.size()));
+        REQUIRE(std::string(writer.data(), writer.size()) == expected);
+
+        writer.clear();
+        REQUIRE(writer.size() == 0);
+    }
+
+    TEST_CASE("Parallel formatting") {
+        std::vector<std::tuple<int, const char*>> records;
+
+        for (int i = 0; i < 1000; ++i) {
+            records.push_back(std::make_tuple(i, (i & 1) ? "odd" : "even"));
+        }
+
+        sp::BufferWriter sequential;
+
+        for (const auto& record : records) {
+            sp::format(sequential, "{:>4} {}\n", std::get<0>(record), std::get<1>(record));
+        }
+
+        const std::string expected(sequential.data(), sequential.size());
+
+        // more threads than records, and a thread count that doesn't evenly
+        // divide the records, should both work
+        const int32_t threadCounts[] = { 0, 1, 3, 4, 2000 };
+
+        for (const auto threads : threadCounts) {
+            sp::BufferWriter parallel;
+            sp::format_parallel(parallel, "{:>4} {}\n", records, threads);
+            REQUIRE(std::string(parallel.data(), parallel.size()) == expected);
+        }
+
+        // non-tuple records are formatted as a single argument
+        const int values[] = { 1, 2, 3, 4, 5 };
+        char buffer[16];
+        sp::StringWriter writer(buffer, sizeof(buffer));
+        sp::format_parallel(writer, "{}.", values, 5, 2);
+        REQUIRE(writer.result() == 10);
+        REQUIRE(std::memcmp(buffer, "1.2.3.4.5.", 10) == 0);
+    }
+
+    TEST_CASE("Writer adapters") {
+        // tee to two sinks, hashing and counting on the way
+        sp::BufferWriter first;
+        char buffer[8];
+        sp::StringWriter second(buffer, sizeof(buffer), true);
+        auto tee = sp::make_tee(first, second);
+        auto crc = sp::make_hash_writer<sp::Crc32>(tee);
+        auto limit = sp::make_limit_writer(crc);
+
+        sp::format(limit, "{} {}!", "Hello", "World");
+        REQUIRE(first.size() == 12);
+        REQUIRE(std::memcmp(first.data(), "Hello World!", 12) == 0);
+        REQUIRE(second.result() == 8);
+        REQUIRE(second.truncated());
+        REQUIRE(!tee.stopped());
+        REQUIRE(limit.count() == 12);
+        REQUIRE(crc.hash() == 0x1c291ca3u);
+
+        // the CRC doesn't depend on how the output is split up
+        sp::Crc32 whole;
+        sp::Crc32 pieces;
+        const char data[] = "The quick brown fox jumps over the lazy dog";
+        whole.update(data, sizeof(data) - 1);
+        for (size_t i = 0; i < sizeof(data) - 1; i += 3) {
+            pieces.update(data + i, std::min<size_t>(3, sizeof(data) - 1 - i));
+        }
+        REQUIRE(whole.value() == 0x414fa339u);
+        REQUIRE(pieces.value() == whole.value());
+
+        sp::NullWriter null;
+        auto fnv = sp::make_hash_writer<sp::Fnv1a64>(null);
+        sp::format(fnv, "{}", "a");
+        REQUIRE(fnv.hash() == 0xaf63dc4c8601ec8cull);
+
+        // the limit stops formatting early
+        sp::BufferWriter limited;
+        sp::IWriter& base = limited;
+        auto limitWriter = sp::make_limit_writer(base, 5);
+        sp::format(limitWriter, "{}{}{}", "abc", "def", "ghi");
+        REQUIRE(limited.size() == 5);
+        REQUIRE(std::memcmp(limited.data(), "abcde", 5) == 0);
+        REQUIRE(limitWriter.truncated());
+        REQUIRE(limitWriter.count() == 6);
+
+        // writers that aren't final are called virtually, so they may be
+        // referenced through an abstract base
+        struct Sink : sp::IWriter {
+            virtual void reset() = 0;
+        };
+
+        struct StringSink final : Sink {
+            std::string str;
+
+            size_t write(size_t length, const void* data) override
+            {
+                str.append(static_cast<const char*>(data), length);
+                return length;
+            }
+
+            void reset() override
+            {
+                str.clear();
+            }
+        };
+
+        StringSink sink;
+        Sink& abstract = sink;
+        auto abstractLimit = sp::make_limit_writer(abstract, 4);
+        sp::format(abstractLimit, "{}", "abcdef");
+        REQUIRE(sink.str == "abcd");
+
+        auto finalLimit = sp::make_limit_writer(sink);
+        sp::format(finalLimit, "{}", "gh");
+        REQUIRE(sink.str == "abcdgh");
+    }
+
+#if defined(SP_ENABLE_ZLIB)
+    TEST_CASE("DeflateWriter") {
+        sp::BufferWriter compressed;
+        std::string expected;
+
+        {
+            sp::DeflateWriter writer(compressed);
+
+            for (int i = 0; i < 20000; ++i) {
+                char line[64];
+                std::snprintf(line, sizeof(line), "row %d,%x,%s\n", i, i * 7, "value");
+                expected += line;
+
+                sp::format(writer, "row {},{:x},{}\n", i, i * 7, "value");
+            }
+
+            // a single write larger than the staging buffer
+            const std::string large(100000, 'z');
+            expected += large;
+            writer.write(large.size(), large.data());
+
+            REQUIRE(writer.finish());
+            REQUIRE(writer.stopped());
+            REQUIRE(writer.input_size() == expected.size());
+            REQUIRE(writer.output_size() == compressed.size());
+            REQUIRE(compressed.size() < expected.size() / 4);
+        }
+
+        // gzip magic, followed by the compressed data
+        REQUIRE(compressed.size() > 2);
+        REQUIRE(uint8_t(compressed.data()[0]) == 0x1f);
+        REQUIRE(uint8_t(compressed.data()[1]) == 0x8b);
+
+        z_stream stream = {};
+        REQUIRE(inflateInit2(&stream, 15 + 16) == Z_OK);
+
+        std::string actual(expected.size() + 1, '\0');
+        stream.next_in = (Bytef*)compressed.data();
+        stream.avail_in = uInt(compressed.size());
+        stream.next_out = (Bytef*)&actual[0];
+        stream.avail_out = uInt(actual.size());
+        REQUIRE(inflate(&stream, Z_FINISH) == Z_STREAM_END);
+        actual.resize(stream.total_out);
+        inflateEnd(&stream);
+
+        REQUIRE(actual == expected);
+    }
+#endif
+
     // This should work on other platforms too, but only linux implements
     // fmemopen, which makes this a lot easier to test. Since we're only
     // really testing our own logic, and not that of the CRT, it should be
@@ -415,6 +1315,214 @@ int main()
         size_t written = writer.write(sizeof(data), data);
         REQUIRE(written == sizeof(data));
     }
+
+    TEST_CASE("FdWriter") {
+        int fds[2];
+        REQUIRE(pipe(fds) == 0);
+
+        std::string payload(1000, 'z');
+        std::string expected;
+
+        {
+            sp::FdWriter writer(fds[1]);
+
+            // enough fields to run out of both segments and arena, while
+            // staying below the capacity of the pipe
+            for (int i = 0; i < 40; ++i) {
+                sp::format(writer, "{}:{:>4}:{}\n", "line", i, sp::StringView(payload.data(), int32_t(payload.size())));
+                expected += "line:" + std::string(i < 10 ? "   " : "  ") + std::to_string(i) + ":" + payload + "\n";
+            }
+
+            // larger than the arena, and not referenced
+            writer.write(payload.size(), payload.data());
+            expected += payload;
+
+            // string arguments are copied, as they may not outlive the call
+            std::string reused;
+            for (int i = 0; i < 4; ++i) {
+                reused.assign(100, char('a' + i));
+                sp::format(writer, "{}|{:>3}\n", reused.c_str(), sp::StringView(reused.data(), 2));
+                expected += reused + "| " + reused.substr(0, 2) + "\n";
+            }
+
+            REQUIRE(writer.flush());
+            REQUIRE(writer.result() == int32_t(expected.size()));
+        }
+
+        close(fds[1]);
+
+        std::string actual;
+        char buffer[4096];
+        ssize_t nread;
+
+        while ((nread = read(fds[0], buffer, sizeof(buffer))) > 0) {
+            actual.append(buffer, size_t(nread));
+        }
+
+        close(fds[0]);
+        REQUIRE(actual == expected);
+    }
+
+    TEST_CASE("AsyncFileWriter") {
+        const sp::AsyncFileWriter::Backend backends[] = {
+            sp::AsyncFileWriter::BACKEND_URING,
+            sp::AsyncFileWriter::BACKEND_PWRITE,
+        };
+
+        // appends land wherever the file ends, so must stay in order
+        for (int i = 0; i < 4; ++i) {
+            const auto backend = backends[i % 2];
+            const bool isAppend = i >= 2;
+            char path[] = "/tmp/sp-test-XXXXXX";
+            const int fd = mkstemp(path);
+            REQUIRE(fd >= 0);
+            unlink(path);
+            REQUIRE(!isAppend || fcntl(fd, F_SETFL, O_APPEND) == 0);
+
+            std::string expected;
+
+            {
+                sp::AsyncFileWriter writer(fd, 0, backend);
+                REQUIRE(backend == sp::AsyncFileWriter::BACKEND_URING || writer.backend() == backend);
+
+                // without io_uring, both passes test the fallback
+                if (writer.backend() != backend) {
+                    std::printf("AsyncFileWriter: io_uring unavailable, tested pwrite instead\n");
+                }
+
+                // enough output to cycle through all buffers several times
+                for (int i = 0; i < 20000; ++i) {
+                    char line[64];
+                    std::snprintf(line, sizeof(line), "record %6d payload\n", i);
+                    expected += line;
+
+                    sp::format(writer, "record {:>6} {}\n", i, "payload");
+                }
+
+                REQUIRE(writer.flush());
+                REQUIRE(writer.result() == int64_t(expected.size()));
+            }
+
+            std::string actual(expected.size(), '\0');
+            REQUIRE(pread(fd, &actual[0], actual.size(), 0) == ssize_t(actual.size()));
+            close(fd);
+
+            REQUIRE(actual == expected);
+        }
+    }
+
+    // Budgets are for the unoptimized test build; see the README for the
+    // footprint of optimized builds. Floats go through `snprintf`, which
+    // accounts for most of theirs.
+    TEST_CASE("Stack usage") {
+        static char buffer[1024];
+        REQUIRE(stack_high_water([] { sp::format(buffer, "{}", 42); }) < 1536);
+        REQUIRE(stack_high_water([] { sp::format(buffer, "{:>+#20x}", 42); }) < 2048);
+        REQUIRE(stack_high_water([] { sp::format(buffer, "{:,.2f}", sp::decimal(123456789, 3)); }) < 2048);
+        REQUIRE(stack_high_water([] { sp::format(buffer, "{:j}", "a\"b"); }) < 3072);
+        REQUIRE(stack_high_water([] { sp::format(buffer, "{}", 1.5); }) < 5120);
+        REQUIRE(stack_high_water([] { sp::format(buffer, "{:>{}.{}f}", 1.5, 10, 2); }) < 6144);
+        REQUIRE(stack_high_water([] { sp::format(buffer, "[{}] {} took {} ms ({})", 1, "request", 0.5, true); }) < 6144);
+
+        // output that doesn't fit the float buffer is still complete
+        sp::format(buffer, "{:.600f}", 1e300);
+        REQUIRE(std::strlen(buffer) == 301 + 1 + 600);
+    }
+#endif
+
+#if defined(SP_ENABLE_IOSTREAMS)
+    TEST_CASE("iostream adapters") {
+        std::ostringstream stream;
+        stream << "count: ";
+
+        sp::OStreamWriter writer(stream.rdbuf());
+        sp::format(writer, "{:>4}|{:x}", 42, 255);
+        REQUIRE(writer.result() == 7);
+        REQUIRE(stream.str() == "count:   42|ff");
+
+        // small writes are buffered until flushed, larger ones go straight
+        // through to the writer
+        sp::BufferWriter output;
+        const std::string large(600, 'x');
+        {
+            sp::WriterStreambuf buffer(output);
+            std::ostream out(&buffer);
+
+            out << "id=" << 7 << ' ' << 1.5;
+            REQUIRE(output.size() == 0);
+            out << std::flush;
+            REQUIRE(output.size() == 8);
+            REQUIRE(std::memcmp(output.data(), "id=7 1.5", 8) == 0);
+
+            out << '|' << large;
+            REQUIRE(output.size() == 609);
+            out << "tail";
+        }
+        REQUIRE(output.size() == 613);
+        REQUIRE(std::memcmp(output.data() + 609, "tail", 4) == 0);
+
+        // writers that stop fail the stream
+        char small[8];
+        sp::StringWriter full(small, sizeof(small), true);
+        sp::WriterStreambuf buffer(full);
+        std::ostream out(&buffer);
+        out << "longer than eight" << std::flush;
+        REQUIRE(out.bad());
+    }
+#endif
+
+#if defined(SP_ENABLE_THREADS)
+    TEST_CASE("Concurrent printing") {
+        static const int THREADS = 4;
+        static const int LINES = 2000;
+
+        std::FILE* direct = std::tmpfile();
+        std::FILE* batched = std::tmpfile();
+        REQUIRE(direct && batched);
+
+        {
+            // small enough to be flushed many times
+            sp::SharedBuffer shared(batched, 256);
+            std::vector<std::thread> threads;
+
+            for (int t = 0; t < THREADS; ++t) {
+                threads.emplace_back([&, t] {
+                    for (int i = 0; i < LINES; ++i) {
+                        sp::format(direct, "thread {} line {:>5} {}\n", t, i, "end");
+                        sp::format(shared, "thread {} line {:>5} {}\n", t, i, "end");
+                    }
+                });
+            }
+
+            for (auto& thread : threads) {
+                thread.join();
+            }
+
+            REQUIRE(!shared.failed());
+        }
+
+        // every line is intact, and each thread's lines are in order
+        for (std::FILE* file : { direct, batched }) {
+            std::rewind(file);
+            int next[THREADS] = {};
+            int t;
+            int i;
+
+            while (std::fscanf(file, "thread %d line %d end\n", &t, &i) == 2) {
+                REQUIRE(t >= 0 && t < THREADS);
+                REQUIRE(next[t] == i);
+                ++next[t];
+            }
+
+            REQUIRE(std::feof(file));
+
+            for (int n : next) {
+                REQUIRE(n == LINES);
+            }
+
+            std::fclose(file);
+        }
+    }
 #endif
 
     if (!s_failed) {
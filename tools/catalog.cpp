@@ -0,0 +1,131 @@
+// sp - string formatting micro-library
+//
+// Written in 2017 by Johan Sköld
+//
+// To the extent possible under law, the author(s) have dedicated all
+// copyright and related and neighboring rights to this software to the public
+// domain worldwide. This software is distributed without any warranty.
+//
+// You should have received a copy of the CC0 Public Domain Dedication along
+// with this software. If not, see <http://creativecommons.org/publicdomain/zero/1.0/>.
+
+// Build a binary format catalog for `sp::Catalog` from a text catalog, with
+// one `key<TAB>format` entry per line. Empty lines and lines starting with
+// `#` are skipped, and `\n`, `\t` and `\\` in formats are unescaped.
+//
+//     sp-catalog <input> <output>
+
+#include <cstdio> // std::fopen, std::fgets, std::fprintf
+#include <string> // std::string
+#include <vector> // std::vector
+
+#include "../include/sp.hpp"
+
+static std::string unescape(const std::string& str)
+{
+    std::string result;
+
+    for (size_t i = 0; i < str.size(); ++i) {
+        if (str[i] != '\\' || i + 1 == str.size()) {
+            result += str[i];
+            continue;
+        }
+
+        switch (str[++i]) {
+        case 'n':
+            result += '\n';
+            break;
+        case 't':
+            result += '\t';
+            break;
+        default:
+            result += str[i];
+            break;
+        }
+    }
+
+    return result;
+}
+
+int main(int argc, char* argv[])
+{
+    if (argc != 3) {
+        std::fprintf(stderr, "usage: %s <input> <output>\n", argv[0]);
+        return 2;
+    }
+
+    std::FILE* input = std::fopen(argv[1], "rb");
+
+    if (!input) {
+        std::fprintf(stderr, "%s: can't open %s\n", argv[0], argv[1]);
+        return 1;
+    }
+
+    std::vector<std::string> keys;
+    std::vector<std::string> formats;
+    std::string line;
+    int32_t lineNumber = 0;
+    bool isValid = true;
+
+    for (int ch = 0; ch != EOF;) {
+        line.clear();
+
+        while ((ch = std::fgetc(input)) != EOF && ch != '\n') {
+            line += char(ch);
+        }
+
+        ++lineNumber;
+
+        if (!line.empty() && line.back() == '\r') {
+            line.pop_back();
+        }
+
+        if (line.empty() || line[0] == '#') {
+            continue;
+        }
+
+        const auto tab = line.find('\t');
+
+        if (tab == std::string::npos) {
+            std::fprintf(stderr, "%s:%d: expected `key<TAB>format`\n", argv[1], lineNumber);
+            isValid = false;
+            continue;
+        }
+
+        keys.push_back(line.substr(0, tab));
+        formats.push_back(unescape(line.substr(tab + 1)));
+    }
+
+    std::fclose(input);
+
+    if (!isValid) {
+        return 1;
+    }
+
+    std::vector<sp::StringView> keyViews;
+    std::vector<sp::StringView> formatViews;
+
+    for (size_t i = 0; i < keys.size(); ++i) {
+        keyViews.emplace_back(keys[i].data(), int32_t(keys[i].size()));
+        formatViews.emplace_back(formats[i].data(), int32_t(formats[i].size()));
+    }
+
+    sp::BufferWriter catalog;
+
+    if (!sp::write_catalog(catalog, keyViews.data(), formatViews.data(), keys.size())) {
+        std::fprintf(stderr, "%s: repeated key, or the catalog is too large\n", argv[1]);
+        return 1;
+    }
+
+    std::FILE* output = std::fopen(argv[2], "wb");
+
+    if (!output
+        || catalog.result() < 0
+        || std::fwrite(catalog.data(), 1, catalog.size(), output) != catalog.size()
+        || std::fclose(output)) {
+        std::fprintf(stderr, "%s: can't write %s\n", argv[0], argv[2]);
+        return 1;
+    }
+
+    return 0;
+}